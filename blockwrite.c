@@ -0,0 +1,70 @@
+/* Block programming, shared by the SWIM programmers
+ *
+ * With diff set the range is read first (through pgm->read_range): blocks
+ * that already hold the new data are skipped, and blocks that are erased
+ * (all bytes 0x00) are written in fast mode, which skips the erase.
+ * A partial last block is completed with its current contents, or with
+ * zeroes if the range was not read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockwrite.h"
+#include "utils.h"
+
+int blockwrite_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype, bool diff, blockwrite_cb write_block) {
+	unsigned int block_size = device->flash_block_size;
+	unsigned int rounded_size = ((length - 1) / block_size + 1) * block_size;
+	unsigned char *current = NULL, *block = malloc(block_size);
+	unsigned int i, j, n;
+
+	if (!block || (diff && !(current = malloc(rounded_size)))) {
+		fprintf(stderr, "malloc failed\n");
+		free(block);
+		return(0);
+	}
+	if (diff && pgm->read_range(pgm, device, current, start, rounded_size) < (int)rounded_size) {
+		free(current);
+		free(block);
+		return(0);
+	}
+
+	DEBUG_PRINT("write range: block program with block size = %d\n", block_size);
+
+	for (i = 0; i < length; i += block_size) {
+		int prgmode = 0x01;
+
+		n = (length - i < block_size ? length - i : block_size);
+		memcpy(block, buffer + i, n);
+		if (n < block_size) {
+			if (current)
+				memcpy(block + n, current + i + n, block_size - n);
+			else
+				memset(block + n, 0, block_size - n);
+		}
+
+		if (current) {
+			if (!memcmp(current + i, block, block_size) && !pgm->force_write) {
+				DEBUG_PRINT("no change 0x%04x to 0x%04x\n", start + i, start + i + block_size);
+				continue;
+			}
+			if (memtype == FLASH || memtype == EEPROM) {
+				prgmode = 0x10;
+				for (j = 0; j < block_size; j++) {
+					if (current[i + j]) {
+						prgmode = 0x01;
+						break;
+					}
+				}
+			}
+		}
+
+		DEBUG_PRINT("%swrite 0x%04x to 0x%04x\n", (prgmode == 0x10 ? "fast " : ""), start + i, start + i + block_size);
+		if (write_block(pgm, device, block, start + i, prgmode, memtype))
+			break;
+	}
+	free(current);
+	free(block);
+	return(i < length ? i : length);
+}
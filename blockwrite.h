@@ -0,0 +1,13 @@
+#ifndef __BLOCKWRITE_H
+#define __BLOCKWRITE_H
+
+#include <stdbool.h>
+#include "pgm.h"
+
+/* Programs one flash_block_size block at addr in the given FLASH_CR2
+ * programming mode (0x01 standard, 0x10 fast). Returns 0 on success. */
+typedef int (*blockwrite_cb)(programmer_t *pgm, const stm8_device_t *device, unsigned char *block, unsigned int addr, int prgmode, const memtype_t memtype);
+
+int blockwrite_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype, bool diff, blockwrite_cb write_block);
+
+#endif
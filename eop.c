@@ -0,0 +1,91 @@
+/* End of programming detection, shared by the SWIM programmers
+ *
+ * Instead of sleeping for the datasheet's worst case t_prog the wait starts
+ * polling FLASH_IAPSR shortly before the programming time observed so far in
+ * this session is up, separately for each programming mode. Until a mode has
+ * been seen, polling starts right away.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include "eop.h"
+#include "utils.h"
+
+#define EOP_POLL_US       50     // pause between IAPSR reads
+#define EOP_TIMEOUT_US    100000 // t_prog is 6.6ms max, leave room for slow links
+#define EOP_EARLY_PERCENT 75     // start polling at this share of the learned time
+
+static const char *eop_mode_name[PGM_EOP_MODES] = {
+	"byte",
+	"standard block",
+	"fast block",
+};
+
+eop_mode_t eop_mode(unsigned char prgmode) {
+	return(prgmode == 0x10 ? EOP_FAST : EOP_STANDARD);
+}
+
+static void eop_learn(pgm_eop_timing_t *t, unsigned long long us) {
+	if(!t->count || us < t->min_us)
+		t->min_us = us;
+	if(us > t->max_us)
+		t->max_us = us;
+	// Moving average, weighted towards the history so single slow polls do not dominate
+	t->learned_us = t->count ? (3 * t->learned_us + us) / 4 : us;
+	t->total_us += us;
+	t->count++;
+}
+
+int eop_wait(programmer_t *pgm, const stm8_device_t *device, eop_mode_t mode, eop_read_byte_cb read_byte) {
+	pgm_eop_timing_t *t = &pgm->eop_timing[mode];
+	unsigned long long start = time_us(), now;
+	int iapsr;
+
+	if(t->count)
+		usleep(t->learned_us * EOP_EARLY_PERCENT / 100);
+
+	for(;;) {
+		iapsr = read_byte(pgm, device->regs.FLASH_IAPSR);
+		now = time_us();
+		if(iapsr < 0)
+			return(EOP_IO_ERROR);
+		t->polls++;
+		// Reading IAPSR clears EOP and WR_PG_DIS, so both are checked on every read
+		if(iapsr & 0x04) {
+			eop_learn(t, now - start);
+			return(EOP_OK);
+		}
+		if(iapsr & 0x01) {
+			fprintf(stderr, "target page is write protected (UBC) or read-out protection is enabled\n");
+			return(EOP_WR_PG_DIS);
+		}
+		if(now - start > EOP_TIMEOUT_US) {
+			fprintf(stderr, "Timed out waiting for the end of programming\n");
+			return(EOP_TIMEOUT);
+		}
+		usleep(EOP_POLL_US);
+	}
+}
+
+int eop_clear(programmer_t *pgm, const stm8_device_t *device, eop_read_byte_cb read_byte) {
+	if(pgm->session.eop_cleared)
+		return(EOP_OK);
+	if(read_byte(pgm, device->regs.FLASH_IAPSR) < 0)
+		return(EOP_IO_ERROR);
+	pgm->session.eop_cleared = true;
+	return(EOP_OK);
+}
+
+void eop_print_stats(programmer_t *pgm) {
+	int mode;
+
+	for(mode = 0; mode < PGM_EOP_MODES; mode++) {
+		pgm_eop_timing_t *t = &pgm->eop_timing[mode];
+
+		if(!t->count)
+			continue;
+		fprintf(stderr, "Programming time, %s: %u writes, avg %llu us, min %llu us, max %llu us, learned %llu us, %.1f polls per write\n",
+			eop_mode_name[mode], t->count, t->total_us / t->count, t->min_us, t->max_us,
+			t->learned_us, (double)t->polls / t->count);
+	}
+}
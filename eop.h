@@ -0,0 +1,24 @@
+#ifndef __EOP_H
+#define __EOP_H
+
+#include "pgm.h"
+
+#define EOP_OK            0
+#define EOP_IO_ERROR      -1 // IAPSR could not be read
+#define EOP_WR_PG_DIS     -2 // write to a protected page
+#define EOP_TIMEOUT       -3
+
+/* Reads one byte of target memory, returns -1 on error. */
+typedef int (*eop_read_byte_cb)(programmer_t *pgm, unsigned int addr);
+
+eop_mode_t eop_mode(unsigned char prgmode);
+/* Waits for FLASH_IAPSR.EOP after a write was started. Returns EOP_OK or one
+ * of the errors above; protection errors and timeouts are reported here. */
+int eop_wait(programmer_t *pgm, const stm8_device_t *device, eop_mode_t mode, eop_read_byte_cb read_byte);
+/* Reads FLASH_IAPSR once per session, before the first write: EOP and
+ * WR_PG_DIS left over from earlier programming would otherwise be taken by
+ * eop_wait for the outcome of that write. Returns EOP_OK or EOP_IO_ERROR. */
+int eop_clear(programmer_t *pgm, const stm8_device_t *device, eop_read_byte_cb read_byte);
+void eop_print_stats(programmer_t *pgm);
+
+#endif
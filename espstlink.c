@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,36 +28,86 @@
 #include <unistd.h>
 #include "libespstlink.h"
 #include "pgm.h"
-#include "try.h"
+#include "regcache.h"
+#include "eop.h"
+#include "blockwrite.h"
 
 #define DM_CSR2 0x7F99
 
+// Prints the error of a failed library call; libespstlink prints nothing.
+// After an error the target may have been reset, which clears the CPU stall
+// bit among others, so no cached register value is trusted any more.
+static bool espstlink_check(programmer_t *pgm, bool ok) {
+  if (!ok) {
+    fprintf(stderr, "%s\n",
+            espstlink_get_last_error(pgm->espstlink)->message);
+    regcache_clear(pgm);
+  }
+  return ok;
+}
+
 static int espstlink_read_byte(programmer_t *pgm, unsigned int addr) {
   uint8_t byte;
-  if (!espstlink_swim_read(pgm->espstlink, &byte, addr, 1)) return -1;
+  if (!espstlink_check(pgm,
+                       espstlink_swim_read(pgm->espstlink, &byte, addr, 1)))
+    return -1;
   return byte;
 }
 
 static bool espstlink_write_byte(programmer_t *pgm, uint8_t byte,
                                  unsigned int addr) {
-  return espstlink_swim_write(pgm->espstlink, &byte, addr, 1);
+  regcache_invalidate(pgm, addr, 1);
+  return espstlink_check(pgm,
+                         espstlink_swim_write(pgm->espstlink, &byte, addr, 1));
+}
+
+// Reads a register the target does not change by itself, see regcache.h.
+static int espstlink_read_reg(programmer_t *pgm, unsigned int addr) {
+  unsigned char value;
+  int byte;
+  if (regcache_get(pgm, addr, &value)) return value;
+  byte = espstlink_read_byte(pgm, addr);
+  if (byte != -1) regcache_set(pgm, addr, byte);
+  return byte;
+}
+
+// Writes such a register, unless it already holds that value.
+static bool espstlink_write_reg(programmer_t *pgm, uint8_t byte,
+                                unsigned int addr) {
+  if (regcache_unchanged(pgm, addr, byte)) return 1;
+  if (!espstlink_write_byte(pgm, byte, addr)) return 0;
+  regcache_set(pgm, addr, byte);
+  return 1;
 }
 
 static bool espstlink_swim_reconnect(programmer_t *pgm) {
   int version = pgm->espstlink->version;
   bool ret = false;
 
-  // Enter reset state, if the programmer firmware supports this.
-  if (version > 0 && !espstlink_reset(pgm->espstlink, /*input=*/0, 1)) return 0;
-
-  if (!espstlink_swim_entry(pgm->espstlink)) return 0;
+  regcache_clear(pgm);
+  memset(&pgm->session, 0, sizeof(pgm->session));
 
-  if (!espstlink_swim_srst(pgm->espstlink)) return 0;
+  // Enter reset state, if the programmer firmware supports this.
+  if (version > 0 &&
+      !espstlink_check(pgm, espstlink_reset(pgm->espstlink, /*input=*/0, 1)))
+    return 0;
+
+  if (!espstlink_check(pgm, espstlink_swim_entry(pgm->espstlink))) return 0;
+  int cycles = pgm->espstlink->entry_cycles;
+  if (cycles < ESPSTLINK_ENTRY_CYCLES_MIN ||
+      cycles > ESPSTLINK_ENTRY_CYCLES_MAX)
+    fprintf(stderr,
+            "Warning: remote device took %d cycles (%d us) (expected: %d us)\n",
+            cycles, cycles / 80, 128 / 8);
+
+  if (!espstlink_check(pgm, espstlink_swim_srst(pgm->espstlink))) return 0;
   usleep(1);
   ret = espstlink_write_byte(pgm, 0xA0, 0x7f80);  // Init the SWIM_CSR.
 
   // Put the reset pin back into pullup state.
-  if (version > 0 && !espstlink_reset(pgm->espstlink, /*input=*/1, 0)) return 0;
+  if (version > 0 &&
+      !espstlink_check(pgm, espstlink_reset(pgm->espstlink, /*input=*/1, 0)))
+    return 0;
 
   return ret;
 }
@@ -64,70 +115,175 @@ static bool espstlink_swim_reconnect(programmer_t *pgm) {
 // Set / Unsets the STALL bit in the DM_CSR2 register. Stops / Resumes the CPU.
 static bool espstlink_stall(programmer_t *pgm, bool stall) {
   // Set the STALL bit in DM_CSR2, to stop any code from executing.
-  int csr = espstlink_read_byte(pgm, DM_CSR2);
+  int csr = espstlink_read_reg(pgm, DM_CSR2);
   if (csr == -1) return 0;
-  return espstlink_write_byte(pgm, stall ? csr | 8 : csr & ~8, DM_CSR2);
+  return espstlink_write_reg(pgm, stall ? csr | 8 : csr & ~8, DM_CSR2);
 }
 
 static bool espstlink_prepare_for_flash(programmer_t *pgm,
                                         const stm8_device_t *device,
                                         const memtype_t memtype) {
   if (!espstlink_stall(pgm, true)) return 0;
+  if (eop_clear(pgm, device, espstlink_read_byte)) return 0;
 
-  // Unlock MASS
-  if (memtype == FLASH) {
+  // Unlock MASS, once per session.
+  if (memtype == FLASH && !pgm->session.flash_unlocked) {
     if (!espstlink_write_byte(pgm, 0x56, device->regs.FLASH_PUKR)) return 0;
     if (!espstlink_write_byte(pgm, 0xae, device->regs.FLASH_PUKR)) return 0;
+    pgm->session.flash_unlocked = true;
   }
-  if (memtype == EEPROM || memtype == OPT) {
+  if ((memtype == EEPROM || memtype == OPT) && !pgm->session.data_unlocked) {
     if (!espstlink_write_byte(pgm, 0xae, device->regs.FLASH_DUKR)) return 0;
     if (!espstlink_write_byte(pgm, 0x56, device->regs.FLASH_DUKR)) return 0;
+    pgm->session.data_unlocked = true;
   }
+  pgm->session.device = device;
 
   return 1;
 }
 
-static void espstlink_wait_until_transfer_completes(
-    programmer_t *pgm, const stm8_device_t *device) {
-  // Wait for EOP to be set in FLASH_IAPSR
-  // provide a better error message than 'tries exceeded'
-  do {
-    int retries = 5;
-    int iapsr;
-    while (retries > 0) {
-      iapsr = espstlink_read_byte(pgm, device->regs.FLASH_IAPSR);
-      if (iapsr & 0x04) break;
-      if (iapsr & 0x01) {
-          ERROR("target page is write protected (UBC) or read-out protection is enabled");
-      }
-      retries--;
-      usleep(10000);
-    }
-  } while (0);
+// Reset DUL and PUL in IAPSR to disable flash and data writes.
+static void espstlink_session_lock(programmer_t *pgm) {
+  if (pgm->session.flash_unlocked || pgm->session.data_unlocked) {
+    int iapsr = espstlink_read_byte(pgm, pgm->session.device->regs.FLASH_IAPSR);
+    if (iapsr != -1)
+      espstlink_write_byte(pgm, iapsr & (~0x0a),
+                           pgm->session.device->regs.FLASH_IAPSR);
+  }
+  pgm->session.flash_unlocked = false;
+  pgm->session.data_unlocked = false;
 }
 
 int espstlink_swim_read_range(programmer_t *pgm, const stm8_device_t *device,
                               unsigned char *buffer, unsigned int start,
                               unsigned int length) {
-  size_t i = 0;
-  for (; i < length;) {
-    int current_size = length - i;
-    if (current_size > 255)
-      current_size = 255;
-    if (!espstlink_swim_read(pgm->espstlink, buffer + i, start + i,
-                             current_size))
-      return i;
-    i += current_size;
+  size_t i = 0, chunk = espstlink_max_size(pgm->espstlink);
+  while (i < length) {
+    // Queue as many chunks as possible, then collect them in one go.
+    size_t queued = i, done;
+    int chunks;
+    for (chunks = 0; chunks < ESPSTLINK_QUEUE_MAX && queued < length;
+         chunks++) {
+      size_t current_size = length - queued;
+      if (current_size > chunk)
+        current_size = chunk;
+      if (!espstlink_check(pgm, espstlink_queue_read(pgm->espstlink,
+                                                     buffer + queued,
+                                                     start + queued,
+                                                     current_size)))
+        return i;
+      queued += current_size;
+    }
+    // All chunks but the last one are full.
+    if (!espstlink_check(pgm, espstlink_flush(pgm->espstlink, &done)))
+      return i + done * chunk;
+    i = queued;
   }
   return i;
 }
 
-int espstlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device,
-                               unsigned char *buffer, unsigned int start,
-                               unsigned int length, const memtype_t memtype) {
+// Queues a register write, see espstlink_flush.
+static bool espstlink_queue_byte(programmer_t *pgm, const uint8_t *byte,
+                                 unsigned int addr) {
+  regcache_invalidate(pgm, addr, 1);
+  return espstlink_check(pgm,
+                         espstlink_queue_write(pgm->espstlink, byte, addr, 1));
+}
+
+// Sends the blocks collected by espstlink_frame_block. Returns 0 on success.
+static int espstlink_frame_flush(programmer_t *pgm,
+                                 const stm8_device_t *device) {
+  espstlink_flash_regs_t regs = {device->regs.FLASH_CR2,
+                                 device->regs.FLASH_NCR2,
+                                 device->regs.FLASH_IAPSR};
+  unsigned int size = device->flash_block_size;
+  unsigned int count = pgm->block_frame_count, written;
+
+  if (!count) return 0;
+  pgm->block_frame_count = 0;
+  regcache_invalidate(pgm, regs.cr2, 1);
+  regcache_invalidate(pgm, regs.ncr2, 1);
+  regcache_invalidate(pgm, pgm->block_frame_addr, count * size);
+  if (espstlink_check(pgm, espstlink_swim_write_blocks(
+                               pgm->espstlink, &regs, pgm->block_frame_mode,
+                               pgm->block_frame, pgm->block_frame_addr, size,
+                               count, &written)))
+    return 0;
+
+  if (!pgm->block_frame_failed) {
+    pgm->block_frame_failed = true;
+    pgm->block_frame_failed_addr = pgm->block_frame_addr + written * size;
+  }
+  espstlink_error_t *error = espstlink_get_last_error(pgm->espstlink);
+  if (error->code == ESPSTLINK_ERROR_PROGRAM && (error->device_code & 0x01))
+    fprintf(stderr, "target page is write protected (UBC) or read-out "
+                    "protection is enabled\n");
+  return -1;
+}
+
+// Collects consecutive blocks of one mode into a WRITE_BLOCKS frame, which
+// is sent once the next block doesn't fit.
+static int espstlink_frame_block(programmer_t *pgm,
+                                 const stm8_device_t *device,
+                                 unsigned char *block, unsigned int addr,
+                                 int prgmode) {
+  unsigned int size = device->flash_block_size;
+  unsigned int count = pgm->block_frame_count;
+
+  if (count && (addr != pgm->block_frame_addr + count * size ||
+                prgmode != pgm->block_frame_mode ||
+                (count + 1) * size > ESPSTLINK_FRAME_MAX || count == 0xFF)) {
+    if (espstlink_frame_flush(pgm, device)) return -1;
+    count = 0;
+  }
+  if (!count) {
+    pgm->block_frame_addr = addr;
+    pgm->block_frame_mode = prgmode;
+  }
+  memcpy(pgm->block_frame + count * size, block, size);
+  pgm->block_frame_count = count + 1;
+  return 0;
+}
+
+// Block writer for blockwrite_range.
+static int espstlink_write_block(programmer_t *pgm,
+                                 const stm8_device_t *device,
+                                 unsigned char *block, unsigned int addr,
+                                 int prgmode, const memtype_t memtype) {
+  uint8_t cr2 = prgmode, ncr2 = ~prgmode;
+
+  // Newer firmware programs whole runs of blocks by itself.
+  if (pgm->espstlink->version >= 3 && (memtype == FLASH || memtype == EEPROM))
+    return espstlink_frame_block(pgm, device, block, addr, prgmode);
+
+  // The mode registers and the block go out back to back.
+  if (memtype == FLASH || memtype == EEPROM) {
+    // Block programming mode
+    if (!espstlink_queue_byte(pgm, &cr2, device->regs.FLASH_CR2)) return -1;
+    if (device->regs.FLASH_NCR2 != 0 &&
+        !espstlink_queue_byte(pgm, &ncr2, device->regs.FLASH_NCR2))
+      return -1;
+  }
+
+  regcache_invalidate(pgm, addr, device->flash_block_size);
+  if (!espstlink_check(pgm, espstlink_queue_write(pgm->espstlink, block, addr,
+                                                  device->flash_block_size) &&
+                                espstlink_flush(pgm->espstlink, NULL)))
+    return -1;
+
+  if (memtype == FLASH || memtype == EEPROM)
+    return eop_wait(pgm, device, eop_mode(prgmode), espstlink_read_byte);
+  return 0;
+}
+
+static int espstlink_swim_write_mem(programmer_t *pgm,
+                                    const stm8_device_t *device,
+                                    unsigned char *buffer, unsigned int start,
+                                    unsigned int length,
+                                    const memtype_t memtype) {
   size_t i = 0;
 
-  espstlink_prepare_for_flash(pgm, device, memtype);
+  if (!espstlink_prepare_for_flash(pgm, device, memtype)) return 0;
 
   if (memtype == OPT) {
     // Option programming mode
@@ -136,85 +292,105 @@ int espstlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device,
       espstlink_write_byte(pgm, 0x7F, device->regs.FLASH_NCR2);
     }
 
-    for (i = 0; i < length; i++) {
-        espstlink_write_byte(pgm, *(buffer++), start++);
-        // Wait for EOP to be set in FLASH_IAPSR
-        usleep(6000); // t_prog per the datasheets is 6ms typ, 6.6ms max
-        TRY(5,espstlink_read_byte(pgm, device->regs.FLASH_IAPSR) & 0x04);
-    }
-  } else {
-    unsigned int rounded_size = ((length - 1) / device->flash_block_size + 1) * device->flash_block_size;
-    unsigned char *current = alloca(rounded_size);
-
-    // Read existing data
-    espstlink_swim_read_range(pgm, device, current, start, rounded_size);
-
-    // Extend the new data with the existing if it doesn't fill a complete flash block
-    // (this is safe as the incoming buffer is actually as big as the device's flash,
-    // not just the image to be flashed).
-    memcpy(buffer + length, current + length, rounded_size - length);
-
-    for (; i < length; i += device->flash_block_size) {
-      // Write one block at a time.
-      if (memcmp(current + i, buffer + i, device->flash_block_size)) {
-        uint8_t prgmode = 0x10;
-
-        if (memtype == FLASH || memtype == EEPROM) {
-          /*
-           * Use fast block programming (prgmode = 0x10) only if we have
-           * read the flash block and verified that it is empty (all its
-           * bytes are 0x00).
-           */
-          for (int j = 0; j < device->flash_block_size; j++) {
-              if (current[i + j]) {
-                  // Not empty so use standard block programming
-                  prgmode = 0x01;
-                  break;
-              }
-          }
-
-          // Block programming mode
-          espstlink_write_byte(pgm, prgmode, device->regs.FLASH_CR2);
-          if(device->regs.FLASH_NCR2 != 0) {
-            espstlink_write_byte(pgm, ~prgmode, device->regs.FLASH_NCR2);
-          }
-        }
-
-        if (!espstlink_swim_write(pgm->espstlink, buffer + i, start + i,
-                                  device->flash_block_size))
-          return i;
+    // Only program the bytes that differ, unless forced. Complement pairs
+    // need no special care: if a value changes, so does its complement.
+    unsigned char *current = pgm->force_write ? NULL : malloc(length);
+    unsigned int skipped = 0;
+    bool diff = current && espstlink_swim_read_range(pgm, device, current,
+                                                     start, length) == length;
 
-        if (memtype == FLASH || memtype == EEPROM) {
-          // t_prog per the datasheets is 6ms typ, 6.6ms max, fast mode is twice as fast
-          usleep(prgmode == 0x10 ? 3000 : 6000);
-          espstlink_wait_until_transfer_completes(pgm, device);
+    for (i = 0; i < length; i++) {
+        if (diff && current[i] == buffer[i]) {
+          skipped++;
+          continue;
         }
-      }
+        if (!espstlink_write_byte(pgm, buffer[i], start + i) ||
+            eop_wait(pgm, device, EOP_BYTE, espstlink_read_byte))
+          break;
     }
-  }
-
-  if (memtype == FLASH || memtype == EEPROM || memtype == OPT) {
-      // Reset DUL and PUL in IAPSR to disable flash and data writes.
-      int iapsr = espstlink_read_byte(pgm, device->regs.FLASH_IAPSR);
-      if (iapsr != -1)
-        espstlink_write_byte(pgm, iapsr & (~0x0a), device->regs.FLASH_IAPSR);
+    free(current);
+    if (skipped)
+      fprintf(stderr, "%u of %u option bytes unchanged, not programmed\n",
+              skipped, length);
+  } else {
+    pgm->block_frame_count = 0;
+    pgm->block_frame_failed = false;
+    i = blockwrite_range(pgm, device, buffer, start, length, memtype,
+                         /*diff=*/true, espstlink_write_block);
+    // Blocks still in a frame were counted as written already.
+    espstlink_frame_flush(pgm, device);
+    if (pgm->block_frame_failed && pgm->block_frame_failed_addr - start < i)
+      i = pgm->block_frame_failed_addr - start;
   }
 
   return i;
 }
 
+int espstlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device,
+                               unsigned char *buffer, unsigned int start,
+                               unsigned int length, const memtype_t memtype) {
+  int written =
+      espstlink_swim_write_mem(pgm, device, buffer, start, length, memtype);
+
+  // Flash and EEPROM stay unlocked until the session ends. Option bytes may
+  // change the protection right away, and after an error the target's state
+  // is unknown, so lock now in those cases. A failed block may also mean that
+  // the target was reset, so the cached registers are dropped as well.
+  if (written < (int)length) regcache_clear(pgm);
+  if (memtype == OPT || written < (int)length) espstlink_session_lock(pgm);
+  return written;
+}
+
 void espstlink_srst(programmer_t *pgm) {
-  espstlink_swim_srst(pgm->espstlink);
+  espstlink_check(pgm, espstlink_swim_srst(pgm->espstlink));
+  regcache_clear(pgm);
+  // The reset also locks the memories again.
+  memset(&pgm->session, 0, sizeof(pgm->session));
   espstlink_stall(pgm, false);
 }
 
+void espstlink_print_stats(programmer_t *pgm) {
+  if (pgm->espstlink && pgm->espstlink->tcp)
+    fprintf(stderr, "Network link, firmware version %d\n",
+            pgm->espstlink->version);
+  else if (pgm->espstlink)
+    fprintf(stderr, "Serial link: %u baud, firmware version %d\n",
+            pgm->espstlink->baud, pgm->espstlink->version);
+  if (pgm->espstlink && pgm->espstlink->payload_bytes)
+    fprintf(stderr, "Compressed payload: %llu bytes sent as %llu (%.1fx)\n",
+            pgm->espstlink->payload_bytes, pgm->espstlink->wire_bytes,
+            (double)pgm->espstlink->payload_bytes /
+                pgm->espstlink->wire_bytes);
+  fprintf(stderr, "Register accesses served from cache: %u\n", pgm->shadow_hits);
+  eop_print_stats(pgm);
+}
+
 bool espstlink_pgm_open(programmer_t *pgm) {
-  pgm->espstlink = espstlink_open(pgm->port);
-  return pgm->espstlink != NULL && espstlink_fetch_version(pgm->espstlink) &&
-         espstlink_swim_reconnect(pgm);
+  espstlink_error_t error;
+
+  pgm->espstlink = espstlink_open(pgm->port, &error);
+  if (pgm->espstlink == NULL) {
+    fprintf(stderr, "%s\n", error.message);
+    return 0;
+  }
+  if (!espstlink_check(pgm, espstlink_fetch_version(pgm->espstlink))) return 0;
+
+  // The firmware starts at the default rate, faster ones are negotiated.
+  if (pgm->baud && pgm->espstlink->tcp)
+    fprintf(stderr, "Network link, baud rate ignored\n");
+  else if (pgm->baud &&
+           !espstlink_check(pgm, espstlink_set_baud(pgm->espstlink, pgm->baud)))
+    fprintf(stderr, "Continuing at %u baud\n", pgm->espstlink->baud);
+
+  // Data goes over the link run-length encoded where the firmware can.
+  if (pgm->espstlink->version >= 4)
+    espstlink_check(pgm, espstlink_set_compression(pgm->espstlink, true));
+
+  return espstlink_swim_reconnect(pgm);
 }
 
 void espstlink_pgm_close(programmer_t *pgm) {
+  espstlink_session_lock(pgm);
   espstlink_close(pgm->espstlink);
   pgm->espstlink = NULL;
 }
@@ -11,6 +11,7 @@ int espstlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device,
                                unsigned char *buffer, unsigned int start,
                                unsigned int length, const memtype_t memtype);
 void espstlink_srst(programmer_t *pgm);
+void espstlink_print_stats(programmer_t *pgm);
 bool espstlink_pgm_open(programmer_t *pgm);
 void espstlink_pgm_close(programmer_t *pgm);
 
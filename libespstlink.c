@@ -18,57 +18,109 @@
 #include "libespstlink.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-static espstlink_error_t error = {0, NULL};
-
-espstlink_error_t *espstlink_get_last_error() { return &error; }
+// A response has failed once the device sent nothing for this long.
+#define ESPSTLINK_TIMEOUT_MS 500
+// How long to wait for the rest of unexpected data, for error reports.
+#define ESPSTLINK_DRAIN_MS 100
+// Newest firmware protocol version supported.
+#define ESPSTLINK_VERSION 4
+// SET_OPTION options, firmware version 2 and later.
+#define ESPSTLINK_OPTION_BAUD 1
+#define ESPSTLINK_OPTION_COMPRESSION 2  // version 4
+// Time the firmware takes to switch rates after acknowledging.
+#define ESPSTLINK_BAUD_SETTLE_MS 10
+// Port syntax for network links, and how long connecting may take.
+#define ESPSTLINK_TCP_PREFIX "tcp://"
+#define ESPSTLINK_CONNECT_TIMEOUT_MS 5000
+// Programming time allowed per WRITE_BLOCKS block (t_prog is 6.6ms max).
+#define ESPSTLINK_BLOCK_PROG_MS 10
+
+// A closed connection should fail the send, not kill the process.
+#ifdef MSG_NOSIGNAL
+#define ESPSTLINK_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define ESPSTLINK_SEND_FLAGS 0
+#endif
+
+espstlink_error_t *espstlink_get_last_error(espstlink_t *pgm) {
+  return &pgm->error;
+}
 
 /** Set the error message based on a format string. */
-static void set_error(int code, const char *format, ...) {
-  // Free an old message.
-  if (error.message != NULL) free(error.message);
-
-  memset(&error, 0, sizeof(error));
+static int set_error_v(espstlink_error_t *error, int code, const char *format,
+                       va_list arglist) {
+  memset(error, 0, sizeof(*error));
+  error->code = code;
+  return vsnprintf(error->message, sizeof(error->message), format, arglist);
+}
 
-  // Calculate required memory size
+static void set_error(espstlink_error_t *error, int code, const char *format,
+                      ...) {
   va_list arglist;
   va_start(arglist, format);
-  size_t size = vsnprintf(NULL, 0, format, arglist);
+  set_error_v(error, code, format, arglist);
   va_end(arglist);
+}
 
-  // Store actual message.
-  error.message = malloc(size);
+/**
+ * set_error with ": " and the description of errnum appended. strerror()
+ * may return a buffer shared by all threads, so strerror_r() is used.
+ */
+static void set_error_errno(espstlink_error_t *error, int code, int errnum,
+                            const char *format, ...) {
+  char text[128];
+  const char *description = text;
+
+  va_list arglist;
   va_start(arglist, format);
-  vsnprintf(error.message, size, format, arglist);
+  int len = set_error_v(error, code, format, arglist);
   va_end(arglist);
-
-  fprintf(stderr, "%s\n", error.message);
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+  description = strerror_r(errnum, text, sizeof(text));
+#else
+  if (strerror_r(errnum, text, sizeof(text)) != 0)
+    snprintf(text, sizeof(text), "error %d", errnum);
+#endif
+  if (len >= 0 && (size_t)len < sizeof(error->message))
+    snprintf(error->message + len, sizeof(error->message) - len, ": %s",
+             description);
 }
 
-espstlink_t *espstlink_open(const char *device) {
+static int tty_open(const char *device, espstlink_error_t *error) {
   struct termios tty;
   memset(&tty, 0, sizeof tty);
 
-  int fd = open(device == NULL ? "/dev/ttyUSB0" : device, O_RDWR | O_NOCTTY);
+  int fd = open(device, O_RDWR | O_NOCTTY);
   if (fd < 0) {
-    perror("Couldn't open tty");
-    return NULL;
+    set_error_errno(error, ESPSTLINK_ERROR_OPEN, errno, "Couldn't open %s",
+                    device);
+    return -1;
   }
 
   /* Error Handling */
   if (tcgetattr(fd, &tty) != 0) {
-    perror("Couldn't open tty");
-    return NULL;
+    set_error_errno(error, ESPSTLINK_ERROR_OPEN, errno,
+                    "Couldn't open tty %s", device);
+    close(fd);
+    return -1;
   }
 
   /* Set Baud Rate */
@@ -76,24 +128,250 @@ espstlink_t *espstlink_open(const char *device) {
   cfsetispeed(&tty, (speed_t)B115200);
 
   /* Setting other Port Stuff */
-  tty.c_cc[VMIN] = 0;             // read does block
-  tty.c_cc[VTIME] = 1;            // 0.1 seconds read timeout
   tty.c_cflag |= CREAD | CLOCAL;  // turn on READ & ignore ctrl lines
 
   /* Make raw */
   cfmakeraw(&tty);
 
+  /* Reads return what is there, timeouts are handled with poll() */
+  tty.c_cc[VMIN] = 0;
+  tty.c_cc[VTIME] = 0;
+
   /* Flush Port, then applies attributes */
   tcflush(fd, TCIFLUSH);
   if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-    perror("Setting tty attributes failed");
+    set_error_errno(error, ESPSTLINK_ERROR_OPEN, errno,
+                    "Setting tty attributes of %s failed", device);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/** connect() that gives up after ESPSTLINK_CONNECT_TIMEOUT_MS. */
+static bool tcp_connect(int fd, const struct sockaddr *addr, socklen_t len) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) return 0;
+
+  if (connect(fd, addr, len) != 0) {
+    if (errno != EINPROGRESS) return 0;
+
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int r, err = 0;
+    socklen_t err_len = sizeof(err);
+    do {
+      r = poll(&pfd, 1, ESPSTLINK_CONNECT_TIMEOUT_MS);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0) errno = ETIMEDOUT;
+    if (r <= 0) return 0;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) return 0;
+    if (err) {
+      errno = err;
+      return 0;
+    }
+  }
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+/** Connects to "host:port", with IPv6 hosts in brackets. */
+static int tcp_open(const char *address, espstlink_error_t *error) {
+  const char *host = address, *port;
+  size_t host_len;
+  char host_buf[256];
+
+  if (address[0] == '[') {
+    const char *end = strchr(address, ']');
+    host++;
+    host_len = end ? (size_t)(end - host) : 0;
+    port = end && end[1] == ':' ? end + 1 : NULL;
+  } else {
+    port = strrchr(address, ':');
+    host_len = port ? (size_t)(port - address) : 0;
+  }
+  if (!port || !port[1] || !host_len || host_len >= sizeof(host_buf)) {
+    set_error(error, ESPSTLINK_ERROR_OPEN,
+              "Invalid address %s%s, expected host:port", ESPSTLINK_TCP_PREFIX,
+              address);
+    return -1;
+  }
+  memcpy(host_buf, host, host_len);
+  host_buf[host_len] = '\0';
+  port++;
+
+  struct addrinfo hints, *res, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int r = getaddrinfo(host_buf, port, &hints, &res);
+  if (r != 0) {
+    set_error(error, ESPSTLINK_ERROR_OPEN, "Couldn't resolve %s: %s",
+              host_buf, gai_strerror(r));
+    return -1;
+  }
+
+  int fd = -1, err = 0;
+  for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      err = errno;
+      continue;
+    }
+    if (!tcp_connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+      err = errno;
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    set_error_errno(error, ESPSTLINK_ERROR_OPEN, err,
+                    "Couldn't connect to %s port %s", host_buf, port);
+    return -1;
+  }
+
+  // Commands are small and latency bound, send them right away.
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  return fd;
+}
+
+espstlink_t *espstlink_open(const char *device, espstlink_error_t *error) {
+  espstlink_error_t ignored;
+  size_t prefix_len = strlen(ESPSTLINK_TCP_PREFIX);
+
+  if (error == NULL) error = &ignored;
+  if (device == NULL) device = "/dev/ttyUSB0";
+
+  bool tcp = strncmp(device, ESPSTLINK_TCP_PREFIX, prefix_len) == 0;
+  int fd = tcp ? tcp_open(device + prefix_len, error) : tty_open(device, error);
+  if (fd < 0) return NULL;
+
+  espstlink_t *pgm = calloc(1, sizeof(espstlink_t));
+  if (pgm == NULL) {
+    set_error(error, ESPSTLINK_ERROR_OPEN, "Out of memory");
+    close(fd);
     return NULL;
   }
-  espstlink_t *pgm = malloc(sizeof(espstlink_t));
   pgm->fd = fd;
+  pgm->tcp = tcp;
+  pgm->baud = tcp ? 0 : ESPSTLINK_DEFAULT_BAUD;
+  pgm->tx_window = tcp ? ESPSTLINK_TCP_WINDOW : ESPSTLINK_TX_WINDOW;
   return pgm;
 }
 
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits up to timeout_ms for data and reads as much of it as fits into the
+ * receive buffer. Returns the number of bytes read, 0 on timeout or -1 on
+ * error (including the device going away).
+ */
+static int rx_fill(espstlink_t *pgm, int timeout_ms) {
+  struct pollfd pfd = {pgm->fd, POLLIN, 0};
+  int r = poll(&pfd, 1, timeout_ms);
+  if (r <= 0) return r < 0 && errno == EINTR ? 0 : r;
+
+  size_t pos = pgm->rx_head % ESPSTLINK_RX_BUF_SIZE;
+  size_t room = ESPSTLINK_RX_BUF_SIZE - (pgm->rx_head - pgm->rx_tail);
+  if (room > ESPSTLINK_RX_BUF_SIZE - pos) room = ESPSTLINK_RX_BUF_SIZE - pos;
+  ssize_t len = read(pgm->fd, pgm->rx_buf + pos, room);
+  if (len < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+  if (len == 0) errno = EPIPE;  // readable but empty: hung up
+  if (len <= 0) return -1;
+  pgm->rx_head += len;
+  return len;
+}
+
+/** Moves up to size buffered bytes to dst. */
+static size_t rx_take(espstlink_t *pgm, uint8_t *dst, size_t size) {
+  size_t taken = 0;
+  while (taken < size && pgm->rx_tail != pgm->rx_head) {
+    size_t pos = pgm->rx_tail % ESPSTLINK_RX_BUF_SIZE;
+    size_t len = pgm->rx_head - pgm->rx_tail;
+    if (len > ESPSTLINK_RX_BUF_SIZE - pos) len = ESPSTLINK_RX_BUF_SIZE - pos;
+    if (len > size - taken) len = size - taken;
+    memcpy(dst + taken, pgm->rx_buf + pos, len);
+    pgm->rx_tail += len;
+    taken += len;
+  }
+  return taken;
+}
+
+/**
+ * Reads exactly size bytes. Fails if the device stays silent for
+ * timeout_ms; the deadline moves on whenever data arrives. Returns the
+ * number of bytes read, which is less than size on failure.
+ */
+static size_t rx_read(espstlink_t *pgm, uint8_t *dst, size_t size,
+                      int timeout_ms) {
+  size_t total = rx_take(pgm, dst, size);
+  long long deadline = now_ms() + timeout_ms;
+
+  while (total < size) {
+    long long left = deadline - now_ms();
+    if (left <= 0) {
+      errno = ETIMEDOUT;
+      break;
+    }
+    int len = rx_fill(pgm, left);
+    if (len < 0) break;
+    if (len > 0) {
+      total += rx_take(pgm, dst + total, size - total);
+      deadline = now_ms() + timeout_ms;
+    }
+  }
+  return total;
+}
+
+/** Discards everything received so far, e.g. leftovers of a failed command. */
+static void rx_discard(espstlink_t *pgm) {
+  pgm->rx_tail = pgm->rx_head;
+  if (!pgm->tcp) tcflush(pgm->fd, TCIFLUSH);
+}
+
+/** Writes all of iov, continuing after partial writes. */
+static bool tx_writev(espstlink_t *pgm, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t len;
+    if (pgm->tcp) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      len = sendmsg(pgm->fd, &msg, ESPSTLINK_SEND_FLAGS);
+    } else {
+      len = writev(pgm->fd, iov, count);
+    }
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    for (; count > 0 && (size_t)len >= iov->iov_len; iov++, count--)
+      len -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + len;
+      iov->iov_len -= len;
+    }
+  }
+  return 1;
+}
+
+/** Sends a single command. */
+static bool tx_send(espstlink_t *pgm, const uint8_t *cmd, size_t len) {
+  struct iovec iov = {(void *)cmd, len};
+  if (tx_writev(pgm, &iov, 1)) return 1;
+  set_error_errno(&pgm->error, ESPSTLINK_ERROR_WRITE, errno,
+                  "Couldn't send to the device");
+  return 0;
+}
+
 static const char *command_name(uint8_t command) {
   switch (command) {
     case 0:
@@ -102,6 +380,14 @@ static const char *command_name(uint8_t command) {
       return "READ";
     case 2:
       return "WRITE";
+    case 3:
+      return "READ_LONG";
+    case 4:
+      return "WRITE_LONG";
+    case 5:
+      return "WRITE_BLOCKS";
+    case 0xFC:
+      return "SET_OPTION";
     case 0xFD:
       return "HARD_RESET";
     case 0xFE:
@@ -132,141 +418,593 @@ static const char *swim_error_name(int code) {
   }
 }
 
-static bool error_check(int fd, uint8_t command, uint8_t *resp_buf,
-                        size_t size) {
+// Keeps whatever else the device sends, for the error report.
+static void error_drain(espstlink_t *pgm, size_t used) {
+  pgm->error.data_len =
+      used + rx_read(pgm, (uint8_t *)pgm->error.data + used,
+                     sizeof(pgm->error.data) - used, ESPSTLINK_DRAIN_MS);
+  rx_discard(pgm);
+}
+
+/** Checks a response that may take up to timeout_ms to start. */
+static bool error_check_within(espstlink_t *pgm, uint8_t command,
+                               uint8_t *resp_buf, size_t size,
+                               int timeout_ms) {
   uint8_t buf[4];
-  int len = read(fd, buf, 1);
+  size_t len = rx_read(pgm, buf, 2, timeout_ms);
   if (len < 1) {
-    set_error(ESPSTLINK_ERROR_READ,
-              "Didn't get a response from the device: %s\n", strerror(errno));
+    set_error_errno(&pgm->error, ESPSTLINK_ERROR_READ, errno,
+                    "Didn't get a response from the device");
     return 0;
   }
   if (buf[0] != command) {
-    set_error(ESPSTLINK_ERROR_DATA, "Unexpected data: %02x\n", buf[0]);
-    error.data[0] = buf[0];
-    error.data_len = 1 + read(fd, &error.data[1], sizeof(error.data) - 1);
+    set_error(&pgm->error, ESPSTLINK_ERROR_DATA,
+              "Unexpected data: %02x", buf[0]);
+    memcpy(pgm->error.data, buf, len);
+    error_drain(pgm, len);
     return 0;
   }
-  len = read(fd, buf + 1, 1);
-  if (len < 1) {
-    set_error(ESPSTLINK_ERROR_DATA,
-              "Device didn't finish command 0x%02x (%s): %s\n", buf[0],
-              command_name(buf[0]), strerror(errno));
+  if (len < 2) {
+    set_error_errno(&pgm->error, ESPSTLINK_ERROR_DATA, errno,
+                    "Device didn't finish command 0x%02x (%s)", buf[0],
+                    command_name(buf[0]));
     return 0;
   }
   if (buf[1] == 0) {
     if (resp_buf && size) {
-      size_t total = 0;
-      while (total < size) {
-        len = read(fd, resp_buf + total, size);
-        if (len < 1) {
-          set_error(
-              ESPSTLINK_ERROR_DATA,
-              "Incomplete response for command 0x%02x (%s): expected %d bytes, "
-              "but got %d bytes (%s)\n",
-              buf[0], command_name(buf[0]), size, len, strerror(errno));
-          return 0;
-        }
-        total += len;
+      len = rx_read(pgm, resp_buf, size, ESPSTLINK_TIMEOUT_MS);
+      if (len < size) {
+        set_error_errno(
+            &pgm->error, ESPSTLINK_ERROR_DATA, errno,
+            "Incomplete response for command 0x%02x (%s): expected %zu bytes, "
+            "but got %zu bytes",
+            buf[0], command_name(buf[0]), size, len);
+        rx_discard(pgm);
+        return 0;
       }
     }
     return 1;
   }
   if (buf[1] == 0xFF) {
-    len = read(fd, buf + 2, 2);
+    len = rx_read(pgm, buf + 2, 2, ESPSTLINK_TIMEOUT_MS);
     if (len < 2) {
-      set_error(ESPSTLINK_ERROR_DATA,
-                "Device didn't finish sending error code for command 0x%02x "
-                "(%s): %s\n",
-                buf[0], command_name(buf[0]), strerror(errno));
+      set_error_errno(&pgm->error, ESPSTLINK_ERROR_DATA, errno,
+                      "Device didn't finish sending error code for command "
+                      "0x%02x (%s)",
+                      buf[0], command_name(buf[0]));
       return 0;
     }
     int code = buf[2] << 8 | buf[3];
-    set_error(ESPSTLINK_ERROR_COMM,
-              "Command 0x%02x (%s) failed with code: 0x%02x (%s)\n", buf[0],
+    set_error(&pgm->error, ESPSTLINK_ERROR_COMM,
+              "Command 0x%02x (%s) failed with code: 0x%02x (%s)", buf[0],
               command_name(buf[0]), code, swim_error_name(code));
-    error.device_code = code;
+    pgm->error.device_code = code;
   } else {
-    set_error(ESPSTLINK_ERROR_DATA,
-              "Unexpected error code for command 0x%02x (%s): 0x%02x\n", buf[0],
+    set_error(&pgm->error, ESPSTLINK_ERROR_DATA,
+              "Unexpected error code for command 0x%02x (%s): 0x%02x", buf[0],
               command_name(buf[0]), buf[1]);
-    error.data[0] = buf[0];
-    error.data[1] = buf[1];
-    error.data_len = 2 + read(fd, &error.data[2], sizeof(error.data) - 2);
+    memcpy(pgm->error.data, buf, 2);
+    error_drain(pgm, 2);
   }
   return 0;
 }
 
+static bool error_check(espstlink_t *pgm, uint8_t command, uint8_t *resp_buf,
+                        size_t size) {
+  return error_check_within(pgm, command, resp_buf, size,
+                            ESPSTLINK_TIMEOUT_MS);
+}
+
 bool espstlink_fetch_version(espstlink_t *pgm) {
   uint8_t cmd[] = {0xFF};
   uint8_t resp_buf[2];
 
-  write(pgm->fd, cmd, 1);
-  if (!error_check(pgm->fd, cmd[0], resp_buf, 2)) return 0;
+  if (!tx_send(pgm, cmd, 1)) return 0;
+  if (!error_check(pgm, cmd[0], resp_buf, 2)) return 0;
 
   int version = resp_buf[0] << 8 | resp_buf[1];
-  if (version > 1) {
-    set_error(ESPSTLINK_ERROR_VERSION, "Unsupported target version: %d.\n",
-              version);
-    error.device_code = version;
+  if (version > ESPSTLINK_VERSION) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_VERSION,
+              "Unsupported target version: %d.", version);
+    pgm->error.device_code = version;
     return 0;
   }
   pgm->version = version;
   return 1;
 }
 
-bool espstlink_swim_entry(const espstlink_t *pgm) {
+static speed_t baud_speed(unsigned int baud) {
+  switch (baud) {
+    case 9600:
+      return B9600;
+    case 19200:
+      return B19200;
+    case 38400:
+      return B38400;
+    case 57600:
+      return B57600;
+    case 115200:
+      return B115200;
+#ifdef B230400
+    case 230400:
+      return B230400;
+#endif
+#ifdef B460800
+    case 460800:
+      return B460800;
+#endif
+#ifdef B921600
+    case 921600:
+      return B921600;
+#endif
+#ifdef B1000000
+    case 1000000:
+      return B1000000;
+#endif
+#ifdef B1500000
+    case 1500000:
+      return B1500000;
+#endif
+#ifdef B2000000
+    case 2000000:
+      return B2000000;
+#endif
+#ifdef B3000000
+    case 3000000:
+      return B3000000;
+#endif
+    default:
+      return B0;
+  }
+}
+
+static bool set_speed(espstlink_t *pgm, speed_t speed) {
+  struct termios tty;
+  if (tcgetattr(pgm->fd, &tty) != 0) return 0;
+  cfsetospeed(&tty, speed);
+  cfsetispeed(&tty, speed);
+  return tcsetattr(pgm->fd, TCSADRAIN, &tty) == 0;
+}
+
+bool espstlink_set_baud(espstlink_t *pgm, unsigned int baud) {
+  speed_t speed = baud_speed(baud);
+  unsigned int old_baud = pgm->baud;
+
+  if (pgm->tcp) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_BAUD,
+              "Network links have no baud rate");
+    return 0;
+  }
+  if (speed == B0) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_BAUD,
+              "Unsupported baud rate: %u", baud);
+    return 0;
+  }
+  if (baud == old_baud) return 1;
+  if (pgm->version < 2) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_VERSION,
+              "Firmware version %d can't change the baud rate, version 2 "
+              "needed",
+              pgm->version);
+    pgm->error.device_code = pgm->version;
+    return 0;
+  }
+
+  uint8_t cmd[] = {0xFC, ESPSTLINK_OPTION_BAUD, baud >> 24, baud >> 16,
+                   baud >> 8, baud};
+  if (!tx_send(pgm, cmd, sizeof(cmd))) return 0;
+  if (!error_check(pgm, cmd[0], NULL, 0)) return 0;
+
+  // The firmware has switched by now, follow it and check the link.
+  usleep(ESPSTLINK_BAUD_SETTLE_MS * 1000);
+  long long switched = now_ms();
+  if (set_speed(pgm, speed)) {
+    rx_discard(pgm);
+    pgm->baud = baud;
+    if (espstlink_fetch_version(pgm)) return 1;
+  }
+
+  // Go back and wait for the firmware to do the same.
+  set_speed(pgm, baud_speed(old_baud));
+  pgm->baud = old_baud;
+  long long left =
+      switched + ESPSTLINK_BAUD_REVERT_MS + ESPSTLINK_DRAIN_MS - now_ms();
+  if (left > 0) usleep(left * 1000);
+  rx_discard(pgm);
+  if (!espstlink_fetch_version(pgm)) return 0;
+  set_error(&pgm->error, ESPSTLINK_ERROR_BAUD,
+            "Device didn't answer at %u baud, staying at %u baud", baud,
+            old_baud);
+  return 0;
+}
+
+bool espstlink_swim_entry(espstlink_t *pgm) {
   uint8_t cmd[] = {0xFE};
   uint8_t resp_buf[2];
 
-  write(pgm->fd, cmd, 1);
-  if (!error_check(pgm->fd, cmd[0], resp_buf, 2)) return 0;
+  if (!tx_send(pgm, cmd, 1)) return 0;
+  if (!error_check(pgm, cmd[0], resp_buf, 2)) return 0;
 
-  int duration = resp_buf[0] << 8 | resp_buf[1];
-  if (duration < 1200 || duration > 1360) {
-    fprintf(stderr,
-            "Warning: remote device took %d cycles (%d us) (expected: %d us)\n",
-            duration, duration / 80, 128 / 8);
-  }
+  pgm->entry_cycles = resp_buf[0] << 8 | resp_buf[1];
   return 1;
 }
 
-bool espstlink_reset(const espstlink_t *pgm, bool input, bool enable_reset) {
+bool espstlink_reset(espstlink_t *pgm, bool input, bool enable_reset) {
   uint8_t cmd[] = {0xFD, input ? 0xFF : enable_reset};
 
-  write(pgm->fd, cmd, 2);
-  return error_check(pgm->fd, cmd[0], NULL, 0);
+  if (!tx_send(pgm, cmd, 2)) return 0;
+  return error_check(pgm, cmd[0], NULL, 0);
 }
 
-bool espstlink_swim_srst(const espstlink_t *pgm) {
+bool espstlink_swim_srst(espstlink_t *pgm) {
   uint8_t cmd[] = {0};
 
-  write(pgm->fd, cmd, 1);
-  return error_check(pgm->fd, cmd[0], NULL, 0);
+  if (!tx_send(pgm, cmd, 1)) return 0;
+  return error_check(pgm, cmd[0], NULL, 0);
 }
 
-bool espstlink_swim_read(const espstlink_t *pgm, uint8_t *buffer,
-                         unsigned int addr, size_t size) {
-  uint8_t cmd[] = {1, size, addr >> 16, addr >> 8, addr};
-  uint8_t resp_buf[512];
-  write(pgm->fd, cmd, 5);
-  if (!error_check(pgm->fd, cmd[0], resp_buf, cmd[1] + 4)) return 0;
-  // there's 4 non data bytes in the response: len, 3*address
-  memcpy(buffer, resp_buf + 4, size);
+static size_t rle_literals(const uint8_t *src, size_t len, uint8_t *dst,
+                           size_t out) {
+  while (len > 0) {
+    size_t n = len;
+    if (n > ESPSTLINK_RLE_LITERAL_MAX) n = ESPSTLINK_RLE_LITERAL_MAX;
+    dst[out++] = n - 1;
+    memcpy(dst + out, src, n);
+    out += n;
+    src += n;
+    len -= n;
+  }
+  return out;
+}
+
+size_t espstlink_rle_encode(const uint8_t *src, size_t size, uint8_t *dst) {
+  size_t in = 0, out = 0, literal = 0;
+
+  while (in < size) {
+    size_t run = 1;
+    while (in + run < size && run < ESPSTLINK_RLE_RUN_MAX &&
+           src[in + run] == src[in])
+      run++;
+    if (run >= ESPSTLINK_RLE_RUN_MIN) {
+      out = rle_literals(src + literal, in - literal, dst, out);
+      dst[out++] = 0x80 | (run - ESPSTLINK_RLE_RUN_MIN);
+      dst[out++] = src[in];
+      literal = in + run;
+    }
+    in += run;
+  }
+  return rle_literals(src + literal, in - literal, dst, out);
+}
+
+/** Length of the data a token stands for. */
+static size_t rle_token_size(uint8_t token) {
+  return token & 0x80 ? (token & 0x7F) + ESPSTLINK_RLE_RUN_MIN : token + 1u;
+}
+
+size_t espstlink_rle_decode(const uint8_t *src, size_t src_len, uint8_t *dst,
+                            size_t size) {
+  size_t in = 0, out = 0;
+
+  while (out < size) {
+    if (in >= src_len) return 0;
+    uint8_t token = src[in++];
+    size_t n = rle_token_size(token);
+    size_t data = token & 0x80 ? 1 : n;
+    if (n > size - out || data > src_len - in) return 0;
+    if (token & 0x80)
+      memset(dst + out, src[in], n);
+    else
+      memcpy(dst + out, src + in, n);
+    in += data;
+    out += n;
+  }
+  return in;
+}
+
+/**
+ * Reads size bytes of encoded response data straight into dst, like
+ * rx_read. Returns the number of bytes decoded.
+ */
+static size_t rx_read_rle(espstlink_t *pgm, uint8_t *dst, size_t size,
+                          int timeout_ms) {
+  size_t out = 0;
+
+  while (out < size) {
+    uint8_t token, value;
+    if (rx_read(pgm, &token, 1, timeout_ms) < 1) break;
+    size_t n = rle_token_size(token);
+    if (n > size - out) {
+      errno = EPROTO;
+      break;
+    }
+    if (token & 0x80) {
+      if (rx_read(pgm, &value, 1, timeout_ms) < 1) break;
+      memset(dst + out, value, n);
+      pgm->wire_bytes += 2;
+    } else {
+      size_t len = rx_read(pgm, dst + out, n, timeout_ms);
+      pgm->wire_bytes += 1 + len;
+      if (len < n) return out + len;
+    }
+    out += n;
+  }
+  pgm->payload_bytes += out;
+  return out;
+}
+
+bool espstlink_set_compression(espstlink_t *pgm, bool enable) {
+  if (pgm->version < 4) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_VERSION,
+              "Firmware version %d can't compress, version 4 needed",
+              pgm->version);
+    pgm->error.device_code = pgm->version;
+    return 0;
+  }
+  // Queued commands were encoded for the current setting.
+  if (pgm->queued && !espstlink_flush(pgm, NULL)) return 0;
+
+  uint8_t cmd[] = {0xFC, ESPSTLINK_OPTION_COMPRESSION, 0, 0, 0, enable};
+  if (!tx_send(pgm, cmd, sizeof(cmd))) return 0;
+  if (!error_check(pgm, cmd[0], NULL, 0)) return 0;
+  pgm->compress = enable;
+  return 1;
+}
+
+size_t espstlink_max_size(const espstlink_t *pgm) {
+  return pgm->version >= 3 ? ESPSTLINK_FRAME_MAX : 0xFF;
+}
+
+/** Empties the queue, freeing the encoded payloads. */
+static void queue_clear(espstlink_t *pgm) {
+  size_t i;
+  for (i = 0; i < pgm->queued; i++) free(pgm->queue[i].encoded);
+  pgm->queued = 0;
+}
+
+static bool queue_cmd(espstlink_t *pgm, uint8_t command, const uint8_t *data,
+                      uint8_t *resp, unsigned int addr, size_t size) {
+  uint8_t *encoded = NULL;
+
+  if (pgm->queued == ESPSTLINK_QUEUE_MAX || size < 1 ||
+      size > espstlink_max_size(pgm) ||
+      (data && pgm->compress &&
+       !(encoded = malloc(ESPSTLINK_RLE_BOUND(size))))) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_QUEUE,
+              "Can't queue command 0x%02x (%s) of %zu bytes, %zu queued",
+              command, command_name(command), size, pgm->queued);
+    queue_clear(pgm);
+    return 0;
+  }
+  espstlink_cmd_t *cmd = &pgm->queue[pgm->queued++];
+  cmd->encoded = encoded;
+  if (encoded) {
+    cmd->encoded_len = espstlink_rle_encode(data, size, encoded);
+    pgm->payload_bytes += size;
+    pgm->wire_bytes += cmd->encoded_len;
+  }
+  size_t len = 0;
+  if (size > 0xFF) {
+    // READ_LONG and WRITE_LONG, with a 16 bit length.
+    cmd->header[len++] = command + 2;
+    cmd->header[len++] = size >> 8;
+  } else {
+    cmd->header[len++] = command;
+  }
+  cmd->header[len++] = size;
+  cmd->header[len++] = addr >> 16;
+  cmd->header[len++] = addr >> 8;
+  cmd->header[len++] = addr;
+  cmd->header_len = len;
+  cmd->data = data;
+  cmd->resp = resp;
+  cmd->size = size;
+  return 1;
+}
+
+bool espstlink_queue_read(espstlink_t *pgm, uint8_t *buffer,
+                          unsigned int addr, size_t size) {
+  return queue_cmd(pgm, 1, NULL, buffer, addr, size);
+}
+
+bool espstlink_queue_write(espstlink_t *pgm, const uint8_t *buffer,
+                           unsigned int addr, size_t size) {
+  return queue_cmd(pgm, 2, buffer, NULL, addr, size);
+}
+
+static size_t cmd_length(const espstlink_cmd_t *cmd) {
+  if (cmd->encoded) return cmd->header_len + cmd->encoded_len;
+  return cmd->header_len + (cmd->data ? cmd->size : 0);
+}
+
+/** Collects the response to a queued command. */
+static bool cmd_response(espstlink_t *pgm, const espstlink_cmd_t *cmd) {
+  // Reads and writes echo their length and address.
+  uint8_t echo[sizeof(cmd->header) - 1];
+  size_t echo_len = cmd->header_len - 1;
+  if (!error_check(pgm, cmd->header[0], echo, echo_len)) return 0;
+  if (memcmp(echo, cmd->header + 1, echo_len) != 0) {
+    const uint8_t *a = echo + echo_len - 3, *b = cmd->header + echo_len - 2;
+    set_error(&pgm->error, ESPSTLINK_ERROR_DATA,
+              "Response to command 0x%02x (%s) is for 0x%06x, expected %zu "
+              "bytes at 0x%06x",
+              cmd->header[0], command_name(cmd->header[0]),
+              a[0] << 16 | a[1] << 8 | a[2], cmd->size,
+              b[0] << 16 | b[1] << 8 | b[2]);
+    memcpy(pgm->error.data, echo, echo_len);
+    error_drain(pgm, echo_len);
+    return 0;
+  }
+  if (cmd->resp) {
+    size_t len =
+        pgm->compress
+            ? rx_read_rle(pgm, cmd->resp, cmd->size, ESPSTLINK_TIMEOUT_MS)
+            : rx_read(pgm, cmd->resp, cmd->size, ESPSTLINK_TIMEOUT_MS);
+    if (len < cmd->size) {
+      set_error_errno(
+          &pgm->error, ESPSTLINK_ERROR_DATA, errno,
+          "Incomplete data for command 0x%02x (%s): expected %zu bytes, but "
+          "got %zu bytes",
+          cmd->header[0], command_name(cmd->header[0]), cmd->size, len);
+      rx_discard(pgm);
+      return 0;
+    }
+  }
   return 1;
 }
 
-bool espstlink_swim_write(const espstlink_t *pgm, const uint8_t *buffer,
+/** Waits for the device to go quiet and drops whatever it sent. */
+static void rx_drain(espstlink_t *pgm) {
+  uint8_t scratch[64];
+  while (rx_read(pgm, scratch, sizeof(scratch), ESPSTLINK_DRAIN_MS) ==
+         sizeof(scratch))
+    ;
+  rx_discard(pgm);
+}
+
+bool espstlink_flush(espstlink_t *pgm, size_t *completed) {
+  struct iovec iov[2 * ESPSTLINK_QUEUE_MAX];
+  size_t sent = 0, done = 0, in_flight = 0;
+  bool ok = 1;
+
+  while (done < pgm->queued) {
+    // Send whatever fits into the window, at least one command.
+    int count = 0;
+    while (sent < pgm->queued) {
+      espstlink_cmd_t *cmd = &pgm->queue[sent];
+      size_t len = cmd_length(cmd);
+      if (in_flight && in_flight + len > pgm->tx_window) break;
+      iov[count].iov_base = cmd->header;
+      iov[count++].iov_len = cmd->header_len;
+      if (cmd->encoded) {
+        iov[count].iov_base = cmd->encoded;
+        iov[count++].iov_len = cmd->encoded_len;
+      } else if (cmd->data) {
+        iov[count].iov_base = (void *)cmd->data;
+        iov[count++].iov_len = cmd->size;
+      }
+      in_flight += len;
+      sent++;
+    }
+    if (count && !tx_writev(pgm, iov, count)) {
+      set_error_errno(&pgm->error, ESPSTLINK_ERROR_WRITE, errno,
+                      "Couldn't send to the device");
+      ok = 0;
+      rx_drain(pgm);
+      break;
+    }
+
+    // Then take the oldest response. After a failure the commands still in
+    // flight run to completion; their responses would only confuse the next
+    // command.
+    if (!cmd_response(pgm, &pgm->queue[done])) {
+      ok = 0;
+      if (done + 1 < sent) rx_drain(pgm);
+      break;
+    }
+    in_flight -= cmd_length(&pgm->queue[done]);
+    done++;
+  }
+
+  queue_clear(pgm);
+  if (completed) *completed = done;
+  return ok;
+}
+
+bool espstlink_swim_read(espstlink_t *pgm, uint8_t *buffer,
+                         unsigned int addr, size_t size) {
+  return espstlink_queue_read(pgm, buffer, addr, size) &&
+         espstlink_flush(pgm, NULL);
+}
+
+bool espstlink_swim_write(espstlink_t *pgm, const uint8_t *buffer,
                           unsigned int addr, size_t size) {
-  uint8_t cmd[] = {2, size, addr >> 16, addr >> 8, addr};
-  write(pgm->fd, cmd, 5);
-  write(pgm->fd, buffer, cmd[1]);
+  return espstlink_queue_write(pgm, buffer, addr, size) &&
+         espstlink_flush(pgm, NULL);
+}
 
-  uint8_t resp_buf[4];
-  return error_check(pgm->fd, cmd[0], resp_buf, 4);
+bool espstlink_swim_write_blocks(espstlink_t *pgm,
+                                 const espstlink_flash_regs_t *regs,
+                                 uint8_t prgmode, const uint8_t *data,
+                                 unsigned int addr, size_t block_size,
+                                 unsigned int count, unsigned int *written) {
+  size_t size = block_size * count;
+  if (written) *written = 0;
+
+  if (pgm->version < 3) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_VERSION,
+              "Firmware version %d can't write block frames, version 3 "
+              "needed",
+              pgm->version);
+    pgm->error.device_code = pgm->version;
+    return 0;
+  }
+  if (count < 1 || count > 0xFF || block_size < 1 ||
+      size > ESPSTLINK_FRAME_MAX) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_ARGS,
+              "Can't write %u blocks of %zu bytes in one frame", count,
+              block_size);
+    return 0;
+  }
+  if (pgm->queued && !espstlink_flush(pgm, NULL)) return 0;
+
+  uint8_t cmd[] = {5,
+                   count,
+                   block_size >> 8,
+                   block_size,
+                   prgmode,
+                   regs->cr2 >> 16,
+                   regs->cr2 >> 8,
+                   regs->cr2,
+                   regs->ncr2 >> 16,
+                   regs->ncr2 >> 8,
+                   regs->ncr2,
+                   regs->iapsr >> 16,
+                   regs->iapsr >> 8,
+                   regs->iapsr,
+                   addr >> 16,
+                   addr >> 8,
+                   addr};
+  struct iovec iov[] = {{cmd, sizeof(cmd)}, {(void *)data, size}};
+  uint8_t encoded[ESPSTLINK_RLE_BOUND(ESPSTLINK_FRAME_MAX)];
+  if (pgm->compress) {
+    iov[1].iov_base = encoded;
+    iov[1].iov_len = espstlink_rle_encode(data, size, encoded);
+    pgm->payload_bytes += size;
+    pgm->wire_bytes += iov[1].iov_len;
+  }
+  if (!tx_writev(pgm, iov, 2)) {
+    set_error_errno(&pgm->error, ESPSTLINK_ERROR_WRITE, errno,
+                    "Couldn't send to the device");
+    rx_drain(pgm);
+    return 0;
+  }
+
+  // The firmware answers once all blocks are programmed, and on serial
+  // links much of the frame may still be on its way.
+  int timeout_ms = ESPSTLINK_TIMEOUT_MS + count * ESPSTLINK_BLOCK_PROG_MS;
+  if (pgm->baud)
+    timeout_ms += (sizeof(cmd) + iov[1].iov_len) * 10 * 1000 / pgm->baud;
+
+  // Blocks done and the IAPSR value that ended the last one.
+  uint8_t resp_buf[2];
+  if (!error_check_within(pgm, cmd[0], resp_buf, sizeof(resp_buf),
+                          timeout_ms))
+    return 0;
+  if (written) *written = resp_buf[0];
+  if (resp_buf[0] < count) {
+    set_error(&pgm->error, ESPSTLINK_ERROR_PROGRAM,
+              "Programming stopped after %u of %u blocks at 0x%06x, IAPSR "
+              "0x%02x",
+              resp_buf[0], count, addr + resp_buf[0] * block_size,
+              resp_buf[1]);
+    pgm->error.device_code = resp_buf[1];
+    return 0;
+  }
+  return 1;
 }
 
 void espstlink_close(espstlink_t *pgm) {
+  queue_clear(pgm);
   close(pgm->fd);
   free(pgm);
 }
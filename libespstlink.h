@@ -1,6 +1,21 @@
 /**
  * libespstlink provides low level access to the STM8 SWIM protocol using
  * the espstlink hardware (https://github.com/rumpeltux/esp-stlink)
+ *
+ * Thread safety: the library has no global state and prints nothing. All
+ * state, including the last error, lives in the espstlink_t handle of each
+ * device, so several devices can be driven from different threads at the
+ * same time. A single handle must not be used by two threads at once.
+ *
+ * Firmware protocol versions (see espstlink_fetch_version) are cumulative,
+ * each has the commands of the ones before it:
+ *   0  GET_VERSION, SWIM entry, SRST, READ and WRITE of up to 255 bytes
+ *   1  HARD_RESET, the reset pin
+ *   2  SET_OPTION for the baud rate, see espstlink_set_baud
+ *   3  READ_LONG, WRITE_LONG and WRITE_BLOCKS with 16 bit lengths for up to
+ *      ESPSTLINK_FRAME_MAX bytes of data
+ *   4  SET_OPTION for compression, see espstlink_set_compression
+ * Older firmware gets the commands of its version only.
  */
 #ifndef __LIBESPSTLINKV_H
 #define __LIBESPSTLINKV_H
@@ -9,23 +24,102 @@
 #include <stddef.h>
 #include <stdint.h>
 
-typedef struct _espstlink_t {
-  int fd;
-  int version;
-} espstlink_t;
+// Library version. The major version is also the shared library's soname,
+// libespstlink.so.N, and changes whenever existing callers have to change:
+//   1  the unversioned libespstlink.so, with one error for the whole process
+//   2  errors are kept per handle. Callers of version 1 have to:
+//      - pass an espstlink_error_t (or NULL) to espstlink_open, which fills
+//        it in when no handle could be created;
+//      - pass the handle to espstlink_get_last_error;
+//      - stop freeing espstlink_error_t.message, now a char array;
+//      - print errors themselves, the library no longer does.
+//      espstlink_t has also grown, so the library and its callers must be
+//      built from the same header.
+#define ESPSTLINK_VERSION_MAJOR 2
+#define ESPSTLINK_VERSION_MINOR 0
+
+// Bytes received from the device but not yet consumed. Must be a power of
+// two. Response data is read straight into the caller's buffer, so this
+// only needs to hold what arrives ahead of it, not a whole response.
+#define ESPSTLINK_RX_BUF_SIZE 1024
+
+// Data the firmware buffers for one command (version 3): the most a
+// READ_LONG, WRITE_LONG or WRITE_BLOCKS frame can carry.
+#define ESPSTLINK_FRAME_MAX 4096
+
+// Commands that can be queued for one espstlink_flush.
+#define ESPSTLINK_QUEUE_MAX 64
+// Request bytes sent ahead of their responses. While the firmware runs a
+// command, the ones behind it wait in its 256 byte serial receive buffer,
+// so the window must not exceed that. A larger command is only sent once
+// nothing is in flight; the firmware then takes its data into the frame
+// buffer as it arrives.
+#define ESPSTLINK_TX_WINDOW 256
+// Over TCP, flow control keeps the firmware from being overrun; the window
+// only bounds what is still sent after a failed command.
+#define ESPSTLINK_TCP_WINDOW 4096
+
+// A queued READ or WRITE, see espstlink_queue_read.
+typedef struct _espstlink_cmd_t {
+  uint8_t header[6];
+  size_t header_len;
+  const uint8_t *data;  // WRITE payload
+  uint8_t *resp;        // READ destination
+  size_t size;
+  uint8_t *encoded;  // WRITE payload as sent when compressing
+  size_t encoded_len;
+} espstlink_cmd_t;
+
+// The firmware's UART rate after power-up.
+#define ESPSTLINK_DEFAULT_BAUD 115200
+// Firmware that switched to a new rate goes back to the old one if it gets
+// no valid command for this long.
+#define ESPSTLINK_BAUD_REVERT_MS 1000
+
+// Expected duration of SWIM entry, in firmware cycles.
+#define ESPSTLINK_ENTRY_CYCLES_MIN 1200
+#define ESPSTLINK_ENTRY_CYCLES_MAX 1360
 
 typedef struct _esplink_error_t {
   int code;
-  char *message;
-  char data[256];
+  char message[256];
+  char data[256];  // unexpected data received, if any
   size_t data_len;
   int device_code;
 } espstlink_error_t;
 
+typedef struct _espstlink_t {
+  int fd;
+  bool tcp;  // network link, see espstlink_open
+  int version;
+  unsigned int baud;  // 0 for network links
+  size_t tx_window;   // see ESPSTLINK_TX_WINDOW
+  bool compress;      // see espstlink_set_compression
+  unsigned long long payload_bytes;  // data compressed, and
+  unsigned long long wire_bytes;     // what it took on the link
+  int entry_cycles;  // duration of the last SWIM entry
+  espstlink_error_t error;
+
+  espstlink_cmd_t queue[ESPSTLINK_QUEUE_MAX];
+  size_t queued;
+
+  // Receive ring buffer; rx_head and rx_tail only ever grow and are taken
+  // modulo ESPSTLINK_RX_BUF_SIZE.
+  uint8_t rx_buf[ESPSTLINK_RX_BUF_SIZE];
+  size_t rx_head;
+  size_t rx_tail;
+} espstlink_t;
+
 #define ESPSTLINK_ERROR_READ 1
 #define ESPSTLINK_ERROR_DATA 2
 #define ESPSTLINK_ERROR_COMM 3
 #define ESPSTLINK_ERROR_VERSION 4
+#define ESPSTLINK_ERROR_WRITE 5
+#define ESPSTLINK_ERROR_QUEUE 6
+#define ESPSTLINK_ERROR_BAUD 7
+#define ESPSTLINK_ERROR_ARGS 8
+#define ESPSTLINK_ERROR_PROGRAM 9
+#define ESPSTLINK_ERROR_OPEN 10
 
 #define ESPSTLINK_SWIM_ERROR_READ_BIT_TIMEOUT -1
 #define ESPSTLINK_SWIM_ERROR_INVALID_TARGET_ID -2
@@ -34,19 +128,121 @@ typedef struct _esplink_error_t {
 #define ESPSTLINK_SWIM_ERROR_SYNC_TIMEOUT_1 -5
 #define ESPSTLINK_SWIM_ERROR_SYNC_TIMEOUT_2 -6
 
-espstlink_error_t *espstlink_get_last_error();
+/** The error of the last failed call on this handle. */
+espstlink_error_t *espstlink_get_last_error(espstlink_t *pgm);
 
-espstlink_t *espstlink_open(const char *device);
+/**
+ * Opens the serial device (default /dev/ttyUSB0), or with "tcp://host:port"
+ * connects to the programmer over the network (IPv6 hosts in brackets). The
+ * command protocol is the same either way. On failure NULL is returned and,
+ * if `error` is given, the reason is stored there.
+ */
+espstlink_t *espstlink_open(const char *device, espstlink_error_t *error);
 void espstlink_close(espstlink_t *pgm);
 bool espstlink_fetch_version(espstlink_t *pgm);
 
-bool espstlink_swim_entry(const espstlink_t *pgm);
-bool espstlink_swim_srst(const espstlink_t *pgm);
-bool espstlink_swim_read(const espstlink_t *pgm, uint8_t *buffer,
+/**
+ * Run-length encoding of data payloads, see espstlink_set_compression.
+ * A token byte t below 0x80 is followed by t + 1 literal bytes, one of 0x80
+ * and up by a single byte to be repeated (t & 0x7F) + 3 times. The decoded
+ * length is known from the command, so a stream just ends once that much is
+ * decoded. Erased or padded flash takes 2 bytes per 130, uncompressible data
+ * grows by at most 1 byte per 128. The firmware uses the same functions.
+ */
+#define ESPSTLINK_RLE_LITERAL_MAX 128
+#define ESPSTLINK_RLE_RUN_MIN 3
+#define ESPSTLINK_RLE_RUN_MAX (0x7F + ESPSTLINK_RLE_RUN_MIN)
+#define ESPSTLINK_RLE_BOUND(size) \
+  ((size) + (size) / ESPSTLINK_RLE_LITERAL_MAX + 1)
+
+/**
+ * Encodes size bytes into dst, which must hold ESPSTLINK_RLE_BOUND(size).
+ * Returns the encoded length.
+ */
+size_t espstlink_rle_encode(const uint8_t *src, size_t size, uint8_t *dst);
+/**
+ * Decodes exactly size bytes into dst. Returns the number of bytes of src
+ * used, or 0 if src is short or malformed.
+ */
+size_t espstlink_rle_decode(const uint8_t *src, size_t src_len, uint8_t *dst,
+                            size_t size);
+
+/**
+ * Turns compression of all data payloads, written and read, on or off;
+ * needs firmware version 4. Queued commands are flushed first.
+ */
+bool espstlink_set_compression(espstlink_t *pgm, bool enable);
+
+/**
+ * Switches the serial link to `baud`, which needs firmware version 2 or later
+ * (see espstlink_fetch_version). The firmware acknowledges the request at the
+ * old rate and then switches; the host follows and confirms the new rate
+ * with GET_VERSION. If that fails, both sides return to the old rate (the
+ * firmware after ESPSTLINK_BAUD_REVERT_MS) and false is returned. Rates up
+ * to 921600 are supported where the OS has them, higher standard rates
+ * (1000000 to 3000000) where termios defines them.
+ */
+bool espstlink_set_baud(espstlink_t *pgm, unsigned int baud);
+
+bool espstlink_swim_entry(espstlink_t *pgm);
+bool espstlink_swim_srst(espstlink_t *pgm);
+bool espstlink_swim_read(espstlink_t *pgm, uint8_t *buffer,
                          unsigned int addr, size_t size);
-bool espstlink_swim_write(const espstlink_t *pgm, const uint8_t *buffer,
+bool espstlink_swim_write(espstlink_t *pgm, const uint8_t *buffer,
                           unsigned int addr, size_t size);
 
+/**
+ * Largest read or write a single command can transfer: 255 bytes, or
+ * ESPSTLINK_FRAME_MAX with firmware version 3, which has commands with 16 bit
+ * lengths.
+ */
+size_t espstlink_max_size(const espstlink_t *pgm);
+
+/**
+ * Pipelined reads and writes.
+ * Up to ESPSTLINK_QUEUE_MAX commands of at most espstlink_max_size() bytes
+ * each can be queued and are then sent back to back by espstlink_flush,
+ * which matches the responses to them in order and reads data straight into
+ * the buffers given. This saves a round trip over the serial link
+ * per command. The buffers passed in must stay valid until the flush.
+ * If queueing fails (queue full, size out of range), the whole queue is
+ * dropped and nothing of it is sent.
+ */
+bool espstlink_queue_read(espstlink_t *pgm, uint8_t *buffer,
+                          unsigned int addr, size_t size);
+bool espstlink_queue_write(espstlink_t *pgm, const uint8_t *buffer,
+                           unsigned int addr, size_t size);
+/**
+ * Sends the queued commands and collects their responses. Stops sending at
+ * the first failed command, waits for the ones already sent and drops their
+ * responses. If `completed` is given, it is set to the number of commands
+ * that succeeded, which are always the first ones queued. The queue is empty
+ * afterwards. espstlink_swim_read and espstlink_swim_write flush the queue
+ * along with their own command.
+ */
+bool espstlink_flush(espstlink_t *pgm, size_t *completed);
+
+// Flash control registers of the target, for espstlink_swim_write_blocks.
+typedef struct _espstlink_flash_regs_t {
+  unsigned int cr2;
+  unsigned int ncr2;  // 0 if the device has none
+  unsigned int iapsr;
+} espstlink_flash_regs_t;
+
+/**
+ * Programs `count` consecutive blocks of `block_size` bytes at `addr` with
+ * one frame of at most ESPSTLINK_FRAME_MAX bytes; needs firmware version 3.
+ * For each block the firmware sets FLASH_CR2 (and NCR2) to `prgmode`, writes
+ * the block and polls IAPSR for the end of programming. If it stops early,
+ * the error is ESPSTLINK_ERROR_PROGRAM with the last IAPSR value read as
+ * device_code. `written` (if given) is set to the number of blocks done.
+ */
+bool espstlink_swim_write_blocks(espstlink_t *pgm,
+                                 const espstlink_flash_regs_t *regs,
+                                 uint8_t prgmode, const uint8_t *data,
+                                 unsigned int addr, size_t block_size,
+                                 unsigned int count, unsigned int *written);
+
 /**
  * Switch the reset pin.
  * If `input`, the pin is used as an input pin with a pull-up resistor.
@@ -54,5 +250,5 @@ bool espstlink_swim_write(const espstlink_t *pgm, const uint8_t *buffer,
  * value == 0: DEFAULT, sets the pin HIGH
  * value == 1: RESET, sets the pin LOW
  */
-bool espstlink_reset(const espstlink_t *pgm, bool input, bool enable_reset);
+bool espstlink_reset(espstlink_t *pgm, bool input, bool enable_reset);
 #endif
@@ -18,6 +18,7 @@
 #include "stm8.h"
 #include "ihex.h"
 #include "srec.h"
+#include "utils.h"
 
 typedef enum {
     INTEL_HEX = 0,
@@ -37,6 +38,8 @@ extern int optreset;
 #define VERSION "1.1"
 #define VERSION_NOTES ""
 
+#define BENCHMARK_ROUNDS 4 // reads (and RAM writes) timed by -k
+
 programmer_t pgms[] = {
 	{ 	"stlink",
 		STLinkV1,
@@ -47,6 +50,7 @@ programmer_t pgms[] = {
 		stlink_swim_srst,
 		stlink_swim_read_range,
 		stlink_swim_write_range,
+		stlink_print_stats,
 	},
 	{
 		"stlinkv2",
@@ -58,6 +62,7 @@ programmer_t pgms[] = {
 		stlink2_srst,
 		stlink2_swim_read_range,
 		stlink2_swim_write_range,
+		stlink2_print_stats,
 	},
 	{
 		"stlinkv21",
@@ -65,10 +70,11 @@ programmer_t pgms[] = {
 		0x0483,
 		0x374b,
 		stlink2_open,
-		stlink_close,
+		stlink2_close,
 		stlink2_srst,
 		stlink2_swim_read_range,
 		stlink2_swim_write_range,
+		stlink2_print_stats,
 	},
 	{
 		"stlinkv3",
@@ -76,10 +82,11 @@ programmer_t pgms[] = {
 		0x0483,
 		0x374f,
 		stlink2_open,
-		stlink_close,
+		stlink2_close,
 		stlink2_srst,
 		stlink2_swim_read_range,
 		stlink2_swim_write_range,
+		stlink2_print_stats,
 	},
 	{
 		"espstlink",
@@ -91,6 +98,7 @@ programmer_t pgms[] = {
 		espstlink_srst,
 		espstlink_swim_read_range,
 		espstlink_swim_write_range,
+		espstlink_print_stats,
 	},
 	{ NULL },
 };
@@ -98,8 +106,9 @@ programmer_t pgms[] = {
 void print_help_and_exit(const char *name, bool err) {
 	int i = 0;
 	FILE *stream = err ? stderr : stdout;
-	fprintf(stream, "Usage: %s [-c programmer] [-S serialno] [-p partno] [-s memtype] [-b bytes] [-r|-w|-v] <filename>\n", name);
+	fprintf(stream, "Usage: %s [-c programmer] [-S serialno] [-d port] [-B baud] [-p partno] [-s memtype] [-b bytes] [-t] [-T ms[,ms]] [-E errors] [-C file] [-r|-w|-v] <filename>\n", name);
 	fprintf(stream, "Usage: %s [-c programmer] [-S serialno] [-p partno] -R\n", name);
+	fprintf(stream, "Usage: %s [-c programmer] [-S serialno] [-d port] [-p partno] [-s memtype] [-b bytes] [-t] -k\n", name);
 	fprintf(stream, "Options:\n");
 	fprintf(stream, "\t-h             Display this help\n");
 	fprintf(stream, "\t-c programmer  Specify programmer used (");
@@ -119,7 +128,8 @@ void print_help_and_exit(const char *name, bool err) {
 	}
 	fprintf(stream, ")\n");
 	fprintf(stream, "\t-S serialno    Specify programmer's serial number. If not given and more than one programmer is available, they'll be listed.\n");
-	fprintf(stream, "\t-d port        Specify the serial device for espstlink (default: /dev/ttyUSB0)\n");
+	fprintf(stream, "\t-d port        Specify the serial device for espstlink (default: /dev/ttyUSB0), or tcp://host:port\n");
+	fprintf(stream, "\t-B baud        Switch espstlink to this baud rate after connecting, e.g. 921600 (needs firmware support)\n");
 	fprintf(stream, "\t-p partno      Specify STM8 device\n");
 	fprintf(stream, "\t-l             List supported STM8 devices\n");
 	fprintf(stream, "\t-s memtype     Specify memory type (flash, eeprom, ram, opt or explicit address)\n");
@@ -128,9 +138,14 @@ void print_help_and_exit(const char *name, bool err) {
 	fprintf(stream, "\t-w <filename>  Write data from file to device\n");
 	fprintf(stream, "\t-v <filename>  Verify data in device against file\n");
 	fprintf(stream, "\t-R             Reset the device only\n");
+	fprintf(stream, "\t-k             Benchmark: read the memory a few times (RAM is also written back) and print the throughput\n");
 	fprintf(stream, "\t-L             List attached ST-LINK compatible programmers and their serial numbers\n");
 	fprintf(stream, "\t-V             Print Date(YearMonthDay-Version) and Version format is IE: 20171204-1.0\n");
 	fprintf(stream, "\t-u             Unlock. Reset option bytes to factory default to remove write protection.\n");
+	fprintf(stream, "\t-t             Print programmer statistics (command latencies etc.) at exit\n");
+	fprintf(stream, "\t-T ms[,ms]     USB timeout for commands[, for data transfers]\n");
+	fprintf(stream, "\t-E errors      SWIM errors to recover from per read or write before giving up (stlinkv2 and later)\n");
+	fprintf(stream, "\t-C file        Cache programmer capabilities in file to speed up connecting (stlinkv2 and later)\n");
 	exit(-err);
 }
 
@@ -141,6 +156,13 @@ void print_version_and_exit( bool err) {
 }
 
 
+static programmer_t *stats_pgm = NULL;
+
+static void print_stats(void) {
+	if(stats_pgm && stats_pgm->print_stats)
+		stats_pgm->print_stats(stats_pgm);
+}
+
 void spawn_error(const char *msg) {
 	fprintf(stderr, "%s\n", msg);
 	exit(-1);
@@ -378,9 +400,14 @@ int main(int argc, char **argv) {
 		pgm_specified = false,
 		pgm_serialno_specified = false,
 		part_specified = false,
-		bytes_count_specified = false;
+		bytes_count_specified = false,
+		stats_specified = false;
 	memtype_t memtype = FLASH;
+	unsigned int usb_timeout_ms = 0, usb_data_timeout_ms = 0;
+	int swim_error_budget = -1;
+	const char *cache_file = NULL;
 	const char * port = NULL;
+	unsigned int baud = 0;
 	int i;
 	programmer_t *pgm = NULL;
 	const stm8_device_t *part = NULL;
@@ -388,7 +415,7 @@ int main(int argc, char **argv) {
 	setbuf (stderr, 0); // Make stderr unbuffered (which is the default on POSIX anyway, but not on Windows).
 	setbuf (stdout, 0); // Also make stdout unbuffered (performance doesn't matter much here, bug quick progress display is useful).
 
-	while((c = getopt(argc, argv, "r:w:v:c:S:p:d:s:b:hluVLR")) != (char)-1) {
+	while((c = getopt(argc, argv, "r:w:v:c:S:p:d:B:s:b:hluVLRktT:E:C:")) != (char)-1) {
 		switch(c) {
 			case 'c':
 				pgm_specified = true;
@@ -409,6 +436,10 @@ int main(int argc, char **argv) {
 			case 'd':
 				port = strdup(optarg);
 				break;
+			case 'B':
+				if(sscanf(optarg, "%u", &baud) < 1 || baud == 0)
+					spawn_error("Invalid baud rate specified");
+				break;
 			case 'L':
 				dump_stlink_programmers();
 				exit(0);
@@ -464,6 +495,24 @@ int main(int argc, char **argv) {
 				action = RESET;
 				need_file = false;
 				break;
+			case 'k':
+				action = BENCHMARK;
+				need_file = false;
+				break;
+			case 't':
+				stats_specified = true;
+				break;
+			case 'T':
+				if(sscanf(optarg, "%u,%u", &usb_timeout_ms, &usb_data_timeout_ms) < 1)
+					spawn_error("Invalid USB timeout specified");
+				break;
+			case 'E':
+				if(sscanf(optarg, "%d", &swim_error_budget) < 1 || swim_error_budget < 0)
+					spawn_error("Invalid SWIM error budget specified");
+				break;
+			case 'C':
+				cache_file = optarg;
+				break;
 			case 'h':
 				print_help_and_exit(argv[0], false);
 			default:
@@ -484,6 +533,11 @@ int main(int argc, char **argv) {
 	if(!pgm)
 		spawn_error("No programmer has been specified");
 	pgm->port = port;
+	pgm->baud = baud;
+	pgm->usb_timeout_ms = usb_timeout_ms;
+	pgm->usb_data_timeout_ms = usb_data_timeout_ms;
+	pgm->swim_error_budget = swim_error_budget;
+	pgm->cache_file = cache_file;
 	if(part_specified && !part) {
 		fprintf(stderr, "No valid part specified. Use -l to see the list of supported devices.\n");
 		exit(-1);
@@ -563,6 +617,11 @@ int main(int argc, char **argv) {
 		print_help_and_exit(argv[0], true);
 	if(!usb_init(pgm, pgm_serialno_specified, pgm_serialno))
 		spawn_error("Couldn't initialize stlink");
+	if(stats_specified) {
+		// Also report statistics if we bail out on an error
+		stats_pgm = pgm;
+		atexit(print_stats);
+	}
 	if(!pgm->open(pgm))
 		spawn_error("Error communicating with MCU. Please check your SWIM connection.");
 
@@ -681,6 +740,10 @@ int main(int argc, char **argv) {
 
 		/* flashing MCU */
 		int sent = pgm->write_range(pgm, part, buf, start, bytes_to_write, memtype);
+		if(sent < bytes_to_write) {
+			fprintf(stderr, "\r\nRequested %d bytes but wrote only %d.\r\n", bytes_to_write, sent);
+			spawn_error("Failed to write MCU");
+		}
 		if(pgm->reset) {
 			// Restarting core (if applicable)
 			pgm->reset(pgm);
@@ -692,6 +755,9 @@ int main(int argc, char **argv) {
 		int sent;
 
 		if (part->read_out_protection_mode == ROP_UNKNOWN) spawn_error("No unlocking mode defined for this device. You may need to edit the file stm8.c");
+		// The option bytes read back while the device is protected tell nothing,
+		// and ROP_STM8L needs the same byte written twice
+		pgm->force_write = true;
 
 		if (part->read_out_protection_mode == ROP_STM8S) {
 			int bytes_to_write=part->option_bytes_size;
@@ -722,6 +788,38 @@ int main(int argc, char **argv) {
 	} else if (action == RESET) {
 		fprintf(stderr, "Resetting board...\n");
 		pgm->reset(pgm);
+	} else if (action == BENCHMARK) {
+		unsigned char *buf = malloc(bytes_count);
+		unsigned long long begin, read_us = 0, write_us = 0;
+
+		if(!buf) spawn_error("malloc failed");
+		for(int round = 0; round < BENCHMARK_ROUNDS; round++) {
+			fprintf(stderr, "Round %d: reading %d bytes at 0x%x... ", round + 1, bytes_count, start);
+			begin = time_us();
+			int recv = pgm->read_range(pgm, part, buf, start, bytes_count);
+			read_us += time_us() - begin;
+			if(recv < bytes_count) {
+				fprintf(stderr, "\r\nRequested %d bytes but received only %d.\r\n", bytes_count, recv);
+				spawn_error("Failed to read MCU");
+			}
+			// Writing back what was read leaves RAM as it was; flash, EEPROM
+			// and option bytes are not written to spare their endurance
+			if(memtype == RAM) {
+				fprintf(stderr, "writing... ");
+				begin = time_us();
+				int sent = pgm->write_range(pgm, part, buf, start, bytes_count, memtype);
+				write_us += time_us() - begin;
+				if(sent < bytes_count) {
+					fprintf(stderr, "\r\nRequested %d bytes but wrote only %d.\r\n", bytes_count, sent);
+					spawn_error("Failed to write MCU");
+				}
+			}
+			fprintf(stderr, "OK\n");
+		}
+		free(buf);
+		fprintf(stderr, "Read: %.0f bytes/s\n", (double)bytes_count * BENCHMARK_ROUNDS * 1000000 / (read_us ? read_us : 1));
+		if(memtype == RAM)
+			fprintf(stderr, "Write: %.0f bytes/s\n", (double)bytes_count * BENCHMARK_ROUNDS * 1000000 / (write_us ? write_us : 1));
 	}
 	if(pgm->close)
 		pgm->close(pgm);
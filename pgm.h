@@ -24,7 +24,8 @@ typedef enum {
     WRITE,
     VERIFY,
     RESET,
-    UNLOCK
+    UNLOCK,
+    BENCHMARK
 } action_t;
 
 typedef enum {
@@ -35,6 +36,75 @@ typedef enum {
 	ESP_STLink
 } programmer_type_t;
 
+/* Completion latency of one kind of programmer command. Bucket i counts
+ * latencies below PGM_LATENCY_MIN_US << i, the last bucket everything above. */
+#define PGM_LATENCY_CMDS	16
+#define PGM_LATENCY_BUCKETS	12
+#define PGM_LATENCY_MIN_US	64ULL
+
+typedef struct {
+	unsigned int count;
+	unsigned int buckets[PGM_LATENCY_BUCKETS];
+	unsigned long long total_us;
+	unsigned long long max_us;
+} pgm_latency_t;
+
+/* Programming time learned for one programming mode, see eop.h */
+typedef enum {
+	EOP_BYTE,       // single byte, e.g. option bytes
+	EOP_STANDARD,   // block with erase
+	EOP_FAST,       // block known to be erased
+	PGM_EOP_MODES
+} eop_mode_t;
+
+typedef struct {
+	unsigned int count;
+	unsigned int polls; // IAPSR reads, including the one that saw EOP
+	unsigned long long learned_us;
+	unsigned long long total_us;
+	unsigned long long min_us;
+	unsigned long long max_us;
+} pgm_eop_timing_t;
+
+/* Duration of one step of connecting to the target */
+#define PGM_CONNECT_STEPS	12
+
+typedef struct {
+	const char *name;
+	unsigned long long us;
+} pgm_step_t;
+
+/* SWIM link quality for the session, see stlinkv2.c */
+typedef struct {
+	bool high_speed;
+	unsigned int clean;          // successful commands since the last error
+	unsigned int recent_errors;  // errors not yet followed by a clean window
+	unsigned int stalls;         // commands whose status stopped changing
+	unsigned int step_up;        // clean commands needed to try high speed again
+	unsigned int fallbacks;
+	unsigned int step_ups;
+} pgm_link_t;
+
+/* Target setup that is kept across read_range/write_range calls until the
+ * programmer is closed or the target is reset, which undoes all of it. */
+typedef struct {
+	const stm8_device_t *device; // for locking the memories again
+	bool swim_active;    // stlink: SWIM session initialised
+	bool clock_set;      // CLK_CKDIVR set to full speed
+	bool flash_unlocked; // PUKR keys written
+	bool data_unlocked;  // DUKR keys written
+	bool eop_cleared;    // IAPSR flags from before the session read away, see eop_clear
+} pgm_session_t;
+
+/* A cached target register, see regcache.h */
+#define PGM_SHADOW_REGS	8
+
+typedef struct {
+	unsigned int addr;
+	unsigned char value;
+	bool valid;
+} pgm_shadow_reg_t;
+
 typedef struct programmer_s {
 	/* Info */
 	const char *name;
@@ -48,6 +118,7 @@ typedef struct programmer_s {
 	void (*reset) (struct programmer_s *pgm);
 	int (*read_range) (struct programmer_s *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length);
 	int (*write_range) (struct programmer_s *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype);
+	void (*print_stats) (struct programmer_s *pgm);
 
 	/* Private */
 	libusb_device_handle *dev_handle;
@@ -55,10 +126,55 @@ typedef struct programmer_s {
 
 	unsigned int msg_count; // debugging only
 	unsigned int out_msg_size; // stlink/stlinkv2
+	unsigned int usb_timeout_ms; // deadline for command/status transfers, 0 = default
+	unsigned int usb_data_timeout_ms; // deadline for data transfers, 0 = default
+
+	pgm_session_t session;
+	bool force_write; // write even what the target already holds (unlock)
+
+	/* Target register shadow for the session (stlinkv2, espstlink). */
+	pgm_shadow_reg_t shadow[PGM_SHADOW_REGS];
+	unsigned int shadow_hits; // register accesses skipped
+
+	/* Programming time per mode for the session (stlinkv2, espstlink). */
+	pgm_eop_timing_t eop_timing[PGM_EOP_MODES];
+
+	/* Data for stlinkv2 module. */
+	const char *cache_file; // programmer capability cache, NULL = not used
+	unsigned int read_buf_size; // as reported by the programmer
+	unsigned char swim_caps[8]; // as reported by SWIM_READ_CAP
+	bool single_frame; // WRITEMEM header and payload go in one transfer
+	bool double_buffer; // READMEM and READBUF take an offset into the buffer
+	unsigned int frame_max; // largest single frame write
+	unsigned char frame_buf[8192]; // reused for single frame writes
+
+	/* Statistics for stlink/stlinkv2 modules. */
+	pgm_step_t connect_steps[PGM_CONNECT_STEPS];
+	unsigned int connect_step_count;
+	pgm_latency_t swim_latency[PGM_LATENCY_CMDS]; // indexed by SWIM command
+	unsigned int usb_transfers;
+	unsigned int status_polls; // status reads, for stlink after the one sent with a command
+	unsigned long long poll_sleep_us; // stlink: time spent waiting between them
+	unsigned int usb_retries; // stlink: command runs repeated after a USB error
+	unsigned int blocks_written;
+	unsigned int block_transfers; // USB transfers spent on blocks_written
+	int swim_error_budget; // SWIM errors to recover from per read_range/write_range call, < 0 = default
+	unsigned int swim_errors; // for the whole session
+	unsigned int swim_errors_mark; // swim_errors when the current call began
+	unsigned int block_retries;
+	unsigned int read_retries;
+	pgm_link_t link;
 
 	/* Data for espstlink module. */
         espstlink_t * espstlink;
 	const char *port;
+	unsigned int baud; // serial rate to negotiate, 0 = firmware default
+	unsigned char block_frame[ESPSTLINK_FRAME_MAX]; // blocks for one WRITE_BLOCKS
+	unsigned int block_frame_addr;
+	unsigned int block_frame_count;
+	int block_frame_mode;
+	bool block_frame_failed;
+	unsigned int block_frame_failed_addr; // first block not written
 } programmer_t;
 
 typedef bool (*pgm_open_cb)(programmer_t *);
@@ -0,0 +1,60 @@
+/* Target register shadow, shared by the SWIM programmers */
+
+#include <string.h>
+#include "regcache.h"
+
+static pgm_shadow_reg_t *regcache_find(programmer_t *pgm, unsigned int addr) {
+	int i;
+	for(i = 0; i < PGM_SHADOW_REGS; i++) {
+		if(pgm->shadow[i].valid && pgm->shadow[i].addr == addr)
+			return(&pgm->shadow[i]);
+	}
+	return(NULL);
+}
+
+// Returns true and the register's value if it is known
+bool regcache_get(programmer_t *pgm, unsigned int addr, unsigned char *value) {
+	pgm_shadow_reg_t *reg = regcache_find(pgm, addr);
+	if(!reg)
+		return(false);
+	*value = reg->value;
+	pgm->shadow_hits++;
+	return(true);
+}
+
+// Returns true if the register is known to hold value already, so a write can be skipped
+bool regcache_unchanged(programmer_t *pgm, unsigned int addr, unsigned char value) {
+	pgm_shadow_reg_t *reg = regcache_find(pgm, addr);
+	if(!reg || reg->value != value)
+		return(false);
+	pgm->shadow_hits++;
+	return(true);
+}
+
+void regcache_set(programmer_t *pgm, unsigned int addr, unsigned char value) {
+	pgm_shadow_reg_t *reg = regcache_find(pgm, addr);
+	int i;
+	for(i = 0; !reg && i < PGM_SHADOW_REGS; i++) {
+		if(!pgm->shadow[i].valid)
+			reg = &pgm->shadow[i];
+	}
+	if(!reg)
+		reg = &pgm->shadow[addr % PGM_SHADOW_REGS];
+	reg->addr = addr;
+	reg->value = value;
+	reg->valid = true;
+}
+
+// Forget registers in [addr, addr + size), e.g. after writing that memory
+void regcache_invalidate(programmer_t *pgm, unsigned int addr, unsigned int size) {
+	int i;
+	for(i = 0; i < PGM_SHADOW_REGS; i++) {
+		if(pgm->shadow[i].addr >= addr && pgm->shadow[i].addr - addr < size)
+			pgm->shadow[i].valid = false;
+	}
+}
+
+// Forget everything, e.g. after a reset or a communication error
+void regcache_clear(programmer_t *pgm) {
+	memset(pgm->shadow, 0, sizeof(pgm->shadow));
+}
@@ -0,0 +1,16 @@
+#ifndef __REGCACHE_H
+#define __REGCACHE_H
+
+#include <stdbool.h>
+#include "pgm.h"
+
+/* Shadow of target registers for the current session. Only registers that
+ * change exclusively through our own writes may be cached; callers must
+ * invalidate registers that the hardware changes by itself. */
+bool regcache_get(programmer_t *pgm, unsigned int addr, unsigned char *value);
+bool regcache_unchanged(programmer_t *pgm, unsigned int addr, unsigned char value);
+void regcache_set(programmer_t *pgm, unsigned int addr, unsigned char value);
+void regcache_invalidate(programmer_t *pgm, unsigned int addr, unsigned int size);
+void regcache_clear(programmer_t *pgm);
+
+#endif
@@ -8,13 +8,16 @@
 #include <endian.h>
 #endif
 
-#include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include "stm8.h"
 #include "pgm.h"
+#include "blockwrite.h"
+#include "eop.h"
+#include "regcache.h"
 #include "stlink.h"
 #include "utils.h"
 
@@ -23,51 +26,9 @@
 #define STLK_READ_BUFFER_SIZE 6144
 #define STLK_MAX_WRITE 512
 
-unsigned int stlink_swim_get_status(programmer_t *pgm);
-int stlink_swim_read_byte(programmer_t *pgm, unsigned char byte, unsigned int start);
-int stlink_swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start);
-
-void stlink_send_message(programmer_t *pgm, int count, ...) {
-	va_list ap;
-	unsigned char data[32];
-	int i, r, actual;
-
-	va_start(ap, count);
-	assert(pgm->out_msg_size < sizeof(data));
-	assert(count <= pgm->out_msg_size);
-	memset(data, 0, pgm->out_msg_size);
-	for(i = 0; i < count; i++)
-		data[i] = va_arg(ap, int);
-	r = libusb_bulk_transfer(pgm->dev_handle, (2 | LIBUSB_ENDPOINT_OUT), data, pgm->out_msg_size, &actual, 0);
-	assert(r == 0);
-	pgm->msg_count++;
-	return;
-}
-
-int stlink_read(programmer_t *pgm, unsigned char *buffer, int count) {
-	int r, recv;
-	r = libusb_bulk_transfer(pgm->dev_handle, (1 | LIBUSB_ENDPOINT_IN), buffer, count, &recv, 0);
-	assert(r==0);
-	return(recv);
-}
-
-int stlink_read1(programmer_t *pgm, int count) {
-	unsigned char buf[16];
-	return(stlink_read(pgm, buf, count));
-}
-
-int stlink_read_and_cmp(programmer_t *pgm, int count, ...) {
-	va_list ap;
-	unsigned char buf[16];
-	stlink_read(pgm, buf, count);
-	int i, ret = 0;
-	va_start(ap, count);
-	for(i = 0; i < count; i++) {
-		if(buf[i] != va_arg(ap, int))
-			ret++;
-	}
-	return(ret);
-}
+int stlink_swim_get_status(programmer_t *pgm);
+static int stlink_swim_read_byte(programmer_t *pgm, unsigned int addr);
+stlink_status_t stlink_swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start);
 
 unsigned char *pack_int16(uint16_t word, unsigned char *out) {
 	// Filling with bytes in big-endian order
@@ -125,8 +86,13 @@ uint32_t unpack_int32_le(unsigned char *block) {
 	return(ret);
 }
 
-void pack_usb_cbw(scsi_usb_cbw *cbw, unsigned char *out) {
+// Returns false for a command block longer than the CBW holds
+bool pack_usb_cbw(scsi_usb_cbw *cbw, unsigned char *out) {
 	unsigned char *offset = out;
+	if(cbw->cblength > sizeof(cbw->cb)) {
+		fprintf(stderr, "Cannot send a command block of %u bytes\n", cbw->cblength);
+		return(false);
+	}
 	offset = pack_int32(cbw->signature, offset);
 	offset = pack_int32(cbw->tag, offset);
 	offset = pack_int32_le(cbw->transfer_length, offset);
@@ -136,7 +102,7 @@ void pack_usb_cbw(scsi_usb_cbw *cbw, unsigned char *out) {
 	offset += 3;
 	memcpy(offset, cbw->cb, sizeof(cbw->cb));
 	offset += sizeof(cbw->cb);
-	assert(offset - out == USB_CBW_SIZE);
+	return(offset - out == USB_CBW_SIZE);
 }
 
 void unpack_usb_csw(unsigned char *block, scsi_usb_csw *out) {
@@ -146,196 +112,550 @@ void unpack_usb_csw(unsigned char *block, scsi_usb_csw *out) {
 	out->status = block[12];
 }
 
-int stlink_send_cbw(libusb_device_handle *dev_handle, scsi_usb_cbw *cbw) {
+/* USB transport
+ * A transfer that fails or times out, and a CSW that does not answer the
+ * CBW, leave the Bulk-Only protocol in an unknown state. The programmer is
+ * then brought back with a mass storage reset and clearing both endpoints,
+ * which takes milliseconds, and the whole run of commands is repeated, up
+ * to STLK_USB_RETRIES times.
+ */
+#define STLK_CBW_TAG 0x707ec281
+#define STLK_CSW_SIGNATURE 0x55534253
+#define STLK_EP_OUT (2 | LIBUSB_ENDPOINT_OUT)
+#define STLK_EP_IN (1 | LIBUSB_ENDPOINT_IN)
+#define STLK_USB_TIMEOUT_MS 1000
+#define STLK_USB_DATA_TIMEOUT_MS 5000
+#define STLK_USB_RETRIES 3
+
+static unsigned int stlink_timeout(programmer_t *pgm, bool data) {
+	if(data)
+		return(pgm->usb_data_timeout_ms ? pgm->usb_data_timeout_ms : STLK_USB_DATA_TIMEOUT_MS);
+	return(pgm->usb_timeout_ms ? pgm->usb_timeout_ms : STLK_USB_TIMEOUT_MS);
+}
+
+// Returns 0 or a libusb error, a short transfer counts as LIBUSB_ERROR_IO
+static int stlink_transfer(programmer_t *pgm, int ep, unsigned char *buf, int length, bool data) {
+	int actual = 0;
+	int r = libusb_bulk_transfer(pgm->dev_handle, ep, buf, length, &actual, stlink_timeout(pgm, data));
+	pgm->usb_transfers++;
+	if(r == 0 && actual != length && !(data && (ep & LIBUSB_ENDPOINT_IN)))
+		r = LIBUSB_ERROR_IO;
+	return(r);
+}
+
+int stlink_send_cbw(programmer_t *pgm, scsi_usb_cbw *cbw) {
 	unsigned char buf[USB_CBW_SIZE];
 	cbw->signature = USB_CBW_SIGNATURE;
-	cbw->tag = 0x707ec281;
-	pack_usb_cbw(cbw, buf);
-	int actual;
-	int r = libusb_bulk_transfer(dev_handle,
-				(2 | LIBUSB_ENDPOINT_OUT),
-				buf,
-				USB_CBW_SIZE,
-				&actual,
-				0);
-	assert(actual == USB_CBW_SIZE);
-	return(r);
+	cbw->tag = STLK_CBW_TAG;
+	if(!pack_usb_cbw(cbw, buf))
+		return(LIBUSB_ERROR_INVALID_PARAM);
+	return(stlink_transfer(pgm, STLK_EP_OUT, buf, USB_CBW_SIZE, false));
 }
 
-int stlink_read_csw(libusb_device_handle *dev_handle, scsi_usb_csw *csw) {
+int stlink_read_csw(programmer_t *pgm, scsi_usb_csw *csw) {
 	unsigned char buf[USB_CSW_SIZE];
-	int recv;
-	int r = libusb_bulk_transfer(dev_handle,
-				(1 | LIBUSB_ENDPOINT_IN),
-				buf,
-				USB_CSW_SIZE,
-				&recv,
-				0);
-	assert(recv == USB_CSW_SIZE);
-	unpack_usb_csw(buf, csw);
+	int r = stlink_transfer(pgm, STLK_EP_IN, buf, USB_CSW_SIZE, false);
+	if(r == 0)
+		unpack_usb_csw(buf, csw);
 	return(r);
 }
 
-scsi_usb_cbw cbw;
-scsi_usb_csw csw;
+// A CSW must carry the tag of the CBW it answers; status 2 is a phase error
+static bool stlink_csw_valid(scsi_usb_csw *csw) {
+	if(csw->signature != STLK_CSW_SIGNATURE || csw->tag != STLK_CBW_TAG) {
+		fprintf(stderr, "IO error: unexpected CSW (signature 0x%08x, tag 0x%08x)\n", csw->signature, csw->tag);
+		return(false);
+	}
+	if(csw->status > 1) {
+		fprintf(stderr, "IO error: phase error\n");
+		return(false);
+	}
+	return(true);
+}
+
+// Bulk-Only Mass Storage Reset, then clear both endpoints
+static void stlink_usb_recover(programmer_t *pgm) {
+	int r = libusb_control_transfer(pgm->dev_handle,
+			LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+			0xff, 0, 0, NULL, 0, stlink_timeout(pgm, false));
+	if(r < 0)
+		DEBUG_PRINT("mass storage reset failed: %s\n", libusb_error_name(r));
+	libusb_clear_halt(pgm->dev_handle, STLK_EP_IN);
+	libusb_clear_halt(pgm->dev_handle, STLK_EP_OUT);
+}
+
+/* Transactions
+ * A command is a CBW, an optional data stage and a CSW. The transfers of
+ * a run of commands are submitted at once, so the programmer works through
+ * them back to back instead of waiting for the host after every stage.
+ * Latency is counted per SWIM command, from the completion of the previous
+ * command of the run (or the start of the run) to its CSW.
+ */
+#define STLK_XACT_MAX 3
+
+typedef struct {
+	scsi_usb_cbw cbw;
+	unsigned char *data; // data stage, cbw.transfer_length bytes
+	unsigned char cbw_buf[USB_CBW_SIZE];
+	unsigned char csw_buf[USB_CSW_SIZE];
+	scsi_usb_csw csw;
+} stlink_xact_t;
+
+static void stlink_xact_v(stlink_xact_t *x, int transfer_length, unsigned char *data, unsigned char flags,
+			int cblength, va_list ap) {
+	int i;
+	memset(x, 0, sizeof(stlink_xact_t));
+	x->cbw.transfer_length = transfer_length;
+	x->cbw.flags = flags;
+	x->cbw.cblength = cblength;
+	for(i = 0; i < cblength && i < sizeof(x->cbw.cb); i++) {
+		x->cbw.cb[i] = va_arg(ap, int);
+	}
+	x->data = data;
+}
+
+static void stlink_xact(stlink_xact_t *x, int transfer_length, unsigned char *data, unsigned char flags,
+			int cblength, ...) {
+	va_list ap;
+	va_start(ap, cblength);
+	stlink_xact_v(x, transfer_length, data, flags, cblength, ap);
+	va_end(ap);
+}
+
+// Ready bytes count, see stlink_swim_get_status
+static void stlink_xact_status(stlink_xact_t *x, unsigned char *buf) {
+	stlink_xact(x, 4, buf, 0x80, 0x0a,
+			0xf4, 0x09,
+			0x01, 0x00,
+			0x00, 0x00,
+			0x00, 0x00,
+			0x00, 0x00);
+}
+
+static void stlink_record_latency(programmer_t *pgm, stlink_xact_t *x, unsigned long long us) {
+	pgm_latency_t *l;
+	int bucket = 0;
+
+	if(x->cbw.cb[0] != 0xf4)
+		return;
+	l = &pgm->swim_latency[x->cbw.cb[1] % PGM_LATENCY_CMDS];
+	while(bucket < PGM_LATENCY_BUCKETS - 1 && us >= (PGM_LATENCY_MIN_US << bucket))
+		bucket++;
+	l->count++;
+	l->buckets[bucket]++;
+	l->total_us += us;
+	if(us > l->max_us)
+		l->max_us = us;
+}
+
+static void LIBUSB_CALL stlink_transfer_done(struct libusb_transfer *transfer) {
+	*(int *)transfer->user_data = 1;
+}
+
+// Runs one command with blocking transfers
+static stlink_status_t stlink_run_sync(programmer_t *pgm, stlink_xact_t *x) {
+	int r;
+	r = stlink_send_cbw(pgm, &x->cbw);
+	if(r == 0 && x->cbw.transfer_length)
+		r = stlink_transfer(pgm, (x->cbw.flags & 0x80) ? STLK_EP_IN : STLK_EP_OUT,
+				x->data, x->cbw.transfer_length, true);
+	if(r == 0)
+		r = stlink_read_csw(pgm, &x->csw);
+	if(r) {
+		fprintf(stderr, "IO error: %s\n", libusb_error_name(r));
+		return(STLK_USB_ERROR);
+	}
+	return(stlink_csw_valid(&x->csw) ? STLK_OK : STLK_USB_ERROR);
+}
+
+static stlink_status_t stlink_run_once(programmer_t *pgm, stlink_xact_t *x, unsigned int count) {
+	struct libusb_transfer *t[STLK_XACT_MAX][3];
+	int done[STLK_XACT_MAX][3];
+	stlink_status_t status = STLK_OK;
+	unsigned long long mark = time_us(), now;
+	unsigned int i, j;
+
+	// Without the asynchronous API, run the commands one stage at a time
+	memset(t, 0, sizeof(t));
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < 3; j++) {
+			if(j == 1 && !x[i].cbw.transfer_length)
+				continue;
+			t[i][j] = libusb_alloc_transfer(0);
+			if(!t[i][j])
+				break;
+		}
+		if(j < 3)
+			break;
+	}
+	if(i < count) {
+		DEBUG_PRINT("    async transfer unavailable - falling back to blocking transfer\n");
+		for(i = 0; i < count; i++)
+			for(j = 0; j < 3; j++)
+				if(t[i][j])
+					libusb_free_transfer(t[i][j]);
+		for(i = 0; i < count && status == STLK_OK; i++) {
+			status = stlink_run_sync(pgm, &x[i]);
+			now = time_us();
+			stlink_record_latency(pgm, &x[i], now - mark);
+			mark = now;
+		}
+		return(status);
+	}
+
+	for(i = 0; i < count; i++) {
+		unsigned char *buf[3] = { x[i].cbw_buf, x[i].data, x[i].csw_buf };
+		int length[3] = { USB_CBW_SIZE, x[i].cbw.transfer_length, USB_CSW_SIZE };
+		int ep[3] = { STLK_EP_OUT, (x[i].cbw.flags & 0x80) ? STLK_EP_IN : STLK_EP_OUT, STLK_EP_IN };
+		for(j = 0; j < 3; j++) {
+			if(!t[i][j])
+				continue;
+			done[i][j] = 0;
+			libusb_fill_bulk_transfer(t[i][j], pgm->dev_handle, ep[j], buf[j], length[j],
+					stlink_transfer_done, &done[i][j], stlink_timeout(pgm, j == 1));
+			if(status == STLK_OK && libusb_submit_transfer(t[i][j]) == 0) {
+				pgm->usb_transfers++;
+			} else {
+				status = STLK_USB_ERROR;
+				done[i][j] = -1;
+			}
+		}
+	}
+
+	for(i = 0; i < count && status == STLK_OK; i++) {
+		for(j = 0; j < 3 && status == STLK_OK; j++) {
+			if(!t[i][j])
+				continue;
+			while(!done[i][j]) {
+				int r = libusb_handle_events_completed(pgm->ctx, &done[i][j]);
+				if(r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+					fprintf(stderr, "IO error: could not handle USB events (%s)\n", libusb_error_name(r));
+					status = STLK_USB_ERROR;
+					break;
+				}
+			}
+			if(done[i][j] > 0 && (t[i][j]->status != LIBUSB_TRANSFER_COMPLETED ||
+					(j != 1 && t[i][j]->actual_length != t[i][j]->length))) {
+				fprintf(stderr, "IO error: expected %d bytes but %d bytes transferred\n",
+						t[i][j]->length, t[i][j]->actual_length);
+				status = STLK_USB_ERROR;
+			}
+		}
+		if(status == STLK_OK) {
+			unpack_usb_csw(x[i].csw_buf, &x[i].csw);
+			if(!stlink_csw_valid(&x[i].csw))
+				status = STLK_USB_ERROR;
+			now = time_us();
+			stlink_record_latency(pgm, &x[i], now - mark);
+			mark = now;
+		}
+	}
+
+	// Nothing after a failed stage can succeed, so do not wait for the rest
+	// to time out
+	if(status != STLK_OK)
+		for(i = 0; i < count; i++)
+			for(j = 0; j < 3; j++)
+				if(t[i][j] && !done[i][j])
+					libusb_cancel_transfer(t[i][j]);
+
+	// Every transfer has a timeout or is cancelled, so this terminates
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < 3; j++) {
+			if(!t[i][j])
+				continue;
+			while(!done[i][j])
+				if(libusb_handle_events_completed(pgm->ctx, &done[i][j]) < 0)
+					break;
+			if(done[i][j])
+				libusb_free_transfer(t[i][j]);
+		}
+	}
+	return(status);
+}
+
+static stlink_status_t stlink_run(programmer_t *pgm, stlink_xact_t *x, unsigned int count) {
+	stlink_status_t status;
+	int tries = 0;
+	unsigned int i;
+
+	if(count > STLK_XACT_MAX) {
+		fprintf(stderr, "Cannot run %u commands at once\n", count);
+		return(STLK_USB_ERROR);
+	}
+	// A command that cannot be packed is not worth a retry
+	for(i = 0; i < count; i++) {
+		x[i].cbw.signature = USB_CBW_SIGNATURE;
+		x[i].cbw.tag = STLK_CBW_TAG;
+		if(!pack_usb_cbw(&x[i].cbw, x[i].cbw_buf))
+			return(STLK_USB_ERROR);
+	}
+	while((status = stlink_run_once(pgm, x, count)) == STLK_USB_ERROR && tries < STLK_USB_RETRIES) {
+		tries++;
+		pgm->usb_retries++;
+		DEBUG_PRINT("recovering the USB transport, try %d\n", tries);
+		stlink_usb_recover(pgm);
+	}
+	return(status);
+}
 
 int stlink_test_unit_ready(programmer_t *pgm) {
+	stlink_xact_t x;
 	// This is a default SCSI command
-	memset(&cbw, 0, sizeof(scsi_usb_cbw));
-	cbw.cblength = 0x06;
-	int r;
-	r = stlink_send_cbw(pgm->dev_handle, &cbw);
-	assert(r == 0);
-	r = stlink_read_csw(pgm->dev_handle, &csw);
-	assert(r == 0);
-	return(csw.status == 0);
+	stlink_xact(&x, 0, NULL, 0x00, 0x06);
+	if(stlink_run(pgm, &x, 1) != STLK_OK)
+		return(0);
+	return(x.csw.status == 0);
 }
 
 int stlink_cmd(programmer_t *pgm, int transfer_length, unsigned char *transfer_out, unsigned char flags,
 			int cblength, ...) {
+	stlink_xact_t x;
+	unsigned char scratch[16];
 	va_list ap;
-	memset(&cbw, 0, sizeof(scsi_usb_cbw));
-	cbw.transfer_length = transfer_length;
-	cbw.flags = flags;
-	cbw.cblength = cblength;
 	va_start(ap, cblength);
-	int i;
-	for(i = 0; i < cblength; i++) {
-		cbw.cb[i] = va_arg(ap, int);
-	}
-	assert( stlink_send_cbw(pgm->dev_handle, &cbw) == 0);
-	if(transfer_length) {
+	if(transfer_length && !transfer_out) {
 		// Transfer expected, read some raw data
-		if(transfer_out)
-			stlink_read(pgm, transfer_out, transfer_length);
-		else
-			stlink_read1(pgm, transfer_length);
-	}
-	// Reading status
-	stlink_read_csw(pgm->dev_handle, &csw);
-	return(csw.status == 0);
-}
-
-int stlink_cmd_swim_read(programmer_t *pgm, uint16_t length, uint16_t start) {
-	memset(&cbw, 0, sizeof(scsi_usb_cbw));
-	cbw.transfer_length = length;
-	cbw.flags = 0x80;
-	cbw.cblength = 0x0a;
-	cbw.cb[0] = 0xf4;
-	cbw.cb[1] = 0x0c;
-	pack_int16(length, cbw.cb+2);
-	pack_int16(start, cbw.cb+6);
+		if(transfer_length > sizeof(scratch)) {
+			va_end(ap);
+			fprintf(stderr, "Cannot read %d bytes of raw data\n", transfer_length);
+			return(0);
+		}
+		transfer_out = scratch;
+	}
+	stlink_xact_v(&x, transfer_length, transfer_out, flags, cblength, ap);
+	va_end(ap);
+	if(stlink_run(pgm, &x, 1) != STLK_OK)
+		return(0);
+	return(x.csw.status == 0);
+}
+
+int stlink_cmd_swim_read(scsi_usb_cbw *cbw, uint16_t length, uint16_t start) {
+	memset(cbw, 0, sizeof(scsi_usb_cbw));
+	cbw->transfer_length = length;
+	cbw->flags = 0x80;
+	cbw->cblength = 0x0a;
+	cbw->cb[0] = 0xf4;
+	cbw->cb[1] = 0x0c;
+	pack_int16(length, cbw->cb+2);
+	pack_int16(start, cbw->cb+6);
 	return 0;
 }
 
-void stlink_init_session(programmer_t *pgm) {
+/* Status polling
+ * The status read together with a SWIM command is usually ready already.
+ * If not, the status is polled with a wait that starts at STLK_POLL_MIN_US
+ * and doubles on every busy status, up to a ceiling that depends on the
+ * command, until the command has taken timeout_us.
+ */
+#define STLK_POLL_MIN_US 100
+#define STLK_POLL_MAX_US 2000
+#define STLK_POLL_SLOW_US 10000 // ceiling for the SWIM entry sequence
+#define STLK_POLL_TIMEOUT_US 2000000
+#define STLK_BYTE_TIMEOUT_US 10000
+#define STLK_STALL_US 40000
+
+/* Bit 0 of the status is set while the last command is still running, and
+ * also when it failed. A running command counts its bytes in the rest of
+ * the status word, a failed one leaves it as it is: a busy status that has
+ * not changed for STLK_STALL_US, like one still busy after timeout_us,
+ * counts as an error.
+ */
+#define STLK_FLAG_BUSY STLK_FLAG_ERR
+#define STLK_STATUS_USB_ERROR -1 // Not a SWIM status: the status could not be read
+
+static int stlink_swim_poll(programmer_t *pgm, int status, unsigned int ceiling_us, unsigned int timeout_us) {
+	unsigned long long begin = time_us(), changed = begin, now;
+	unsigned int wait = STLK_POLL_MIN_US;
+	int last;
+	while(status >= 0 && (status & STLK_FLAG_BUSY) && (now = time_us()) - begin < timeout_us) {
+		if(now - changed >= STLK_STALL_US) {
+			pgm->link.stalls++;
+			break;
+		}
+		usleep(wait);
+		pgm->poll_sleep_us += wait;
+		wait = (wait * 2 > ceiling_us ? ceiling_us : wait * 2);
+		pgm->status_polls++;
+		last = status;
+		status = stlink_swim_get_status(pgm);
+		if(status != last)
+			changed = time_us();
+	}
+	return(status);
+}
+
+// The outcome of a command from its polled status
+static stlink_status_t stlink_swim_result(int status) {
+	if(status < 0)
+		return(STLK_USB_ERROR);
+	if(status & STLK_FLAG_ERR)
+		return(STLK_SWIM_ERROR);
+	return(STLK_OK);
+}
+
+// Runs a SWIM command together with reading the status it leaves behind, and waits for it
+static stlink_status_t stlink_swim_cmd(programmer_t *pgm, int cblength, ...) {
+	stlink_xact_t x[2];
+	unsigned char buf[4];
+	va_list ap;
+	va_start(ap, cblength);
+	stlink_xact_v(&x[0], 0, NULL, 0x00, cblength, ap);
+	va_end(ap);
+	stlink_xact_status(&x[1], buf);
+	if(stlink_run(pgm, x, 2) != STLK_OK)
+		return(STLK_USB_ERROR);
+	return(stlink_swim_result(stlink_swim_poll(pgm, unpack_int32_le(buf), STLK_POLL_SLOW_US, STLK_POLL_TIMEOUT_US)));
+}
+
+stlink_status_t stlink_init_session(programmer_t *pgm) {
 	int i;
+	stlink_status_t status = STLK_OK;
 	char f4_cmd_arg1[] = {	0x07,
 				0x07,
 				0x08,
 				0x07,
 				0x04,
 				};
-	for(i = 0; i < sizeof(f4_cmd_arg1); i++) {
-		stlink_cmd(pgm, 0, NULL, 0x00, 0x0a,
+	for(i = 0; i < sizeof(f4_cmd_arg1) && status == STLK_OK; i++) {
+		status = stlink_swim_cmd(pgm, 0x0a,
 				0xf4, f4_cmd_arg1[i],
 				0x01, 0x00,
 				0x00, 0x00,
 				0x00, 0x00,
 				0x00, 0x00);
-		stlink_swim_get_status(pgm);
 	}
-	do {
-		usleep(10000);
-	} while ((stlink_swim_get_status(pgm) & 1) != 0);
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x03,
+	if(status == STLK_SWIM_ERROR)
+		fprintf(stderr, "SWIM entry sequence did not complete\n");
+	if(status != STLK_OK)
+		return(status);
+	if((status = stlink_swim_cmd(pgm, 0x03,
 			0xf4, 0x03,
 			0x00, 0x00,
 			0x00, 0x00,
 			0x00, 0x00,
-			0x00, 0x00);
-	stlink_swim_get_status(pgm);
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x0a,
+			0x00, 0x00)) != STLK_OK ||
+	   (status = stlink_swim_cmd(pgm, 0x0a,
 			0xf4, 0x05,
 			0x00, 0x00,
 			0x00, 0x00,
 			0x00, 0x00,
-			0x00, 0x00);
-	stlink_swim_get_status(pgm);
-
-	stlink_swim_write_byte(pgm, 0xa0, 0x7f80); // mov 0x0a, SWIM_CSR2 ;; Init SWIM
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x0a,
+			0x00, 0x00)) != STLK_OK ||
+	   (status = stlink_swim_write_byte(pgm, 0xa0, 0x7f80)) != STLK_OK || // mov 0x0a, SWIM_CSR2 ;; Init SWIM
+	   (status = stlink_swim_cmd(pgm, 0x0a,
 			0xf4, 0x08,
 			0x00, 0x01,
 			0x00, 0x00,
 			0x7f, 0x80,
-			0xa0, 0x00);
-	stlink_swim_get_status(pgm);
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x0a,
+			0xa0, 0x00)) != STLK_OK ||
+	   (status = stlink_swim_cmd(pgm, 0x0a,
 			0xf4, 0x06,
 			0x00, 0x01,
 			0x00, 0x00,
 			0x7f, 0x99,
-			0xa0, 0x00);
-	stlink_swim_get_status(pgm);
-	stlink_swim_write_byte(pgm, 0xb0, 0x7f80); 
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x03, // Elsewise, only zeroes will be received
+			0xa0, 0x00)) != STLK_OK ||
+	   (status = stlink_swim_write_byte(pgm, 0xb0, 0x7f80)) != STLK_OK ||
+	   (status = stlink_swim_cmd(pgm, 0x03, // Elsewise, only zeroes will be received
 			0xf4, 0x03,
-			0x01);
-	stlink_swim_get_status(pgm);
-	stlink_swim_write_byte(pgm, 0xb4, 0x7f80); 
+			0x01)) != STLK_OK ||
+	   (status = stlink_swim_write_byte(pgm, 0xb4, 0x7f80)) != STLK_OK)
+		return(status);
+	return(STLK_OK);
 }
 
 void stlink_finish_session(programmer_t *pgm) {
+	// Best effort: the session is over whether or not the target hears it
 	stlink_swim_write_byte(pgm, 0xb6, 0x7f80);
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x0a,
+	stlink_swim_cmd(pgm, 0x0a,
 			0xf4, 0x05,
 			0x00, 0x01,
 			0x00, 0x00,
 			0x7f, 0x80,
 			0xb6, 0x00);
-	stlink_swim_get_status(pgm);
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x0a,
+	stlink_swim_cmd(pgm, 0x0a,
 			0xf4, 0x07,
 			0x00, 0x01,
 			0x00, 0x00,
 			0x7f, 0x80,
 			0xb6, 0x00);
-	stlink_swim_get_status(pgm);
-	stlink_cmd(pgm, 0, NULL, 0x00, 0x03,
+	stlink_swim_cmd(pgm, 0x03,
 			0xf4, 0x03,
 			0x01);
-	stlink_swim_get_status(pgm);
 }
 
-unsigned int stlink_swim_get_status(programmer_t *pgm) {
+// init_session/finish_session are only run once per programmer session
+static bool stlink_begin_session(programmer_t *pgm) {
+	if(!pgm->session.swim_active) {
+		if(stlink_init_session(pgm) != STLK_OK)
+			return(false);
+		pgm->session.swim_active = true;
+	}
+	return(true);
+}
+
+static void stlink_end_session(programmer_t *pgm) {
+	if(pgm->session.swim_active)
+		stlink_finish_session(pgm);
+	memset(&pgm->session, 0, sizeof(pgm->session));
+	regcache_clear(pgm);
+}
+
+static bool stlink_set_clock(programmer_t *pgm, const stm8_device_t *device) {
+	if(!pgm->session.clock_set) {
+		if(stlink_swim_write_byte(pgm, 0x00, device->regs.CLK_CKDIVR) != STLK_OK) // mov 0x00, CLK_DIVR
+			return(false);
+		pgm->session.clock_set = true;
+	}
+	return(true);
+}
+
+// Reset DUL and PUL in IAPSR to disable flash and data writes.
+static void stlink_session_lock(programmer_t *pgm) {
+	int iapsr;
+
+	if(pgm->session.flash_unlocked || pgm->session.data_unlocked) {
+		iapsr = stlink_swim_read_byte(pgm, pgm->session.device->regs.FLASH_IAPSR);
+		if(iapsr < 0 || stlink_swim_write_byte(pgm, iapsr & ~0x0a, pgm->session.device->regs.FLASH_IAPSR) != STLK_OK)
+			fprintf(stderr, "Could not lock flash and data memory after writing\n");
+	}
+	pgm->session.flash_unlocked = false;
+	pgm->session.data_unlocked = false;
+}
+
+int stlink_swim_get_status(programmer_t *pgm) {
+	stlink_xact_t x;
 	unsigned char buf[4];
-	stlink_cmd(pgm, 4, buf, 0x80, 0x0a,
-			0xf4, 0x09,
-			0x01, 0x00,
-			0x00, 0x00,
-			0x00, 0x00,
-			0x00, 0x00);
+	stlink_xact_status(&x, buf);
+	if(stlink_run(pgm, &x, 1) != STLK_OK)
+		return(STLK_STATUS_USB_ERROR);
 	return(unpack_int32_le(buf));
 }
 
 bool stlink_open(programmer_t *pgm) {
 	unsigned char buf[18];
 	pgm->out_msg_size = 31;
+	memset(&pgm->session, 0, sizeof(pgm->session));
+	regcache_clear(pgm);
 	stlink_test_unit_ready(pgm);
 	stlink_cmd(pgm, 0x06, buf, 0x80, 6, 0xf1, 0x80, 0x00, 0x00, 0x00, 0x00);
 	stlink_test_unit_ready(pgm);
 	stlink_cmd(pgm, 0x12, buf, 0x80, 6, 0x12, 0x80, 0x00, 0x00, 0x20);
 	stlink_test_unit_ready(pgm);
-	stlink_cmd(pgm, 2, buf, 0x80, 2, 0xf5, 0x00); // Reading status
+	if(!stlink_cmd(pgm, 2, buf, 0x80, 2, 0xf5, 0x00)) { // Reading status
+		fprintf(stderr, "Could not read the programmer status\n");
+		return(false);
+	}
 	stlink_test_unit_ready(pgm);
 	int status = unpack_int16_le(buf);
 	switch(status) {
 		case 0x0000: // Ok
-			stlink_cmd(pgm, 0, NULL, 0x80, 2, 0xf3, 0x07); // Start initializing sequence
-			stlink_cmd(pgm, 0, NULL, 0x00, 2, 0xf4, 0x00); // Turn the lights on
-			stlink_cmd(pgm, 2, buf, 0x80, 2, 0xf4, 0x0d);
-			stlink_cmd(pgm, 8, buf, 0x80, 3, 0xf4, 0x02, 0x01); // End init
+			if(!stlink_cmd(pgm, 0, NULL, 0x80, 2, 0xf3, 0x07) || // Start initializing sequence
+			   !stlink_cmd(pgm, 0, NULL, 0x00, 2, 0xf4, 0x00) || // Turn the lights on
+			   !stlink_cmd(pgm, 2, buf, 0x80, 2, 0xf4, 0x0d) ||
+			   !stlink_cmd(pgm, 8, buf, 0x80, 3, 0xf4, 0x02, 0x01)) { // End init
+				fprintf(stderr, "Could not initialize the programmer\n");
+				return(false);
+			}
 		case 0x0003: // Already initialized
 			return(true);
 		case 0x0001: // Busy
@@ -347,41 +667,48 @@ bool stlink_open(programmer_t *pgm) {
 }
 
 void stlink_close(programmer_t *pgm) {
+	stlink_session_lock(pgm);
+	stlink_end_session(pgm);
 }
 
 void stlink_swim_srst(programmer_t *pgm) {
-	// Ready bytes count (always 1 here)
-	stlink_cmd(pgm, 0, NULL, 0x80, 0x0a,
+	// The reset locks the memories again, so only the SWIM session is finished
+	stlink_end_session(pgm);
+	stlink_swim_cmd(pgm, 0x0a,
 			0xf4, 0x08, 
 			0x00, 0x01,
 			0x00, 0x00, 
 			0x00, 0x00, 
 			0x00, 0x00);
-	stlink_swim_get_status(pgm);
 }
 
-int stlink_swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start) {
+stlink_status_t stlink_swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start) {
+	stlink_xact_t x[2];
 	unsigned char buf[4], start2[2];
 	int result, tries = 0;
 	pack_int16(start, start2);
 	DEBUG_PRINT("stlink_swim_write_byte\n");
+	regcache_invalidate(pgm, start, 1);
 	do {
-		stlink_cmd(pgm, 0, NULL, 0x00, 0x10,
+		stlink_xact(&x[0], 0, NULL, 0x00, 0x10,
 				0xf4, 0x0a, 
 				0x00, 0x01,
 				0x00, 0x00,
 				start2[0], start2[1],
 				byte, 0x00,
 				0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-		usleep(2000);
 		// Ready bytes count (always 1 here)
-		stlink_cmd(pgm, 4, buf, 0x80, 0x0a,
+		stlink_xact(&x[1], 4, buf, 0x80, 0x0a,
 				0xf4, 0x09, 
 				0x00, 0x01,
 				0x00, 0x00, 
 				start2[0], start2[1],
 				byte, 0x00);
-		result = unpack_int16_le(buf);
+		if(stlink_run(pgm, x, 2) != STLK_OK)
+			return(STLK_USB_ERROR);
+		result = stlink_swim_poll(pgm, unpack_int16_le(buf), STLK_POLL_MAX_US, STLK_BYTE_TIMEOUT_US);
+		if(result < 0)
+			return(STLK_USB_ERROR);
 		tries++;
 		if(result & STLK_FLAG_BUFFER_FULL) {
 			usleep(4000); // Chill out
@@ -390,161 +717,326 @@ int stlink_swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int s
 		}
 		if(result & STLK_FLAG_ERR)
 			break;
-	} while(result & STLK_FLAG_ERR && tries < 5);
-	return(result);
+	} while(result & (STLK_FLAG_ERR | STLK_FLAG_BUFFER_FULL) && tries < 5);
+	if(result & STLK_FLAG_BUFFER_FULL) {
+		fprintf(stderr, "SWIM buffer still full after %d tries\n", tries);
+		return(STLK_SWIM_ERROR);
+	}
+	return(stlink_swim_result(result));
 }
 
-int stlink_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length) {
-	DEBUG_PRINT("stlink_swim_read_range\n");
-	stlink_init_session(pgm);
-	stlink_swim_write_byte(pgm, 0x00, device->regs.CLK_CKDIVR); // mov 0x00, CLK_DIVR
+// Fills x with READMEM (start a SWIM read) or READBUF (fetch its data)
+static void stlink_xact_swim_read(stlink_xact_t *x, unsigned int subcmd, unsigned char *buffer, unsigned int start, unsigned int length) {
+	unsigned char block_start2[2], block_size2[2];
+	pack_int16(start, block_start2);
+	pack_int16(length, block_size2);
+	stlink_xact(x, subcmd == 0x0c ? length : 0, buffer, 0x80, 0x0a,
+			0xf4, subcmd,
+			block_size2[0], block_size2[1],
+			0x00, 0x00,
+			block_start2[0], block_start2[1],
+			0x00, 0x00);
+}
+
+// Returns the byte at addr, or -1 on error
+static int stlink_swim_read_byte(programmer_t *pgm, unsigned int addr) {
+	stlink_xact_t x[2];
+	unsigned char status[4], byte;
+	int result;
+
+	stlink_xact_swim_read(&x[0], 0x0b, NULL, addr, 1);
+	stlink_xact_status(&x[1], status);
+	if(stlink_run(pgm, x, 2) != STLK_OK)
+		return(-1);
+	result = stlink_swim_poll(pgm, unpack_int32_le(status), STLK_POLL_MAX_US, STLK_BYTE_TIMEOUT_US);
+	if(stlink_swim_result(result) != STLK_OK)
+		return(-1);
+	stlink_xact_swim_read(&x[0], 0x0c, &byte, addr, 1);
+	if(stlink_run(pgm, x, 1) != STLK_OK)
+		return(-1);
+	return(byte);
+}
+
+/* Error recovery
+ * After a SWIM error the SWIM line is reset and, as with stlink2_recover,
+ * the failed block is written again or the read resumed where it failed.
+ * Each read_range or write_range call tolerates pgm->swim_error_budget
+ * errors (STLK_MAX_SWIM_ERRORS if negative).
+ */
+#define STLK_MAX_SWIM_ERRORS 8
+
+static bool stlink_recover(programmer_t *pgm) {
+	unsigned int budget = (pgm->swim_error_budget < 0 ? STLK_MAX_SWIM_ERRORS : pgm->swim_error_budget);
+
+	if(pgm->swim_errors++ - pgm->swim_errors_mark >= budget) {
+		fprintf(stderr, "Giving up after %u SWIM errors\n", pgm->swim_errors - pgm->swim_errors_mark);
+		return(false);
+	}
+	DEBUG_PRINT("recovering from SWIM error %u\n", pgm->swim_errors);
+	// The failed command may have left target registers in any state
+	regcache_clear(pgm);
+	return(stlink_swim_cmd(pgm, 0x0a,
+			0xf4, 0x06,
+			0x00, 0x00,
+			0x00, 0x00,
+			0x00, 0x00,
+			0x00, 0x00) == STLK_OK);
+}
+
+// Returns the number of bytes read before the first error
+static int stlink_swim_read_mem(programmer_t *pgm, unsigned char *buffer, unsigned int start, unsigned int length) {
+	stlink_xact_t x[3];
+	unsigned char status[4];
+	unsigned int n = 0;
+	int result;
 	int i;
 	for(i = 0; i < length; i += STLK_READ_BUFFER_SIZE) {
-		unsigned char block_start2[2], block_size2[2];
-		int block_start = start + i;
 		// Determining block size
 		int block_size = length - i;
 		if(block_size > STLK_READ_BUFFER_SIZE)
 			block_size = STLK_READ_BUFFER_SIZE;
-		DEBUG_PRINT("Reading %d bytes from %x\n", block_size, block_start);
-		// Starting SWIM transfer
-		pack_int16(block_start, block_start2);
-		pack_int16(block_size, block_size2);
-		stlink_cmd(pgm, 0, NULL, 0x80, 0x0a,
-				0xf4, 0x0b, 
-				block_size2[0], block_size2[1],
-				0x00, 0x00, 
-				block_start2[0], block_start2[1],
-				0x00, 0x00);
+		DEBUG_PRINT("Reading %d bytes from %x\n", block_size, start + i);
+		// Starting SWIM transfer, behind downloading the previous block
+		stlink_xact_swim_read(&x[n++], 0x0b, NULL, start + i, block_size);
+		stlink_xact_status(&x[n++], status);
+		if(stlink_run(pgm, x, n) != STLK_OK)
+			return(i > 0 ? i - STLK_READ_BUFFER_SIZE : 0);
+		n = 0;
 		// Waiting until the data becomes ready
-		int result;
-		do {
-			usleep(2000);
-			result = stlink_swim_get_status(pgm);
-		} while(result & 1);
+		result = stlink_swim_poll(pgm, unpack_int32_le(status), STLK_POLL_MAX_US, STLK_POLL_TIMEOUT_US);
+		if(result < 0)
+			return(i);
+		if(result & STLK_FLAG_ERR) {
+			fprintf(stderr, "SWIM error reading %d bytes from 0x%x\n", block_size, start + i);
+			return(i);
+		}
 		// Downloading bytes from stlink
-		stlink_cmd(pgm, block_size, &(buffer[i]), 0x80, 0x0a,
-				0xf4, 0x0c, 
-				block_size2[0], block_size2[1],
-				0x00, 0x00, 
-				block_start2[0], block_start2[1],
-				0x00, 0x00);
+		stlink_xact_swim_read(&x[n++], 0x0c, buffer + i, start + i, block_size);
 	}
-	stlink_finish_session(pgm);
+	if(n && stlink_run(pgm, x, n) != STLK_OK)
+		return(i - STLK_READ_BUFFER_SIZE);
 	return(length);
 }
 
-int stlink_swim_wait(programmer_t *pgm) {
-	int result;
-	do {
-		usleep(3000);
-		result = stlink_swim_get_status(pgm);
-	} while(result & 1);
-	return(result);
+int stlink_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length) {
+	unsigned int done = 0;
+	DEBUG_PRINT("stlink_swim_read_range\n");
+	if(!stlink_begin_session(pgm) || !stlink_set_clock(pgm, device))
+		return(0);
+	pgm->swim_errors_mark = pgm->swim_errors;
+	for(;;) {
+		done += stlink_swim_read_mem(pgm, buffer + done, start + done, length - done);
+		if(done >= length || !stlink_recover(pgm))
+			return(done);
+		pgm->read_retries++;
+	}
 }
 
-int stlink_swim_write_block(programmer_t *pgm, unsigned char *buffer,
+static stlink_status_t stlink_swim_write_block(programmer_t *pgm, unsigned char *buffer,
 			unsigned int start,
 			unsigned int length,
 			unsigned int padding
 			) {
+	stlink_xact_t x[2];
+	unsigned char status[4];
+	unsigned char tail[STLK_MAX_WRITE-6];
 	int length1 = 8 - padding; // Amount to be transferred with CBW
 	int length2 = length - 8 + padding; // Amount to be transferred with additional transfer
 	if (length2 < 0) length2 = 0;
 	unsigned char block_size2[2], block_start2[2];
 	pack_int16(start, block_start2);
 	pack_int16(length, block_size2);
+	regcache_invalidate(pgm, start, length);
 	// Some logical checks
-	assert(padding >= 0 && padding <= 1);
-	assert(length1 + length2 == length);
-	assert(length1 + padding <= 8);
-	assert(length2 < STLK_MAX_WRITE - 6);
-	assert(length1 > 0);
-	assert(length2 > 0);
-	// Filling CBW
-	memset(&cbw, 0, sizeof(scsi_usb_cbw));
-	cbw.transfer_length = length2 + padding;
-	cbw.flags = 0x00;
-	cbw.cblength = 0x10;
-	cbw.cb[0] = 0xf4;
-	cbw.cb[1] = 0x0a;
-	memcpy(cbw.cb+2, block_size2, 2);
-	memcpy(cbw.cb+6, block_start2, 2);
-	memcpy(cbw.cb+8+padding, buffer, length1);
-	if(padding) cbw.cb[8] = '\0';
-	assert( stlink_send_cbw(pgm->dev_handle, &cbw) == 0);
-	usleep(3000);
-	if(length2) {
-		// Sending the rest
-		unsigned char tail[STLK_MAX_WRITE-6];
-		memcpy(tail, buffer + length1, length2);
-		if(padding) tail[length2] = '\1';
-		int actual;
-		int r = libusb_bulk_transfer(pgm->dev_handle,
-				(2 | LIBUSB_ENDPOINT_OUT),
-				tail,
-				length2 + padding,
-				&actual,
-				0);
-		assert(r == 0);
-		assert(actual == length2 + padding);
-	}
-	// Reading status
-	stlink_read_csw(pgm->dev_handle, &csw);
-	assert(csw.status == 0);
-	memset(cbw.cb+8, 0, 8);
-	cbw.cb[8] = 0x01;
-	cbw.cb[9] = 0x02;
-	int result = stlink_swim_wait(pgm);
-	return(result);
+	if(padding > 1 || length1 <= 0 || length2 <= 0 || length2 + padding > sizeof(tail)) {
+		fprintf(stderr, "Cannot write a block of %u bytes\n", length);
+		return(STLK_SWIM_ERROR);
+	}
+	// Filling CBW, the rest is sent in the data stage
+	memcpy(tail, buffer + length1, length2);
+	if(padding) tail[length2] = '\1';
+	stlink_xact(&x[0], length2 + padding, tail, 0x00, 0x10,
+			0xf4, 0x0a,
+			block_size2[0], block_size2[1],
+			0x00, 0x00,
+			block_start2[0], block_start2[1]);
+	memcpy(x[0].cbw.cb+8+padding, buffer, length1);
+	if(padding) x[0].cbw.cb[8] = '\0';
+	stlink_xact_status(&x[1], status);
+	if(stlink_run(pgm, x, 2) != STLK_OK)
+		return(STLK_USB_ERROR);
+	if(x[0].csw.status != 0)
+		return(STLK_SWIM_ERROR);
+	return(stlink_swim_result(stlink_swim_poll(pgm, unpack_int32_le(status), STLK_POLL_MAX_US, STLK_POLL_TIMEOUT_US)));
 }
 
-int stlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype) {
-	int i;
-	stlink_init_session(pgm);
-	stlink_swim_write_byte(pgm, 0x00, device->regs.CLK_CKDIVR);
-    if(memtype == FLASH || memtype == EEPROM || memtype == OPT) {
-        stlink_swim_write_byte(pgm, 0x00, device->regs.FLASH_IAPSR);
+// Sets the CPU stall bit in DM_CSR2, reading and writing it only if the cache does not know it is set
+static bool stlink_stall_cpu(programmer_t *pgm, const stm8_device_t *device) {
+	unsigned int addr = device->regs.FLASH_DM_CSR2;
+	unsigned char csr;
+	int byte;
+
+	if(!regcache_get(pgm, addr, &csr)) {
+		if((byte = stlink_swim_read_byte(pgm, addr)) < 0)
+			return(false);
+		csr = byte;
+		regcache_set(pgm, addr, csr);
+	}
+	if(regcache_unchanged(pgm, addr, csr | 0x08))
+		return(true);
+	if(stlink_swim_write_byte(pgm, csr | 0x08, addr) != STLK_OK)
+		return(false);
+	regcache_set(pgm, addr, csr | 0x08);
+	return(true);
+}
+
+// Returns EOP_OK or the reason the block failed
+static int stlink_write_block(programmer_t *pgm, const stm8_device_t *device, unsigned char *block, unsigned int addr, int prgmode, const memtype_t memtype) {
+	DEBUG_PRINT("Writing block %04x with size %d\n", addr, device->flash_block_size);
+    if(memtype == FLASH || memtype == EEPROM) {
+        // Stall the CPU before entering block programming mode, as
+        // stlink2_write_block does. The bit stays set until the target is
+        // reset, so after the first block it comes from the cache.
+        if(!stlink_stall_cpu(pgm, device))
+            return(EOP_IO_ERROR);
+        if(stlink_swim_write_byte(pgm, prgmode, device->regs.FLASH_CR2) != STLK_OK)
+            return(EOP_IO_ERROR);
+        if(device->regs.FLASH_NCR2 != 0) { // Device have FLASH_NCR2 register
+            if(stlink_swim_write_byte(pgm, ~prgmode, device->regs.FLASH_NCR2) != STLK_OK)
+                return(EOP_IO_ERROR);
+        }
     }
-    if(memtype == FLASH) {
-        stlink_swim_write_byte(pgm, 0x56, device->regs.FLASH_PUKR);
-        stlink_swim_write_byte(pgm, 0xae, device->regs.FLASH_PUKR); 
+	if(stlink_swim_write_block(pgm, block, addr, device->flash_block_size, 0) != STLK_OK) {
+		fprintf(stderr, "Write error at 0x%04x\n", addr);
+		return(EOP_IO_ERROR);
+	}
+	// The next block must not be sent while this one is programmed
+	if(memtype == FLASH || memtype == EEPROM) {
+		int result = eop_wait(pgm, device, eop_mode(prgmode), stlink_swim_read_byte);
+		if(result != EOP_OK) {
+			fprintf(stderr, "Programming failed at 0x%04x\n", addr);
+			return(result);
+		}
+	}
+	return(EOP_OK);
+}
+
+// Block writer for blockwrite_range, retrying blocks that failed with a SWIM error
+static int stlink_program_block(programmer_t *pgm, const stm8_device_t *device, unsigned char *block, unsigned int addr, int prgmode, const memtype_t memtype) {
+	int result;
+
+	while((result = stlink_write_block(pgm, device, block, addr, prgmode, memtype)) != EOP_OK) {
+		if(result == EOP_WR_PG_DIS || !stlink_recover(pgm))
+			return(result);
+		// The failed attempt may have programmed part of the block
+		prgmode = 0x01;
+		pgm->block_retries++;
+	}
+	return(0);
+}
+
+// Option bytes are programmed one byte at a time in option programming mode
+static int stlink_write_opt(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length) {
+	// Only program the bytes that differ, unless forced
+	unsigned char *current = pgm->force_write ? NULL : malloc(length);
+	bool diff = current && stlink_swim_read_range(pgm, device, current, start, length) == length;
+	unsigned int i, skipped = 0;
+
+	if(stlink_swim_write_byte(pgm, 0x80, device->regs.FLASH_CR2) != STLK_OK ||
+	   (device->regs.FLASH_NCR2 != 0 && stlink_swim_write_byte(pgm, 0x7f, device->regs.FLASH_NCR2) != STLK_OK)) {
+		free(current);
+		return(0);
+	}
+	for(i = 0; i < length; i++) {
+		if(diff && current[i] == buffer[i]) {
+			skipped++;
+			continue;
+		}
+		if(stlink_swim_write_byte(pgm, buffer[i], start + i) != STLK_OK ||
+		   eop_wait(pgm, device, EOP_BYTE, stlink_swim_read_byte) != EOP_OK) {
+			fprintf(stderr, "Write error at 0x%04x\n", start + i);
+			break;
+		}
+	}
+	if(skipped)
+		fprintf(stderr, "%u of %u option bytes unchanged, not programmed\n", skipped, length);
+	free(current);
+	return(i);
+}
+
+int stlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype) {
+	pgm->swim_errors_mark = pgm->swim_errors;
+	if(!stlink_begin_session(pgm) || !stlink_set_clock(pgm, device) ||
+	   eop_clear(pgm, device, stlink_swim_read_byte) != EOP_OK)
+		return(0);
+    bool unlocked = (memtype == FLASH && pgm->session.flash_unlocked) ||
+                    ((memtype == EEPROM || memtype == OPT) && pgm->session.data_unlocked);
+    // The keys alone unlock; writing IAPSR would clear PUL/DUL again
+    if(memtype == FLASH && !unlocked) {
+        if(stlink_swim_write_byte(pgm, 0x56, device->regs.FLASH_PUKR) != STLK_OK ||
+           stlink_swim_write_byte(pgm, 0xae, device->regs.FLASH_PUKR) != STLK_OK)
+            return(0);
+        pgm->session.flash_unlocked = true;
     }
-    if(memtype == EEPROM || memtype == OPT) {
-        stlink_swim_write_byte(pgm, 0xae, device->regs.FLASH_DUKR);
-        stlink_swim_write_byte(pgm, 0x56, device->regs.FLASH_DUKR);
+    if((memtype == EEPROM || memtype == OPT) && !unlocked) {
+        if(stlink_swim_write_byte(pgm, 0xae, device->regs.FLASH_DUKR) != STLK_OK ||
+           stlink_swim_write_byte(pgm, 0x56, device->regs.FLASH_DUKR) != STLK_OK)
+            return(0);
+        pgm->session.data_unlocked = true;
     }
-    if(memtype == FLASH || memtype == EEPROM || memtype == OPT) {
-        stlink_swim_write_byte(pgm, 0x56, device->regs.FLASH_IAPSR);
+    pgm->session.device = device;
+    int written;
+    // Option bytes may change the protection right away, so they are not kept
+    // unlocked; flash and EEPROM are locked when the session ends.
+    if(memtype == OPT) {
+        written = stlink_write_opt(pgm, device, buffer, start, length);
+        stlink_session_lock(pgm);
+    } else {
+        written = blockwrite_range(pgm, device, buffer, start, length, memtype, true, stlink_program_block);
     }
-    int flash_block_size = device->flash_block_size;
-	for(i = 0; i < length; i+=flash_block_size) {
-		unsigned char block[128];
-		memset(block, 0, sizeof(block));
-		int block_size = length - i;
-		if(block_size > flash_block_size)
-			block_size = flash_block_size;
-		DEBUG_PRINT("Writing block %04x with size %d\n", start+i, block_size);
-		memcpy(block, buffer+i, block_size);
-		if(block_size < flash_block_size) {
-			DEBUG_PRINT("Padding block %04x with %d zeroes\n",
-					start+i,
-					flash_block_size - block_size);
-			block_size = flash_block_size;
-		}
-        if(memtype == FLASH || memtype == EEPROM || memtype == OPT) {
-            stlink_swim_write_byte(pgm, 0x01, device->regs.FLASH_CR2);
-            if(device->regs.FLASH_NCR2 != 0) { // Device have FLASH_NCR2 register
-                stlink_swim_write_byte(pgm, 0xFE, device->regs.FLASH_NCR2);
-            }
-        }
-		int result = stlink_swim_write_block(pgm, block, start + i, block_size, 0);
-		if(result & STLK_FLAG_ERR)
-			fprintf(stderr, "Write error\n");
+	return(written);
+}
+
+void stlink_print_stats(programmer_t *pgm) {
+	static const char * const swim_cmd_names[] = {
+		"ENTER", "EXIT", "READ_CAP", "SPEED", "ENTER_SEQ", "GEN_RST", "RESET",
+		"ASSERT_RESET", "DEASSERT_RESET", "READSTATUS", "WRITEMEM", "READMEM",
+		"READBUF", "READ_BUFSIZE",
+	};
+	unsigned long long command_us = 0;
+	unsigned int cmd, b;
+
+	fprintf(stderr, "SWIM command latency (us):\n");
+	fprintf(stderr, "  %-16s %7s %7s %7s", "command", "count", "avg", "max");
+	for (b = 0; b < PGM_LATENCY_BUCKETS - 1; b++) {
+		char label[16];
+		snprintf(label, sizeof(label), "<%llu", PGM_LATENCY_MIN_US << b);
+		fprintf(stderr, " %7s", label);
 	}
-    if(memtype == FLASH || memtype == EEPROM || memtype == OPT) {
-        stlink_swim_write_byte(pgm, 0x56, device->regs.FLASH_IAPSR);
-    }
-	stlink_finish_session(pgm);
-	return(length);
+	fprintf(stderr, " %7s\n", "more");
+
+	for (cmd = 0; cmd < PGM_LATENCY_CMDS; cmd++) {
+		pgm_latency_t *l = &pgm->swim_latency[cmd];
+
+		if (!l->count)
+			continue;
+		command_us += l->total_us;
+		fprintf(stderr, "  %-16s %7u %7llu %7llu",
+			cmd < sizeof(swim_cmd_names) / sizeof(swim_cmd_names[0]) ? swim_cmd_names[cmd] : "?",
+			l->count, l->total_us / l->count, l->max_us);
+		for (b = 0; b < PGM_LATENCY_BUCKETS; b++)
+			fprintf(stderr, " %7u", l->buckets[b]);
+		fprintf(stderr, "\n");
+	}
+
+	fprintf(stderr, "USB transfers: %u total, %u command runs repeated after USB errors\n",
+		pgm->usb_transfers, pgm->usb_retries);
+	fprintf(stderr, "SWIM errors: %u, stalls: %u (%u blocks retried, %u reads resumed)\n",
+		pgm->swim_errors, pgm->link.stalls, pgm->block_retries, pgm->read_retries);
+	if (command_us + pgm->poll_sleep_us)
+		fprintf(stderr, "Status polls: %u, %llu us asleep between them (%.1f%% of %llu us spent on SWIM commands)\n",
+			pgm->status_polls, pgm->poll_sleep_us,
+			100.0 * pgm->poll_sleep_us / (command_us + pgm->poll_sleep_us),
+			command_us + pgm->poll_sleep_us);
+	eop_print_stats(pgm);
 }
@@ -51,5 +51,6 @@ void stlink_close(programmer_t *pgm);
 void stlink_swim_srst(programmer_t *pgm);
 int stlink_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length);
 int stlink_swim_write_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype);
+void stlink_print_stats(programmer_t *pgm);
 
 #endif
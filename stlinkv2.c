@@ -8,11 +8,14 @@
 #include <string.h>
 #include <unistd.h>
 #include "stlinkv2.h"
+#include "stlink.h"
 #include "error.h"
-#include "try.h"
 #include "byte_utils.h"
 #include "stlinkv2.h"
 #include "utils.h"
+#include "regcache.h"
+#include "eop.h"
+#include "blockwrite.h"
 
 
 /* Use high speed SWIM mode.
@@ -29,6 +32,23 @@
  */
 #define ONLY_WRITE_DIFFS        1
 
+/* Pipeline range reads.
+ * If set to 1 then the SWIM_READBUF command of a range read and the IN
+ * transfer for its data are submitted together (using asynchronous libusb
+ * transfers) instead of waiting for each USB transfer to complete before
+ * starting the next one. READMEM overwrites the programmer's buffer, and
+ * nothing guarantees that the firmware has sent all of it by the time it
+ * accepts the next command, so the READMEM for the next chunk only goes
+ * along with them if the programmer double buffers (see
+ * stlink2_probe_double_buffer); otherwise it waits until the data has arrived.
+ */
+#define USE_ASYNC_READ          1
+
+/* Oldest ST-Link/V2 SWIM firmware whose WRITEMEM payload is probed for
+ * single frame transfers (STLINK-V3 always is). Older firmware drops the
+ * bytes after the command, so it is not worth the probe.
+ */
+#define SINGLE_FRAME_MIN_SWIM   7
 
 #define MAX_SWIM_ERRORS         8
 
@@ -68,17 +88,38 @@
 #define SWIM_READBUF            0x0c
 #define SWIM_READBUFSIZE        0x0d
 
-#if DEBUG
-#undef nSTR
-#define nSTR(name)	[name] = #name + 6
-static const char * const debug_cmd_map[] = {
-	nSTR(DEBUG_EXIT),
-};
-
-#undef nSTR
-#define nSTR(name)	[name] = #name + 4
-static const char * const dfu_cmd_map[] = {
-	nSTR(DFU_EXIT),
+/* USB deadlines.
+ * Every USB transfer must complete within a deadline: command and status
+ * messages within pgm->usb_timeout_ms, data within pgm->usb_data_timeout_ms
+ * (USB_CMD_TIMEOUT_MS/USB_DATA_TIMEOUT_MS if not set). Short transfers are
+ * continued after a backoff that starts at USB_RETRY_MIN_US and doubles up to
+ * USB_RETRY_MAX_US. A transfer that does not complete in time is reported as
+ * STLK_USB_ERROR, so the caller can retry instead of giving up on the session.
+ */
+#define USB_CMD_TIMEOUT_MS      1000
+#define USB_DATA_TIMEOUT_MS     5000
+#define USB_RETRY_MIN_US        100
+#define USB_RETRY_MAX_US        1000
+
+/* Status polling.
+ * After a SWIM command the status is polled with a wait that starts at
+ * SWIM_POLL_MIN_US and doubles on every busy status, up to a per-command
+ * ceiling (swim_poll_ceiling_us, SWIM_POLL_MAX_US if not listed). A command
+ * has failed once its status has not changed for SWIM_STALL_US.
+ */
+#define SWIM_STATUS_USB_ERROR   -1 // Not a SWIM status: the status could not be read
+
+#define SWIM_POLL_MIN_US        100
+#define SWIM_POLL_MAX_US        2000
+#define SWIM_STALL_US           40000
+
+static const unsigned int swim_poll_ceiling_us[] = {
+	[SWIM_ENTER_SEQ] = 10000,
+	[SWIM_GEN_RST] = 10000,
+	[SWIM_RESET] = 10000,
+	[SWIM_ASSERT_RESET] = 10000,
+	[SWIM_DEASSERT_RESET] = 10000,
+	[SWIM_READMEM] = 5000,
 };
 
 #undef nSTR
@@ -100,6 +141,19 @@ static const char * const swim_cmd_map[] = {
 	nSTR(SWIM_READBUFSIZE),
 };
 
+#if DEBUG
+#undef nSTR
+#define nSTR(name)	[name] = #name + 6
+static const char * const debug_cmd_map[] = {
+	nSTR(DEBUG_EXIT),
+};
+
+#undef nSTR
+#define nSTR(name)	[name] = #name + 4
+static const char * const dfu_cmd_map[] = {
+	nSTR(DFU_EXIT),
+};
+
 #undef nSTR
 #define nSTR(name)	[name - STLINK_GET_VERSION] = #name + 7
 static const char * const stlink_cmd_map[] = {
@@ -149,63 +203,154 @@ static const char * const subcmd_to_str(unsigned int cmd, unsigned int subcmd) {
 
 unsigned char *pack_int16(uint16_t word, unsigned char *out);
 
-unsigned int read_buf_size = 6144;
 
-static void swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start);
+static stlink_status_t swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start);
 static int swim_read_byte(programmer_t *pgm, unsigned int addr);
 
-static unsigned int msg_transfer(programmer_t *pgm, unsigned char *buf, unsigned int length, int direction) {
-	int bytes_transferred = 0;
+static int msg_endpoint(programmer_t *pgm, int direction) {
 	int ep = (direction == LIBUSB_ENDPOINT_OUT) ? 2 : 1;
 	if (pgm->type == STLinkV21 || pgm->type == STLinkV3)
 		ep = 1;
-	libusb_bulk_transfer(pgm->dev_handle, ep | direction, buf, length, &bytes_transferred, 0);
-	if(bytes_transferred != length) ERROR2("IO error: expected %d bytes but %d bytes transferred\n", length, bytes_transferred);
-	return bytes_transferred;
+	return ep | direction;
+}
+
+// Command and status messages are at most 16 bytes; anything longer carries data.
+static unsigned int msg_timeout(programmer_t *pgm, unsigned int length) {
+	if (length <= 16)
+		return pgm->usb_timeout_ms ? pgm->usb_timeout_ms : USB_CMD_TIMEOUT_MS;
+	return pgm->usb_data_timeout_ms ? pgm->usb_data_timeout_ms : USB_DATA_TIMEOUT_MS;
 }
 
-static void msg_send(programmer_t *pgm, unsigned char *buf, unsigned int length) {
+static stlink_status_t msg_transfer(programmer_t *pgm, unsigned char *buf, unsigned int length, int direction) {
+	unsigned long long deadline = time_us() + msg_timeout(pgm, length) * 1000ULL;
+	unsigned int backoff = USB_RETRY_MIN_US;
+	int ep = msg_endpoint(pgm, direction);
+	int r = 0;
+
 	while (length > 0) {
-		int n = msg_transfer(pgm, buf, length, LIBUSB_ENDPOINT_OUT);
+		unsigned long long now = time_us();
+		int n = 0;
+
+		if (now >= deadline) {
+			fprintf(stderr, "IO error: %d bytes still to be %s (%s)\n", length,
+				direction == LIBUSB_ENDPOINT_OUT ? "sent" : "received",
+				r ? libusb_error_name(r) : "short transfer");
+			return STLK_USB_ERROR;
+		}
 
+		r = libusb_bulk_transfer(pgm->dev_handle, ep, buf, length, &n, (deadline - now + 999) / 1000);
+		pgm->usb_transfers++;
 		length -= n;
 		buf += n;
 
+		if (r == LIBUSB_ERROR_PIPE) {
+			libusb_clear_halt(pgm->dev_handle, ep);
+		} else if (r && r != LIBUSB_ERROR_TIMEOUT && r != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "IO error: %s\n", libusb_error_name(r));
+			return STLK_USB_ERROR;
+		}
+
 		if (length > 0) {
-			DEBUG_PRINT("    short write - %d bytes still to go\n", length);
-			usleep(1000000);
+			DEBUG_PRINT("    short %s - %d bytes still to go\n", direction == LIBUSB_ENDPOINT_OUT ? "write" : "read", length);
+			usleep(backoff);
+			backoff = (backoff * 2 > USB_RETRY_MAX_US ? USB_RETRY_MAX_US : backoff * 2);
 		}
 	}
+	return STLK_OK;
 }
 
-static void msg_recv(programmer_t *pgm, unsigned char *buf, unsigned int length) {
-	int n;
+// Clear both endpoints after transfers the firmware did not take as expected
+static void msg_resync(programmer_t *pgm) {
+	libusb_clear_halt(pgm->dev_handle, msg_endpoint(pgm, LIBUSB_ENDPOINT_OUT));
+	libusb_clear_halt(pgm->dev_handle, msg_endpoint(pgm, LIBUSB_ENDPOINT_IN));
+}
 
-	while (length > 0) {
-		n = msg_transfer(pgm, buf, length, LIBUSB_ENDPOINT_IN);
-		length -= n;
-		buf += n;
+static stlink_status_t msg_send(programmer_t *pgm, unsigned char *buf, unsigned int length) {
+	return msg_transfer(pgm, buf, length, LIBUSB_ENDPOINT_OUT);
+}
 
-		if (length > 0) {
-			DEBUG_PRINT("    short read - %d bytes more needed\n", length);
-			usleep(1000000);
+static stlink_status_t msg_recv(programmer_t *pgm, unsigned char *buf, unsigned int length) {
+	return msg_transfer(pgm, buf, length, LIBUSB_ENDPOINT_IN);
+}
+
+typedef struct {
+	unsigned char *buf;
+	unsigned int length;
+	int direction;
+	struct libusb_transfer *transfer;
+	int done;
+} msg_async_t;
+
+static void LIBUSB_CALL msg_async_done(struct libusb_transfer *transfer) {
+	*(int *)transfer->user_data = 1;
+}
+
+/* Submit all messages at once and wait until every one of them completed.
+ * Transfers on the same endpoint complete in submission order. If the
+ * asynchronous API is not usable, the remaining messages are sent
+ * synchronously instead.
+ */
+static stlink_status_t msg_transfer_async(programmer_t *pgm, msg_async_t *msgs, unsigned int count) {
+	stlink_status_t status = STLK_OK;
+	unsigned int i, submitted;
+
+	for (submitted = 0; submitted < count; submitted++) {
+		msg_async_t *m = &msgs[submitted];
+
+		m->done = 0;
+		m->transfer = libusb_alloc_transfer(0);
+		if (!m->transfer)
+			break;
+		libusb_fill_bulk_transfer(m->transfer, pgm->dev_handle, msg_endpoint(pgm, m->direction),
+				m->buf, m->length, msg_async_done, &m->done, msg_timeout(pgm, m->length));
+		if (libusb_submit_transfer(m->transfer)) {
+			libusb_free_transfer(m->transfer);
+			break;
 		}
+		pgm->usb_transfers++;
 	}
+
+	for (i = 0; i < submitted; i++) {
+		msg_async_t *m = &msgs[i];
+
+		// Every transfer has a timeout, so this terminates
+		while (!m->done) {
+			int r = libusb_handle_events_completed(pgm->ctx, &m->done);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+				fprintf(stderr, "IO error: could not handle USB events (%s)\n", libusb_error_name(r));
+				return STLK_USB_ERROR;
+			}
+		}
+		if (m->transfer->status != LIBUSB_TRANSFER_COMPLETED || m->transfer->actual_length != m->length) {
+			fprintf(stderr, "IO error: expected %d bytes but %d bytes transferred\n", m->length, m->transfer->actual_length);
+			if (m->transfer->status == LIBUSB_TRANSFER_STALL)
+				libusb_clear_halt(pgm->dev_handle, m->transfer->endpoint);
+			status = STLK_USB_ERROR;
+		}
+		libusb_free_transfer(m->transfer);
+	}
+
+	for (; i < count && status == STLK_OK; i++) {
+		DEBUG_PRINT("    async transfer unavailable - falling back to blocking transfer\n");
+		status = msg_transfer(pgm, msgs[i].buf, msgs[i].length, msgs[i].direction);
+	}
+	return status;
 }
 
-static unsigned int msg_recv_int(programmer_t *pgm, unsigned int length) {
+static stlink_status_t msg_recv_int(programmer_t *pgm, unsigned int length, unsigned int *value) {
 	unsigned char buf[4] = { 0x00, 0x01, 0x02, 0x03 };
-	msg_recv(pgm, buf, length);
-	unsigned int ret = load_int(buf, length, MP_LITTLE_ENDIAN);
-	DEBUG_PRINT("        -> 0x%x\n", ret);
-	return ret;
+	stlink_status_t status = msg_recv(pgm, buf, length);
+	*value = load_int(buf, length, MP_LITTLE_ENDIAN);
+	DEBUG_PRINT("        -> 0x%x\n", *value);
+	return status;
 }
 
-static unsigned int msg_recv_int8(programmer_t *pgm) {	return msg_recv_int(pgm, 1); }
-static unsigned int msg_recv_int16(programmer_t *pgm) {	return msg_recv_int(pgm, 2); }
+static stlink_status_t msg_recv_int8(programmer_t *pgm, unsigned int *value) { return msg_recv_int(pgm, 1, value); }
+static stlink_status_t msg_recv_int16(programmer_t *pgm, unsigned int *value) { return msg_recv_int(pgm, 2, value); }
 
-static void stlink2_cmd_internal(programmer_t *pgm, unsigned char *buf, unsigned int buf_len, unsigned int length, va_list ap) {
+static stlink_status_t stlink2_cmd_internal(programmer_t *pgm, unsigned char *buf, unsigned int buf_len, unsigned int length, va_list ap) {
 	unsigned char cmd_buf[16];
+	stlink_status_t status;
 	int i, j;
 
 	// Preparing
@@ -230,103 +375,703 @@ static void stlink2_cmd_internal(programmer_t *pgm, unsigned char *buf, unsigned
 	DEBUG_PRINT("\n");
 
 	// Triggering USB transfer
-	msg_send(pgm, cmd_buf, sizeof(cmd_buf));
-	if (buf_len)
-		msg_send(pgm, buf, buf_len);
+	status = msg_send(pgm, cmd_buf, sizeof(cmd_buf));
+	if (status == STLK_OK && buf_len)
+		status = msg_send(pgm, buf, buf_len);
+	return status;
 }
 
-static void stlink2_cmd(programmer_t *pgm, unsigned int length, ...) {
+static stlink_status_t stlink2_cmd(programmer_t *pgm, unsigned int length, ...) {
+	stlink_status_t status;
 	va_list ap;
 
 	va_start(ap, length);
-	stlink2_cmd_internal(pgm, NULL, 0, length, ap);
+	status = stlink2_cmd_internal(pgm, NULL, 0, length, ap);
 	va_end(ap);
+	return status;
 }
 
-static void swim_cmd_internal(programmer_t *pgm, unsigned char *buf, unsigned int buf_len, unsigned int length, va_list ap) {
-	int stalls = 0;
+static void swim_record_latency(programmer_t *pgm, unsigned int subcmd, unsigned long long us) {
+	pgm_latency_t *l = &pgm->swim_latency[subcmd % PGM_LATENCY_CMDS];
+	int bucket = 0;
+
+	while (bucket < PGM_LATENCY_BUCKETS - 1 && us >= (PGM_LATENCY_MIN_US << bucket))
+		bucket++;
+
+	l->count++;
+	l->buckets[bucket]++;
+	l->total_us += us;
+	if (us > l->max_us)
+		l->max_us = us;
+}
+
+// Poll SWIM_READSTATUS until the last SWIM command (subcmd) has completed.
+// Returns the SWIM status, or SWIM_STATUS_USB_ERROR if it could not be read.
+static int swim_poll_status(programmer_t *pgm, unsigned int subcmd) {
 	unsigned char status[2][4];
+	unsigned long long begin = time_us(), changed = begin, now;
+	unsigned int wait = SWIM_POLL_MIN_US;
+	unsigned int ceiling = SWIM_POLL_MAX_US;
 	int set = 0;
 
-	stlink2_cmd_internal(pgm, buf, buf_len, length, ap);
+	if (subcmd < sizeof(swim_poll_ceiling_us) / sizeof(swim_poll_ceiling_us[0]) && swim_poll_ceiling_us[subcmd])
+		ceiling = swim_poll_ceiling_us[subcmd];
 
-	while (stalls < 4) {
+	memset(status, 0xff, sizeof(status));
+	while (1) {
 
-		stlink2_cmd(pgm,2,STLINK_SWIM,SWIM_READSTATUS);
-		msg_recv(pgm, status[set], 4);
+		if (stlink2_cmd(pgm,2,STLINK_SWIM,SWIM_READSTATUS) || msg_recv(pgm, status[set], 4))
+			return SWIM_STATUS_USB_ERROR;
+		pgm->status_polls++;
 		DEBUG_PRINT("        status %02x %02x %02x %02x\n", status[set][0], status[set][1], status[set][2], status[set][3]);
+		now = time_us();
 
 		if (status[set][0] == STLINK_SWIM_OK) {
 			// We're done!
-			return;
+			swim_record_latency(pgm, subcmd, now - begin);
+			pgm->link.clean++;
+			return STLINK_SWIM_OK;
 		}
+		if (status[set][0] != STLINK_SWIM_BUSY)
+			return status[set][0];
 
 		// Still waiting...
 		if (memcmp(status[0], status[1], 4))
-			stalls = 0;
-		else
-			stalls++;
+			changed = now;
+		else if (now - changed >= SWIM_STALL_US) {
+			pgm->link.stalls++;
+			break;
+		}
 
 		set ^= 1;
-		usleep(10000);
-		//usleep(100);
+		usleep(wait);
+		wait = (wait * 2 > ceiling ? ceiling : wait * 2);
 	}
-	ERROR2("SWIM error 0x%02x\n", status[set][0]);
+	return status[set][0];
 }
 
-static void swim_cmd(programmer_t *pgm, unsigned int length, ...) {
-	va_list ap;
+static stlink_status_t swim_wait_status(programmer_t *pgm, unsigned int subcmd) {
+	int status = swim_poll_status(pgm, subcmd);
 
-	va_start(ap, length);
-	swim_cmd_internal(pgm, NULL, 0, length, ap);
-	va_end(ap);
+	if (status == SWIM_STATUS_USB_ERROR)
+		return STLK_USB_ERROR;
+	if (status != STLINK_SWIM_OK) {
+		fprintf(stderr, "SWIM error 0x%02x\n", status);
+		return STLK_SWIM_ERROR;
+	}
+	return STLK_OK;
+}
+
+static stlink_status_t swim_cmd_internal(programmer_t *pgm, unsigned int length, va_list ap) {
+	stlink_status_t status;
+	unsigned int subcmd;
+	va_list aq;
+
+	// The second argument is the SWIM command, which selects the poll timing
+	va_copy(aq, ap);
+	va_arg(aq, int);
+	subcmd = va_arg(aq, int);
+	va_end(aq);
+
+	status = stlink2_cmd_internal(pgm, NULL, 0, length, ap);
+	if (status == STLK_OK)
+		status = swim_wait_status(pgm, subcmd);
+	return status;
 }
 
-static void swim_cmd_with_data(programmer_t *pgm, unsigned char *buf, unsigned int buf_len, unsigned int length, ...) {
+static stlink_status_t swim_cmd(programmer_t *pgm, unsigned int length, ...) {
+	stlink_status_t status;
 	va_list ap;
 
 	va_start(ap, length);
-	swim_cmd_internal(pgm, buf, buf_len, length, ap);
+	status = swim_cmd_internal(pgm, length, ap);
 	va_end(ap);
+	return status;
+}
+
+/* SWIM command queue.
+ * Queued SWIM_WRITEMEM/SWIM_READMEM commands are run in order by
+ * swim_queue_flush. The firmware's status only tells about the last command,
+ * so every command gets its own status check; to save a round trip the first
+ * SWIM_READSTATUS goes out together with the command. If a command fails,
+ * the commands from it on stay queued, so that after stlink2_recover the
+ * queue can be replayed from the failed command on: replaying commands that
+ * already reached the target could send an unlock key twice, which locks the
+ * memory until reset, or restart a block that is being programmed.
+ * If a flush that swim_queue_add needs for room fails, the error is latched:
+ * later commands are dropped, and every swim_queue_flush returns the error
+ * without sending anything until swim_queue_drop. Such a queue cannot be
+ * replayed (swim_queue_latched), the caller has to fail.
+ * The queue holds up to SWIM_QUEUE_LEN commands.
+ */
+#define SWIM_QUEUE_LEN          16
+
+/* Transfer tuning per programmer type, selected in stlink2_open.
+ * STLINK-V3 is a high speed USB device with 512 byte packets, so its single
+ * frame writes go up to the programmer's whole buffer: a RAM chunk of
+ * read_buf_size bytes is one transfer instead of three.
+ */
+typedef struct {
+	unsigned int frame_max;   // largest single frame WRITEMEM transfer
+} stlink2_profile_t;
+
+static const stlink2_profile_t stlink2_profiles[] = {
+	[STLinkV2]  = { .frame_max = 2048 },
+	[STLinkV21] = { .frame_max = 2048 },
+	[STLinkV3]  = { .frame_max = 6144 + 16 },
+};
+
+typedef struct {
+	unsigned char cmd[16];
+	unsigned char *data;    // WRITEMEM payload beyond the header or READMEM destination
+	unsigned char *frame;   // WRITEMEM header and payload in pgm->frame_buf (single frame mode)
+	unsigned int size;
+	unsigned int addr;
+} swim_queue_entry_t;
+
+typedef struct {
+	swim_queue_entry_t entries[SWIM_QUEUE_LEN];
+	unsigned int count;
+	unsigned int frame_used; // bytes of pgm->frame_buf taken by queued frames
+	stlink_status_t status;
+} swim_queue_t;
+
+static stlink_status_t swim_queue_flush(programmer_t *pgm, swim_queue_t *q);
+
+// Flushes the queue if a command with frame_len bytes of frame does not fit; false once an error is latched
+static bool swim_queue_room(programmer_t *pgm, swim_queue_t *q, unsigned int frame_len) {
+	if (q->status == STLK_OK && (q->count >= SWIM_QUEUE_LEN || q->frame_used + frame_len > sizeof(pgm->frame_buf))) {
+		q->status = swim_queue_flush(pgm, q);
+		if (q->status != STLK_OK)
+			q->count = q->frame_used = 0;
+	}
+	return q->status == STLK_OK;
+}
+
+static swim_queue_entry_t *swim_queue_add(swim_queue_t *q, unsigned int subcmd, unsigned int addr, unsigned int size) {
+	swim_queue_entry_t *e = &q->entries[q->count++];
+
+	memset(e->cmd, 0, sizeof(e->cmd));
+	e->cmd[0] = STLINK_SWIM;
+	e->cmd[1] = subcmd;
+	e->cmd[2] = HI(size);
+	e->cmd[3] = LO(size);
+	e->cmd[4] = EH(addr);
+	e->cmd[5] = EX(addr);
+	e->cmd[6] = HI(addr);
+	e->cmd[7] = LO(addr);
+	e->data = NULL;
+	e->frame = NULL;
+	e->size = size;
+	e->addr = addr;
+	return e;
+}
+
+/* The first 8 bytes are sent in the same USB transfer as the command itself.
+ * In single frame mode the rest follows in that transfer too, copied into the
+ * session's frame buffer; otherwise it is sent in a second transfer and must
+ * stay valid until the queue is flushed.
+ */
+static void swim_queue_write(programmer_t *pgm, swim_queue_t *q, unsigned char *buf, unsigned int size, unsigned int addr) {
+	unsigned int frame_len = sizeof(q->entries[0].cmd) + size - 8;
+	bool framed = pgm->single_frame && size > 8 && frame_len <= pgm->frame_max;
+	swim_queue_entry_t *e;
+
+	regcache_invalidate(pgm, addr, size);
+	if (!swim_queue_room(pgm, q, framed ? frame_len : 0))
+		return;
+
+	e = swim_queue_add(q, SWIM_WRITEMEM, addr, size);
+	memcpy(e->cmd + 8, buf, size < 8 ? size : 8);
+	if (framed) {
+		e->frame = pgm->frame_buf + q->frame_used;
+		q->frame_used += frame_len;
+		memcpy(e->frame, e->cmd, sizeof(e->cmd));
+		memcpy(e->frame + sizeof(e->cmd), buf + 8, size - 8);
+	} else if (size > 8) {
+		e->data = buf + 8;
+	}
+}
+
+static void swim_queue_write_byte(programmer_t *pgm, swim_queue_t *q, unsigned char byte, unsigned int addr) {
+	swim_queue_write(pgm, q, &byte, 1, addr);
+}
+
+// Only for registers that the target does not change by itself, see regcache.h
+static void swim_queue_write_reg(programmer_t *pgm, swim_queue_t *q, unsigned char byte, unsigned int addr) {
+	if (regcache_unchanged(pgm, addr, byte))
+		return;
+	swim_queue_write_byte(pgm, q, byte, addr);
+	regcache_set(pgm, addr, byte);
+}
+
+// buf is filled in when the queue is flushed
+static void swim_queue_read(programmer_t *pgm, swim_queue_t *q, unsigned char *buf, unsigned int size, unsigned int addr) {
+	if (swim_queue_room(pgm, q, 0))
+		swim_queue_add(q, SWIM_READMEM, addr, size)->data = buf;
+}
+
+// The transfers for entry i, returns their number
+static unsigned int swim_queue_msgs(swim_queue_t *q, unsigned int i, msg_async_t *msgs) {
+	swim_queue_entry_t *e = &q->entries[i];
+	unsigned int n = 0;
+
+	DEBUG_PRINT("     queued %s %d bytes at 0x%06x\n", e->cmd[1] == SWIM_READMEM ? "READMEM" : "WRITEMEM", e->size, e->addr);
+	if (e->frame) {
+		msgs[n++] = (msg_async_t){ e->frame, sizeof(e->cmd) + e->size - 8, LIBUSB_ENDPOINT_OUT };
+		return n;
+	}
+	msgs[n++] = (msg_async_t){ e->cmd, sizeof(e->cmd), LIBUSB_ENDPOINT_OUT };
+	if (e->cmd[1] == SWIM_WRITEMEM && e->data)
+		msgs[n++] = (msg_async_t){ e->data, e->size - 8, LIBUSB_ENDPOINT_OUT };
+	return n;
+}
+
+// Send entry i with the first status read and wait until it has completed
+static stlink_status_t swim_queue_run(programmer_t *pgm, swim_queue_t *q, unsigned int i) {
+	swim_queue_entry_t *e = &q->entries[i];
+	unsigned char readstatus_cmd[16] = { STLINK_SWIM, SWIM_READSTATUS };
+	unsigned char status[4];
+	msg_async_t msgs[4];
+	unsigned long long begin = time_us();
+	unsigned int n = swim_queue_msgs(q, i, msgs);
+	int result;
+
+	msgs[n++] = (msg_async_t){ readstatus_cmd, sizeof(readstatus_cmd), LIBUSB_ENDPOINT_OUT };
+	msgs[n++] = (msg_async_t){ status, sizeof(status), LIBUSB_ENDPOINT_IN };
+	if (msg_transfer_async(pgm, msgs, n))
+		return STLK_USB_ERROR;
+	DEBUG_PRINT("        status %02x %02x %02x %02x\n", status[0], status[1], status[2], status[3]);
+
+	result = status[0];
+	if (result == STLINK_SWIM_BUSY) {
+		result = swim_poll_status(pgm, e->cmd[1]);
+	} else if (result == STLINK_SWIM_OK) {
+		swim_record_latency(pgm, e->cmd[1], time_us() - begin);
+		pgm->link.clean++;
+	}
+	if (result == SWIM_STATUS_USB_ERROR)
+		return STLK_USB_ERROR;
+	if (result != STLINK_SWIM_OK) {
+		fprintf(stderr, "SWIM error 0x%02x (%s %d bytes at 0x%06x)\n", result,
+			e->cmd[1] == SWIM_READMEM ? "read of" : "write of", e->size, e->addr);
+		return STLK_SWIM_ERROR;
+	}
+
+	// The data must be fetched before the next READMEM overwrites the programmer's buffer
+	if (e->cmd[1] == SWIM_READMEM) {
+		if (stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUF) || msg_recv(pgm, e->data, e->size))
+			return STLK_USB_ERROR;
+	}
+	return STLK_OK;
+}
+
+static void swim_queue_drop(swim_queue_t *q) {
+	q->count = 0;
+	q->frame_used = 0;
+	q->status = STLK_OK;
+}
+
+// Commands were lost to an error latched by swim_queue_room
+static bool swim_queue_latched(swim_queue_t *q) {
+	return q->status != STLK_OK;
+}
+
+static stlink_status_t swim_queue_flush(programmer_t *pgm, swim_queue_t *q) {
+	stlink_status_t status = q->status;
+	unsigned int i;
+
+	if (swim_queue_latched(q))
+		return status;
+	for (i = 0; i < q->count && status == STLK_OK; i++)
+		status = swim_queue_run(pgm, q, i);
+
+	if (status == STLK_OK) {
+		swim_queue_drop(q);
+	} else {
+		// Keep the failed command and the ones after it for a replay
+		i--;
+		memmove(q->entries, q->entries + i, (q->count - i) * sizeof(q->entries[0]));
+		q->count -= i;
+	}
+	// The failed command may or may not have reached the target
+	if (status != STLK_OK)
+		regcache_clear(pgm);
+	return status;
+}
+
+/* Probe whether the firmware accepts a WRITEMEM command and its payload in a
+ * single transfer, by rewriting the first bytes of RAM with their current
+ * contents in that form. Firmware older than SINGLE_FRAME_MIN_SWIM is not
+ * probed. If the write fails, times out or does not read back, the endpoints
+ * and the SWIM link are resynchronised, the RAM is restored with a split
+ * write and split writes are used from then on.
+ */
+static stlink_status_t stlink2_probe_framing(programmer_t *pgm, unsigned int version) {
+	unsigned char ram[16], check[16];
+	swim_queue_t q = { .count = 0 };
+	stlink_status_t status;
+
+	pgm->single_frame = false;
+	if (((version >> 12) & 0x3f) < 3 && (version & 0x3f) < SINGLE_FRAME_MIN_SWIM) {
+		DEBUG_PRINT("SWIM firmware v%d, continuing with split frame writes\n", version & 0x3f);
+		return STLK_OK;
+	}
+
+	swim_queue_read(pgm, &q, ram, sizeof(ram), 0x0000);
+	if (swim_queue_flush(pgm, &q))
+		return STLK_USB_ERROR;
+
+	pgm->single_frame = true;
+	swim_queue_write(pgm, &q, ram, sizeof(ram), 0x0000);
+	status = swim_queue_flush(pgm, &q);
+	swim_queue_drop(&q);
+
+	if (status == STLK_OK) {
+		swim_queue_read(pgm, &q, check, sizeof(check), 0x0000);
+		status = swim_queue_flush(pgm, &q);
+		swim_queue_drop(&q);
+	}
+	if (status != STLK_OK || memcmp(ram, check, sizeof(ram))) {
+		pgm->single_frame = false;
+		// Firmware that took the payload for the next command may still wait for data
+		if (status == STLK_USB_ERROR)
+			msg_resync(pgm);
+		if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_RESET))
+			return STLK_USB_ERROR;
+		swim_queue_write(pgm, &q, ram, sizeof(ram), 0x0000);
+		if (swim_queue_flush(pgm, &q))
+			return STLK_USB_ERROR;
+	}
+	DEBUG_PRINT("continuing with %s frame writes\n", pgm->single_frame ? "single" : "split");
+	return STLK_OK;
 }
 
+#if USE_ASYNC_READ
+/* READMEM and READBUF with an offset into the programmer's buffer in bytes
+ * 8-9; READBUF also gets its size in bytes 2-3. Only sent to firmware that
+ * passed stlink2_probe_double_buffer, apart from the probe itself.
+ */
+static void swim_readmem_cmd(unsigned char *cmd_buf, unsigned int start, unsigned int size, unsigned int offset) {
+	memset(cmd_buf, 0, 16);
+	cmd_buf[0] = STLINK_SWIM;
+	cmd_buf[1] = SWIM_READMEM;
+	cmd_buf[2] = HI(size);
+	cmd_buf[3] = LO(size);
+	cmd_buf[5] = EX(start);
+	cmd_buf[6] = HI(start);
+	cmd_buf[7] = LO(start);
+	cmd_buf[8] = HI(offset);
+	cmd_buf[9] = LO(offset);
+}
+
+static void swim_readbuf_cmd(unsigned char *cmd_buf, unsigned int size, unsigned int offset) {
+	memset(cmd_buf, 0, 16);
+	cmd_buf[0] = STLINK_SWIM;
+	cmd_buf[1] = SWIM_READBUF;
+	cmd_buf[2] = HI(size);
+	cmd_buf[3] = LO(size);
+	cmd_buf[8] = HI(offset);
+	cmd_buf[9] = LO(offset);
+}
+
+/* Probe whether the firmware keeps READMEM data at the offset given in the
+ * command, so that a range read can fill one half of its buffer while the
+ * other half is sent. The first bytes of RAM are set to a pattern whose two
+ * halves differ, read into the upper and then the lower half of the buffer
+ * and fetched from both; firmware that ignores the offsets returns the lower
+ * half twice. RAM is restored afterwards, and on any failure the endpoints
+ * and the SWIM link are resynchronised and reads stay sequential.
+ */
+static stlink_status_t stlink2_probe_double_buffer(programmer_t *pgm) {
+	unsigned char ram[32], pattern[32], check[32], cmd[16];
+	unsigned int half = pgm->read_buf_size / 2, i;
+	swim_queue_t q = { .count = 0 };
+	stlink_status_t status;
+
+	pgm->double_buffer = false;
+	if (half < sizeof(ram) / 2)
+		return STLK_OK;
+
+	swim_queue_read(pgm, &q, ram, sizeof(ram), 0x0000);
+	if (swim_queue_flush(pgm, &q))
+		return STLK_USB_ERROR;
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i;
+	swim_queue_write(pgm, &q, pattern, sizeof(pattern), 0x0000);
+	status = swim_queue_flush(pgm, &q);
+	swim_queue_drop(&q);
+
+	if (status == STLK_OK) {
+		swim_readmem_cmd(cmd, 0x0000, 16, half);
+		status = msg_send(pgm, cmd, sizeof(cmd));
+	}
+	if (status == STLK_OK)
+		status = swim_wait_status(pgm, SWIM_READMEM);
+	if (status == STLK_OK) {
+		swim_readmem_cmd(cmd, 0x0010, 16, 0);
+		status = msg_send(pgm, cmd, sizeof(cmd));
+	}
+	if (status == STLK_OK)
+		status = swim_wait_status(pgm, SWIM_READMEM);
+	if (status == STLK_OK) {
+		swim_readbuf_cmd(cmd, 16, half);
+		status = msg_send(pgm, cmd, sizeof(cmd));
+	}
+	if (status == STLK_OK)
+		status = msg_recv(pgm, check, 16);
+	if (status == STLK_OK) {
+		swim_readbuf_cmd(cmd, 16, 0);
+		status = msg_send(pgm, cmd, sizeof(cmd));
+	}
+	if (status == STLK_OK)
+		status = msg_recv(pgm, check + 16, 16);
+
+	pgm->double_buffer = (status == STLK_OK && !memcmp(pattern, check, sizeof(pattern)));
+	if (status != STLK_OK) {
+		if (status == STLK_USB_ERROR)
+			msg_resync(pgm);
+		if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_RESET))
+			return STLK_USB_ERROR;
+	}
+	swim_queue_write(pgm, &q, ram, sizeof(ram), 0x0000);
+	if (swim_queue_flush(pgm, &q))
+		return STLK_USB_ERROR;
+	DEBUG_PRINT("continuing with %s reads\n", pgm->double_buffer ? "double buffered" : "sequential");
+	return STLK_OK;
+}
+#endif
+
 #if USE_HIGH_SPEED
 // Switch to high speed SWIM format (UM0470: 3.3)
-static void stlink2_high_speed(programmer_t *pgm) {
-	unsigned char csr;
+static stlink_status_t stlink2_high_speed(programmer_t *pgm) {
+	int csr;
 
 	// Wait for HSIT to be set in SWIM_CSR
 	// avoid hanging when HSIT doesn't become 1
 	unsigned char retries = 10;
 	while (!((csr = swim_read_byte(pgm, 0x7f80)) & 0x02) && (retries-- != 0))
 		usleep(500);
+	if (csr < 0)
+		return STLK_USB_ERROR;
 
 	// Do a SWIM_RESET to resync clocking
-	swim_cmd(pgm, 2, STLINK_SWIM, SWIM_RESET);
+	if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_RESET))
+		return STLK_SWIM_ERROR;
 
 	if (csr & 0x02) {
 		// Set HS in SWIM_CSR
-		swim_write_byte(pgm, csr | 0x10, 0x7f80);
+		if (swim_write_byte(pgm, csr | 0x10, 0x7f80))
+			return STLK_SWIM_ERROR;
 
 		// Finally, tell the stlinkv2 to use high speed format.
-		swim_cmd(pgm, 3, STLINK_SWIM, SWIM_SPEED, 1);
+		if (swim_cmd(pgm, 3, STLINK_SWIM, SWIM_SPEED, 1))
+			return STLK_SWIM_ERROR;
+		pgm->link.high_speed = true;
 		DEBUG_PRINT("continuing in high speed swim\n");
 	}
 	else {
 		DEBUG_PRINT("continuing in low speed swim\n");
 	}
+	return STLK_OK;
+}
+
+// Back to low speed format: clear HS in SWIM_CSR, then switch the stlinkv2 over
+static stlink_status_t stlink2_low_speed(programmer_t *pgm) {
+	int csr = swim_read_byte(pgm, 0x7f80);
+
+	if (csr < 0)
+		return STLK_USB_ERROR;
+	if (swim_write_byte(pgm, csr & ~0x10, 0x7f80))
+		return STLK_SWIM_ERROR;
+	if (swim_cmd(pgm, 3, STLINK_SWIM, SWIM_SPEED, 0))
+		return STLK_SWIM_ERROR;
+	pgm->link.high_speed = false;
+	if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_RESET))
+		return STLK_SWIM_ERROR;
+	DEBUG_PRINT("continuing in low speed swim\n");
+	return STLK_OK;
 }
 #endif
 
+/* Link quality monitor.
+ * Successful SWIM commands, errors and stalls are counted per session.
+ * LINK_FALLBACK_ERRORS errors without LINK_CLEAN_WINDOW successful commands
+ * in between drop a high speed link to low speed. After link.step_up
+ * successful commands in a row at low speed, high speed is tried again;
+ * every fallback doubles link.step_up, so a link that keeps failing at high
+ * speed settles at low speed.
+ */
+#define LINK_FALLBACK_ERRORS    2
+#define LINK_CLEAN_WINDOW       256
+#define LINK_STEP_UP_MIN        1024
+
+static void stlink2_link_reset(programmer_t *pgm) {
+	memset(&pgm->link, 0, sizeof(pgm->link));
+	pgm->link.step_up = LINK_STEP_UP_MIN;
+}
+
+// Called between blocks, where the speed can be changed safely
+static void stlink2_link_check(programmer_t *pgm) {
+#if USE_HIGH_SPEED
+	pgm_link_t *l = &pgm->link;
+
+	if (l->high_speed || !l->fallbacks || l->clean < l->step_up)
+		return;
+	fprintf(stderr, "SWIM link stable again, trying high speed\n");
+	l->clean = 0;
+	l->recent_errors = 0;
+	if (stlink2_high_speed(pgm) == STLK_OK && l->high_speed)
+		l->step_ups++;
+#endif
+}
+
+/* Connect step timing: each step's duration since the previous mark is
+ * recorded in pgm->connect_steps and printed with the statistics.
+ */
+static void stlink2_connect_step(programmer_t *pgm, const char *name, unsigned long long *mark) {
+	unsigned long long now = time_us();
+
+	if (pgm->connect_step_count < PGM_CONNECT_STEPS) {
+		pgm->connect_steps[pgm->connect_step_count].name = name;
+		pgm->connect_steps[pgm->connect_step_count].us = now - *mark;
+		pgm->connect_step_count++;
+	}
+	*mark = now;
+}
+
+/* Capability cache.
+ * With a cache file set (-C), what the programmer reports about itself is
+ * stored per serial number, one line per programmer:
+ *   <serial> <version> <read_buf_size> <SWIM_READ_CAP bytes> <single_frame> <double_buffer>
+ * A later connect to the same programmer with the same firmware version then
+ * skips SWIM_READBUFSIZE, SWIM_READ_CAP and the probes. Lines without
+ * double_buffer, from before it was probed, count as a miss. An updated
+ * entry moves to the end, so the file is ordered from the least recently
+ * stored; once it holds CACHE_LINES_MAX entries the oldest one is dropped.
+ */
+#define CACHE_LINE_MAX          256
+#define CACHE_LINES_MAX         64
+
+static bool stlink2_serial(programmer_t *pgm, char *serial, size_t size) {
+	struct libusb_device_descriptor desc;
+	unsigned char raw[32];
+	int i, len;
+
+	if (libusb_get_device_descriptor(libusb_get_device(pgm->dev_handle), &desc) || !desc.iSerialNumber)
+		return(false);
+	len = libusb_get_string_descriptor_ascii(pgm->dev_handle, desc.iSerialNumber, raw, sizeof(raw));
+	if (len <= 0 || (size_t)len * 2 >= size)
+		return(false);
+	for (i = 0; i < len; i++)
+		sprintf(serial + 2 * i, "%02X", raw[i]);
+	return(true);
+}
+
+static bool stlink2_cache_load(programmer_t *pgm, const char *serial, unsigned int version) {
+	char line[CACHE_LINE_MAX], key[CACHE_LINE_MAX], caps[CACHE_LINE_MAX];
+	unsigned int v, size, single, dbuf, i, byte;
+	bool found = false;
+	FILE *f = fopen(pgm->cache_file, "r");
+
+	if (!f)
+		return(false);
+	while (!found && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%255s %x %u %255s %u %u", key, &v, &size, caps, &single, &dbuf) != 6 ||
+			strcmp(key, serial) || v != version || strlen(caps) != 2 * sizeof(pgm->swim_caps))
+			continue;
+		for (i = 0; i < sizeof(pgm->swim_caps); i++) {
+			sscanf(caps + 2 * i, "%2x", &byte);
+			pgm->swim_caps[i] = byte;
+		}
+		pgm->read_buf_size = size;
+		pgm->single_frame = single;
+		pgm->double_buffer = dbuf;
+		found = true;
+	}
+	fclose(f);
+	return(found);
+}
+
+static void stlink2_cache_store(programmer_t *pgm, const char *serial, unsigned int version) {
+	char lines[CACHE_LINES_MAX][CACHE_LINE_MAX], tmp[FILENAME_MAX];
+	unsigned int n = 0, i, dropped = 0;
+	size_t len = strlen(serial);
+	FILE *f;
+
+	// Keep the entries of other programmers, as many as fit with the new one
+	if ((f = fopen(pgm->cache_file, "r"))) {
+		while (fgets(lines[n], sizeof(lines[n]), f)) {
+			if (!strncmp(lines[n], serial, len) && lines[n][len] == ' ')
+				continue;
+			if (++n == CACHE_LINES_MAX) {
+				memmove(lines[0], lines[1], (--n) * sizeof(lines[0]));
+				dropped++;
+			}
+		}
+		fclose(f);
+	}
+	if (dropped)
+		fprintf(stderr, "Capability cache %s full, dropped the %u oldest entries\n", pgm->cache_file, dropped);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pgm->cache_file);
+	if (!(f = fopen(tmp, "w"))) {
+		perror(tmp);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		fputs(lines[i], f);
+	fprintf(f, "%s %04x %u ", serial, version, pgm->read_buf_size);
+	for (i = 0; i < sizeof(pgm->swim_caps); i++)
+		fprintf(f, "%02x", pgm->swim_caps[i]);
+	fprintf(f, " %d %d\n", pgm->single_frame, pgm->double_buffer);
+	if (fclose(f) || rename(tmp, pgm->cache_file))
+		perror(pgm->cache_file);
+}
+
+/* Hot reattach.
+ * If the programmer is still in SWIM mode and the target still answers with
+ * the SWIM_CSR value set up by a previous connect, the reset and entry
+ * sequence is skipped.
+ */
+static bool stlink2_reattach(programmer_t *pgm) {
+	int csr = swim_read_byte(pgm, 0x7f80);
+
+	if (csr < 0 || (csr & 0xa1) != 0xa1)
+		return(false);
+	// Stall the CPU again, keeping the speed in use
+	if (swim_write_byte(pgm, 0xa1 | (csr & 0x10), 0x7f80))
+		return(false);
+	pgm->link.high_speed = (csr & 0x10) != 0;
+	return(true);
+}
+
 bool stlink2_open(programmer_t *pgm) {
 	unsigned char buf[8];
 	unsigned int v;
-
-	stlink2_cmd(pgm, 1, STLINK_GET_VERSION);
-	msg_recv(pgm, buf, 6);
+	unsigned long long begin = time_us(), mark = begin;
+	char serial[80];
+	bool cached = false, hot = false;
+
+	regcache_clear(pgm);
+	memset(&pgm->session, 0, sizeof(pgm->session));
+	stlink2_link_reset(pgm);
+	pgm->read_buf_size = 6144;
+	pgm->double_buffer = false;
+	pgm->connect_step_count = 0;
+	pgm->frame_max = stlink2_profiles[pgm->type].frame_max;
+	if (stlink2_cmd(pgm, 1, STLINK_GET_VERSION) || msg_recv(pgm, buf, 6))
+		return(false);
 	v = (buf[0] << 8) | buf[1];
 	fprintf(stderr, "STLink: v%d, JTAG: v%d, SWIM: v%d, VID: %02x%02x, PID: %02x%02x\n",
 		(v >> 12) & 0x3f, (v >> 6) & 0x3f, v & 0x3f, buf[2], buf[3], buf[4], buf[5]);
+	stlink2_connect_step(pgm, "GET_VERSION", &mark);
+
+	if (pgm->cache_file && stlink2_serial(pgm, serial, sizeof(serial)))
+		cached = stlink2_cache_load(pgm, serial, v);
+	else
+		serial[0] = '\0';
+	stlink2_connect_step(pgm, "cache lookup", &mark);
 
 #if 0
 	// This does not appear to work on all ST-Link V2 clones even if the JTAG
@@ -339,67 +1084,179 @@ bool stlink2_open(programmer_t *pgm) {
 	}
 #endif
 
-	stlink2_cmd(pgm, 1, STLINK_GET_CURRENT_MODE);
-	msg_recv(pgm, buf, 2);
+	if (stlink2_cmd(pgm, 1, STLINK_GET_CURRENT_MODE) || msg_recv(pgm, buf, 2))
+		return(false);
 	DEBUG_PRINT("        -> %02x %02x\n", buf[0], buf[1]);
 
 	switch (buf[0]) {
 		case STLINK_MODE_DEBUG:
-			stlink2_cmd(pgm, 2, STLINK_DEBUG, DEBUG_EXIT);
+			if (stlink2_cmd(pgm, 2, STLINK_DEBUG, DEBUG_EXIT))
+				return(false);
 			break;
 
 		case STLINK_MODE_BOOTLOADER:
 		case STLINK_MODE_DFU:
 		case STLINK_MODE_MASS:
-			stlink2_cmd(pgm, 2, STLINK_DFU, DFU_EXIT);
+			if (stlink2_cmd(pgm, 2, STLINK_DFU, DFU_EXIT))
+				return(false);
 			break;
 
 		default:
 			break;
 	}
 
-	if (buf[0] != STLINK_MODE_SWIM)
-		stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_ENTER);
+	if (buf[0] != STLINK_MODE_SWIM && stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_ENTER))
+		return(false);
+	stlink2_connect_step(pgm, "mode", &mark);
 
-	stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUFSIZE);
-	read_buf_size = msg_recv_int16(pgm);
+	if (!cached) {
+		if (stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUFSIZE) || msg_recv_int16(pgm, &pgm->read_buf_size))
+			return(false);
 
-	stlink2_cmd(pgm, 3, STLINK_SWIM, SWIM_READ_CAP, 0x01);
-	msg_recv(pgm, buf, 8);
-	DEBUG_PRINT("        -> %02x %02x %02x %02x %02x %02x %02x %02x\n",
-		buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
+		if (stlink2_cmd(pgm, 3, STLINK_SWIM, SWIM_READ_CAP, 0x01) || msg_recv(pgm, pgm->swim_caps, 8))
+			return(false);
+		DEBUG_PRINT("        -> %02x %02x %02x %02x %02x %02x %02x %02x\n",
+			pgm->swim_caps[0], pgm->swim_caps[1], pgm->swim_caps[2], pgm->swim_caps[3],
+			pgm->swim_caps[4], pgm->swim_caps[5], pgm->swim_caps[6], pgm->swim_caps[7]);
+		stlink2_connect_step(pgm, "capabilities", &mark);
+	}
 
-	swim_cmd(pgm, 2, STLINK_SWIM, SWIM_ASSERT_RESET);
+	if (buf[0] == STLINK_MODE_SWIM) {
+		hot = stlink2_reattach(pgm);
+		stlink2_connect_step(pgm, "reattach", &mark);
+		// Whatever speed the last session left the programmer in, the entry
+		// sequence below starts in low speed
+		if (!hot && swim_cmd(pgm, 3, STLINK_SWIM, SWIM_SPEED, 0))
+			return(false);
+	}
 
-	swim_cmd(pgm, 2, STLINK_SWIM, SWIM_ENTER_SEQ);
+	if (!hot) {
+		if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_ASSERT_RESET))
+			return(false);
 
-	// Mask internal interrupt sources, enable access to whole of memory,
-	// prioritize SWIM and stall the CPU.
-	swim_write_byte(pgm, 0xa1, 0x7f80);
+		if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_ENTER_SEQ))
+			return(false);
 
-	swim_cmd(pgm, 2, STLINK_SWIM, SWIM_DEASSERT_RESET);
-	usleep(1000);
+		// Mask internal interrupt sources, enable access to whole of memory,
+		// prioritize SWIM and stall the CPU.
+		if (swim_write_byte(pgm, 0xa1, 0x7f80))
+			return(false);
+
+		if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_DEASSERT_RESET))
+			return(false);
+		usleep(1000);
+		stlink2_connect_step(pgm, "entry sequence", &mark);
+	}
 
 #if USE_HIGH_SPEED
-	stlink2_high_speed(pgm);
+	if (!pgm->link.high_speed) {
+		if (stlink2_high_speed(pgm))
+			return(false);
+		stlink2_connect_step(pgm, "high speed", &mark);
+	}
+#endif
+
+	if (!cached) {
+		if (stlink2_probe_framing(pgm, v))
+			return(false);
+		stlink2_connect_step(pgm, "framing probe", &mark);
+#if USE_ASYNC_READ
+		if (stlink2_probe_double_buffer(pgm))
+			return(false);
+		stlink2_connect_step(pgm, "buffer probe", &mark);
 #endif
+		if (serial[0])
+			stlink2_cache_store(pgm, serial, v);
+	}
 
+	DEBUG_PRINT("connected in %llu us (%s%s)\n", time_us() - begin,
+		hot ? "reattached" : "entered", cached ? ", cached capabilities" : "");
 	return(true);
 }
 
 void stlink2_srst(programmer_t *pgm) {
-	swim_write_byte(pgm, swim_read_byte(pgm, 0x7f80) | 0x4, 0x7f80); // set SWIM_CSR.RST
+	int csr = swim_read_byte(pgm, 0x7f80);
+	if (csr < 0 || swim_write_byte(pgm, csr | 0x4, 0x7f80)) { // set SWIM_CSR.RST
+		fprintf(stderr, "Could not reset the target\n");
+		return;
+	}
 	// alt : remove stall bit after reset (like libespstlink)
 	swim_cmd(pgm, 2, STLINK_SWIM, SWIM_GEN_RST);
 	usleep(1000);
+	regcache_clear(pgm);
+	// The reset also locks the memories again
+	memset(&pgm->session, 0, sizeof(pgm->session));
+}
+
+void stlink2_print_stats(programmer_t *pgm) {
+	unsigned int cmd, b;
+
+	fprintf(stderr, "SWIM command latency (us):\n");
+	fprintf(stderr, "  %-16s %7s %7s %7s", "command", "count", "avg", "max");
+	for (b = 0; b < PGM_LATENCY_BUCKETS - 1; b++) {
+		char label[16];
+		snprintf(label, sizeof(label), "<%llu", PGM_LATENCY_MIN_US << b);
+		fprintf(stderr, " %7s", label);
+	}
+	fprintf(stderr, " %7s\n", "more");
+
+	for (cmd = 0; cmd < PGM_LATENCY_CMDS; cmd++) {
+		pgm_latency_t *l = &pgm->swim_latency[cmd];
+
+		if (!l->count)
+			continue;
+		fprintf(stderr, "  %-16s %7u %7llu %7llu",
+			cmd < sizeof(swim_cmd_map) / sizeof(swim_cmd_map[0]) && swim_cmd_map[cmd] ? swim_cmd_map[cmd] : "?",
+			l->count, l->total_us / l->count, l->max_us);
+		for (b = 0; b < PGM_LATENCY_BUCKETS; b++)
+			fprintf(stderr, " %7u", l->buckets[b]);
+		fprintf(stderr, "\n");
+	}
+
+	fprintf(stderr, "USB transfers: %u total", pgm->usb_transfers);
+	if (pgm->blocks_written)
+		fprintf(stderr, ", %.1f per written block (%u blocks)",
+			(double)pgm->block_transfers / pgm->blocks_written, pgm->blocks_written);
+	fprintf(stderr, ", %s frame writes, %s reads\n", pgm->single_frame ? "single" : "split",
+		pgm->double_buffer ? "double buffered" : "sequential");
+	fprintf(stderr, "Register accesses served from cache: %u\n", pgm->shadow_hits);
+	fprintf(stderr, "SWIM errors: %u, stalls: %u (%u blocks retried, %u reads resumed)\n",
+		pgm->swim_errors, pgm->link.stalls, pgm->block_retries, pgm->read_retries);
+	fprintf(stderr, "SWIM link: %s speed, %u fallbacks to low speed, %u step ups\n",
+		pgm->link.high_speed ? "high" : "low", pgm->link.fallbacks, pgm->link.step_ups);
+	if (pgm->connect_step_count) {
+		fprintf(stderr, "Connect steps (us):");
+		for (cmd = 0; cmd < pgm->connect_step_count; cmd++)
+			fprintf(stderr, " %s %llu%s", pgm->connect_steps[cmd].name, pgm->connect_steps[cmd].us,
+				cmd + 1 < pgm->connect_step_count ? "," : "\n");
+	}
+	eop_print_stats(pgm);
+}
+
+// Reset DUL and PUL in IAPSR to disable flash and data writes.
+static void stlink2_session_lock(programmer_t *pgm) {
+	int iapsr;
+
+	if (!pgm->session.flash_unlocked && !pgm->session.data_unlocked)
+		return;
+	iapsr = swim_read_byte(pgm, pgm->session.device->regs.FLASH_IAPSR);
+	if (iapsr < 0 || swim_write_byte(pgm, iapsr & (~0x0a), pgm->session.device->regs.FLASH_IAPSR))
+		fprintf(stderr, "Could not lock flash and data memory after writing\n");
+	pgm->session.flash_unlocked = false;
+	pgm->session.data_unlocked = false;
 }
 
 void stlink2_close(programmer_t *pgm) {
+	if (pgm->link.fallbacks)
+		fprintf(stderr, "SWIM link: %u errors, %u stalls, %u retries, fell back to low speed %u times\n",
+			pgm->swim_errors, pgm->link.stalls, pgm->block_retries + pgm->read_retries, pgm->link.fallbacks);
+	stlink2_session_lock(pgm);
 	stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_EXIT);
 }
 
-static void swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start) {
-	swim_cmd(pgm, 9, STLINK_SWIM, SWIM_WRITEMEM,
+static stlink_status_t swim_write_byte(programmer_t *pgm, unsigned char byte, unsigned int start) {
+	regcache_invalidate(pgm, start, 1);
+	return swim_cmd(pgm, 9, STLINK_SWIM, SWIM_WRITEMEM,
 			0x00, 0x01,
 			0x00, EX(start),
 			HI(start), LO(start),
@@ -416,32 +1273,153 @@ static void stlink2_write_word(programmer_t *pgm, unsigned int word, unsigned in
 }
 #endif
 
+// Returns -1 on error
 static int swim_read_byte(programmer_t *pgm, unsigned int addr) {
-	swim_cmd(pgm, 8, STLINK_SWIM, SWIM_READMEM,
+	unsigned int byte;
+
+	if (swim_cmd(pgm, 8, STLINK_SWIM, SWIM_READMEM,
 			0x00, 0x01,
 			0x00, EX(addr),
-			HI(addr), LO(addr));
+			HI(addr), LO(addr)))
+		return(-1);
 
-	stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUF);
-	return(msg_recv_int8(pgm));
+	if (stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUF) || msg_recv_int8(pgm, &byte))
+		return(-1);
+	return(byte);
 }
 
-int stlink2_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length) {
+/* Error recovery.
+ * After a failed command the link is resynchronised with a SWIM_RESET and,
+ * if enabled, high speed is negotiated again unless the link monitor decides
+ * to fall back to low speed. The caller then retries only the failed block
+ * or the rest of a read. Each read_range or write_range call tolerates
+ * pgm->swim_error_budget errors (MAX_SWIM_ERRORS if negative); the diff read
+ * at the start of a write starts the count afresh, before any block is written.
+ */
+static bool stlink2_recover(programmer_t *pgm) {
+	unsigned int budget = (pgm->swim_error_budget < 0 ? MAX_SWIM_ERRORS : pgm->swim_error_budget);
+	pgm_link_t *l = &pgm->link;
+
+	if (l->clean >= LINK_CLEAN_WINDOW)
+		l->recent_errors = 0;
+	l->recent_errors++;
+	l->clean = 0;
+
+	if (pgm->swim_errors++ - pgm->swim_errors_mark >= budget) {
+		fprintf(stderr, "Giving up after %u SWIM errors\n", pgm->swim_errors - pgm->swim_errors_mark);
+		return(false);
+	}
+	DEBUG_PRINT("recovering from SWIM error %u\n", pgm->swim_errors);
+	// The failed command may have left target registers in any state
+	regcache_clear(pgm);
+	if (swim_cmd(pgm, 2, STLINK_SWIM, SWIM_RESET))
+		return(false);
+#if USE_HIGH_SPEED
+	if (l->high_speed && l->recent_errors >= LINK_FALLBACK_ERRORS) {
+		fprintf(stderr, "SWIM link unreliable, falling back to low speed\n");
+		if (stlink2_low_speed(pgm))
+			return(false);
+		l->fallbacks++;
+		if (l->fallbacks > 1)
+			l->step_up *= 2;
+		l->recent_errors = 0;
+	} else if (l->high_speed && stlink2_high_speed(pgm)) {
+		return(false);
+	}
+#endif
+	return(true);
+}
+
+#if USE_ASYNC_READ
+/* A chunk's READMEM takes about as long per byte as the last one did, so
+ * its status is first read when 7/8 of that time has passed instead of
+ * polling from the start.
+ */
+static void swim_read_pace(unsigned long long sent, unsigned int size, unsigned long long ns_per_byte) {
+	unsigned long long due = sent + ns_per_byte * size / 1000 * 7 / 8, now = time_us();
+
+	if (due > now)
+		usleep(due - now);
+}
+
+/* With a double buffering programmer each chunk takes half of its buffer,
+ * and the READMEM for the next chunk, into the other half, is sent right
+ * behind the READBUF for this one, so the SWIM read runs while the data is
+ * sent over USB.
+ */
+static int swim_read_mem(programmer_t *pgm, unsigned char *buffer, unsigned int start, unsigned int length) {
+	unsigned char readmem_cmd[16], readbuf_cmd[16] = { STLINK_SWIM, SWIM_READBUF };
+	unsigned int chunk = (pgm->double_buffer ? pgm->read_buf_size / 2 : pgm->read_buf_size);
+	unsigned int remaining = length, offset = 0;
+	unsigned int size = (remaining > chunk ? chunk : remaining);
+	unsigned long long sent = time_us(), ns_per_byte;
+
+	DEBUG_PRINT("read range\n");
+	if (!length)
+		return 0;
+
+	swim_readmem_cmd(readmem_cmd, start, size, offset);
+	if (msg_send(pgm, readmem_cmd, sizeof(readmem_cmd)) || swim_wait_status(pgm, SWIM_READMEM))
+		return 0;
+	ns_per_byte = (time_us() - sent) * 1000 / size;
+
+	while (remaining > 0) {
+		unsigned int next = (remaining - size > chunk ? chunk : remaining - size);
+		msg_async_t msgs[3] = {
+			{ readbuf_cmd, sizeof(readbuf_cmd), LIBUSB_ENDPOINT_OUT },
+			{ buffer, size, LIBUSB_ENDPOINT_IN },
+			{ readmem_cmd, sizeof(readmem_cmd), LIBUSB_ENDPOINT_OUT },
+		};
+
+		DEBUG_PRINT("read 0x%04x to 0x%04x\n", start, start + size);
+		if (pgm->double_buffer) {
+			swim_readbuf_cmd(readbuf_cmd, size, offset);
+			offset ^= chunk;
+			swim_readmem_cmd(readmem_cmd, start + size, next, offset);
+		}
+		// Fetch the chunk with command and data transfer in flight at once
+		sent = time_us();
+		if (msg_transfer_async(pgm, msgs, (pgm->double_buffer && next ? 3 : 2)))
+			return length - remaining;
+
+		buffer += size;
+		start += size;
+		remaining -= size;
+		size = next;
+		if (!remaining)
+			break;
+		if (!pgm->double_buffer) {
+			swim_readmem_cmd(readmem_cmd, start, size, offset);
+			sent = time_us();
+			if (msg_send(pgm, readmem_cmd, sizeof(readmem_cmd)))
+				return length - remaining;
+		}
+		swim_read_pace(sent, size, ns_per_byte);
+		if (swim_wait_status(pgm, SWIM_READMEM))
+			return length - remaining;
+		ns_per_byte = (time_us() - sent) * 1000 / size;
+	}
+
+	return length;
+}
+#else
+static int swim_read_mem(programmer_t *pgm, unsigned char *buffer, unsigned int start, unsigned int length) {
 	DEBUG_PRINT("read range\n");
 
 	unsigned int remaining = length;
 
 	while (remaining > 0) {
-		unsigned int size = (remaining > read_buf_size ? read_buf_size : remaining);
+		unsigned int size = (remaining > pgm->read_buf_size ? pgm->read_buf_size : remaining);
 
 		DEBUG_PRINT("read 0x%04x to 0x%04x\n", start, start + size);
 
-		swim_cmd(pgm, 8, STLINK_SWIM, SWIM_READMEM,
+		if (swim_cmd(pgm, 8, STLINK_SWIM, SWIM_READMEM,
 				HI(size), LO(size),
-				0x00, EX(start), HI(start), LO(start));
+				0x00, EX(start), HI(start), LO(start)))
+			return length - remaining;
 
-		stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUF);
-		msg_recv(pgm, buffer, size);
+		if (stlink2_cmd(pgm, 2, STLINK_SWIM, SWIM_READBUF) || msg_recv(pgm, buffer, size))
+			return length - remaining;
 
 		buffer += size;
 		start += size;
@@ -450,128 +1428,254 @@ int stlink2_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsi
 
 	return length;
 }
+#endif
 
-int stlink2_swim_write_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype) {
-	unsigned int iapsr;
+int stlink2_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length) {
+	unsigned int done = 0;
+
+	pgm->swim_errors_mark = pgm->swim_errors;
+	for (;;) {
+		stlink2_link_check(pgm);
+		done += swim_read_mem(pgm, buffer + done, start + done, length - done);
+		if (done >= length || !stlink2_recover(pgm))
+			return(done);
+		pgm->read_retries++;
+	}
+}
+
+/* RAM needs neither the flash controller nor block alignment, so it is
+ * written in chunks as large as the programmer's buffer, without reading it
+ * first. A failed chunk is written again after stlink2_recover. Returns the
+ * number of bytes written before the first chunk that could not be.
+ */
+static int stlink2_swim_write_ram(programmer_t *pgm, unsigned char *buffer, unsigned int start, unsigned int length) {
+	unsigned int i, size;
+	swim_queue_t q = { .count = 0 };
+
+	DEBUG_PRINT("write range: RAM in chunks of up to %d bytes\n", pgm->read_buf_size);
+
+	for (i = 0; i < length; i += size) {
+		size = (length - i > pgm->read_buf_size ? pgm->read_buf_size : length - i);
+		swim_queue_write(pgm, &q, buffer + i, size, start + i);
+		while (swim_queue_flush(pgm, &q)) {
+			if (swim_queue_latched(&q) || !stlink2_recover(pgm)) {
+				swim_queue_drop(&q);
+				return(i);
+			}
+		}
+	}
+	return(length);
+}
+
+/* Writes FLASH, EEPROM, OPT or an arbitrary address range. The clock setup
+ * and the unlocking are done once per session; the memories are locked again
+ * by stlink2_session_lock. After an error (force) the session state is not
+ * trusted: the clock is set again and IAPSR tells whether the memories are
+ * still unlocked, as sending the keys to an unlocked memory may lock it.
+ * A failed command is replayed from where it failed, never the keys before it.
+ */
+static stlink_status_t stlink2_write_setup(programmer_t *pgm, const stm8_device_t *device, const memtype_t memtype, bool force) {
+	swim_queue_t q = { .count = 0 };
+	stlink_status_t status;
 
 	DEBUG_PRINT("write range: setup\n");
 
-	swim_write_byte(pgm, 0x00, device->regs.CLK_CKDIVR);
+	if (force) {
+		int iapsr = swim_read_byte(pgm, device->regs.FLASH_IAPSR);
+
+		if (iapsr < 0)
+			return(STLK_SWIM_ERROR);
+		pgm->session.clock_set = false;
+		pgm->session.flash_unlocked = (iapsr & 0x02) != 0;
+		pgm->session.data_unlocked = (iapsr & 0x08) != 0;
+		pgm->session.eop_cleared = true;
+	} else if (eop_clear(pgm, device, swim_read_byte)) {
+		return(STLK_SWIM_ERROR);
+	}
+
+	if (!pgm->session.clock_set)
+		swim_queue_write_byte(pgm, &q, 0x00, device->regs.CLK_CKDIVR);
 
 	// Unlock MASS
-	if (memtype == FLASH) {
+	if (memtype == FLASH && !pgm->session.flash_unlocked) {
 		DEBUG_PRINT("write range: unlock FLASH\n");
-		swim_write_byte(pgm, 0x56, device->regs.FLASH_PUKR);
-		swim_write_byte(pgm, 0xae, device->regs.FLASH_PUKR); 
-	} else if (memtype == EEPROM || memtype == OPT) {
+		swim_queue_write_byte(pgm, &q, 0x56, device->regs.FLASH_PUKR);
+		swim_queue_write_byte(pgm, &q, 0xae, device->regs.FLASH_PUKR);
+	} else if ((memtype == EEPROM || memtype == OPT) && !pgm->session.data_unlocked) {
 		DEBUG_PRINT("write range: unlock EEPROM\n");
-		swim_write_byte(pgm, 0xae, device->regs.FLASH_DUKR);
-		swim_write_byte(pgm, 0x56, device->regs.FLASH_DUKR);
+		swim_queue_write_byte(pgm, &q, 0xae, device->regs.FLASH_DUKR);
+		swim_queue_write_byte(pgm, &q, 0x56, device->regs.FLASH_DUKR);
 	}
 
 	if (memtype == OPT) {
 		// Option programming mode
-		swim_write_byte(pgm, 0x80, device->regs.FLASH_CR2);
+		swim_queue_write_byte(pgm, &q, 0x80, device->regs.FLASH_CR2);
 		if (device->regs.FLASH_NCR2 != 0) {
-			swim_write_byte(pgm, 0x7F, device->regs.FLASH_NCR2);
+			swim_queue_write_byte(pgm, &q, 0x7F, device->regs.FLASH_NCR2);
 		}
+	}
 
-		for (unsigned int i = 0; i < length; i++) {
-			swim_write_byte(pgm, *(buffer++), start++);
-			// Wait for EOP to be set in FLASH_IAPSR
-			usleep(6000); // t_prog per the datasheets is 6ms typ, 6.6ms max
-			TRY(5,swim_read_byte(pgm, device->regs.FLASH_IAPSR) & 0x04);
+	while ((status = swim_queue_flush(pgm, &q))) {
+		if (swim_queue_latched(&q) || !stlink2_recover(pgm)) {
+			swim_queue_drop(&q);
+			return(status);
 		}
+	}
+	pgm->session.device = device;
+	pgm->session.clock_set = true;
+	if (memtype == FLASH)
+		pgm->session.flash_unlocked = true;
+	else if (memtype == EEPROM || memtype == OPT)
+		pgm->session.data_unlocked = true;
+	return(STLK_OK);
+}
 
-	} else {
-		// NOTE : RAM is also written in flash_block_size chunks here; just for convenience
-		unsigned int rounded_size = ((length - 1) / device->flash_block_size + 1) * device->flash_block_size;
-		unsigned char *current = alloca(rounded_size);
-		int i;
-
-#if ONLY_WRITE_DIFFS
-		stlink2_swim_read_range(pgm, device, current, start, rounded_size);
-		memcpy(buffer + length, current + length, rounded_size - length);
-#endif
+// Resynchronises the link and repeats the setup; false if the write has to be given up
+static bool stlink2_write_recover(programmer_t *pgm, const stm8_device_t *device, const memtype_t memtype) {
+	return(stlink2_recover(pgm) && !stlink2_write_setup(pgm, device, memtype, true));
+}
 
-		DEBUG_PRINT("write range: block program with block size = %d\n", device->flash_block_size);
-
-		for (i = 0; i < length; i += device->flash_block_size) {
-				// BUG HERE : can read beyond buffer[] array boundary, because buffer is not always a multiple of flash_block_size
-			if (ONLY_WRITE_DIFFS && !memcmp(current + i, buffer + i, device->flash_block_size)) {
-				DEBUG_PRINT("no change 0x%04x to 0x%04x\n", start + i, start + i + device->flash_block_size);
-			} else {
-				int prgmode;
-				/*
-				 * Use fast block programming (prgmode = 0x10) only if we have
-				 * read the flash block and verified that it is empty (all its
-				 * bytes are 0x00).
-				 */
-#if ONLY_WRITE_DIFFS
-				prgmode = 0x10;
-				for (int j = 0; j < device->flash_block_size; j++) {
-					if (current[i + j]) {
-						prgmode = 0x01;
-						break;
-					}
-				}
-#else
-				prgmode = 0x01;
-#endif
+static int stlink2_write_opt_byte(programmer_t *pgm, const stm8_device_t *device, unsigned char byte, unsigned int addr) {
+	if (swim_write_byte(pgm, byte, addr))
+		return(EOP_IO_ERROR);
+	return(eop_wait(pgm, device, EOP_BYTE, swim_read_byte));
+}
 
-				DEBUG_PRINT("%swrite 0x%04x to 0x%04x\n", (prgmode == 0x10 ? "fast " : ""), start + i, start + i + device->flash_block_size);
+// Returns EOP_OK or the reason the block failed
+static int stlink2_write_block(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int addr, int prgmode, const memtype_t memtype) {
+	swim_queue_t q = { .count = 0 };
+
+	stlink2_link_check(pgm);
+
+	if (memtype == FLASH || memtype == EEPROM) {
+		// Stall the CPU before entering block programming mode
+		// If the CPU keeps running and executes a software reset
+		// (e.g. due to an invalid instruction) programming fails.
+		// The stall bit stays set until the target is reset, so after
+		// the first block both the read and the write come from the cache.
+		// stlink2_recover and stlink2_target_reset clear the cache.
+		unsigned char csr;
+		if (!regcache_get(pgm, device->regs.FLASH_DM_CSR2, &csr)) {
+			swim_queue_read(pgm, &q, &csr, 1, device->regs.FLASH_DM_CSR2);
+			if (swim_queue_flush(pgm, &q))
+				return(EOP_IO_ERROR);
+			regcache_set(pgm, device->regs.FLASH_DM_CSR2, csr);
+		}
+		swim_queue_write_reg(pgm, &q, csr | 8, device->regs.FLASH_DM_CSR2);
+
+		// Block programming mode
+		// The programming mode bits in CR2/NCR2 are cleared by hardware
+		// when the block has been written, so they are written every time.
+		swim_queue_write_byte(pgm, &q, prgmode, device->regs.FLASH_CR2);
+		if(device->regs.FLASH_NCR2 != 0) {
+			swim_queue_write_byte(pgm, &q, ~prgmode, device->regs.FLASH_NCR2);
+		}
+	}
 
-				if (memtype == FLASH || memtype == EEPROM) {
-					// Stall the CPU before entering block programming mode
-          // If the CPU keeps running and executes a software reset
-          // (e.g. due to an invalid instruction) programming fails.
-					int csr = swim_read_byte(pgm, device->regs.FLASH_DM_CSR2);
-					swim_write_byte(pgm, csr | 8, device->regs.FLASH_DM_CSR2);
+	// Page-based writing
+	// The first 8 packet bytes are transmitted in the same USB bulk transfer
+	// as the command itself with the rest following.
+	// BUG HERE : only works correctly if start is on flash block boundary
+	swim_queue_write(pgm, &q, buffer, device->flash_block_size, addr);
+	if (swim_queue_flush(pgm, &q))
+		return(EOP_IO_ERROR);
+
+	if (memtype == FLASH || memtype == EEPROM)
+		return(eop_wait(pgm, device, eop_mode(prgmode), swim_read_byte));
+	return(EOP_OK);
+}
 
-					// Block programming mode
-					swim_write_byte(pgm, prgmode, device->regs.FLASH_CR2);
-					if(device->regs.FLASH_NCR2 != 0) {
-						swim_write_byte(pgm, ~prgmode, device->regs.FLASH_NCR2);
-					}
-				}
+/* A write protection error may also mean that the target was reset by its
+ * watchdog or a brown-out, which clears the CPU stall bit and locks the
+ * memories. The stall bit is read from the target, not the cache, to tell.
+ */
+static bool stlink2_target_reset(programmer_t *pgm, const stm8_device_t *device) {
+	int csr = swim_read_byte(pgm, device->regs.FLASH_DM_CSR2);
+
+	if (csr < 0 || (csr & 0x08))
+		return(false);
+	fprintf(stderr, "Target was reset during programming\n");
+	regcache_clear(pgm);
+	pgm->session.flash_unlocked = false;
+	pgm->session.data_unlocked = false;
+	pgm->session.clock_set = false;
+	return(true);
+}
 
-				// Page-based writing
-				// The first 8 packet bytes are transmitted in the same USB bulk transfer
-				// as the command itself with the rest following.
-				// BUG HERE : only works correctly if start is on flash block boundary
-				swim_cmd_with_data(pgm, buffer + i, device->flash_block_size, 8, STLINK_SWIM, SWIM_WRITEMEM,
-					HI(device->flash_block_size), LO(device->flash_block_size),
-					EH(start + i), EX(start + i), HI(start + i), LO(start + i));
-
-				if (memtype == FLASH || memtype == EEPROM) {
-					// Wait for EOP to be set in FLASH_IAPSR
-					// t_prog per the datasheets is 6ms typ, 6.6ms max, fast mode is twice as fast
-					usleep(prgmode == 0x10 ? 3000 : 6000);
-					//TRY(5,swim_read_byte(pgm, device->regs.FLASH_IAPSR) & 0x04);
-					// provide a better error message than 'tries exceeded'
-					do {
-						int retries = 5;
-						int iapsr;
-						while (retries > 0) {
-							iapsr = swim_read_byte(pgm, device->regs.FLASH_IAPSR);
-							if (iapsr & 0x04) break;
-							if (iapsr & 0x01) {
-								ERROR("target page is write protected (UBC) or read-out protection is enabled");
-							}
-							retries--;
-							usleep(10000);
-						}
-					} while (0);
+// Block writer for blockwrite_range, recovering from SWIM errors and target resets
+static int stlink2_program_block(programmer_t *pgm, const stm8_device_t *device, unsigned char *block, unsigned int addr, int prgmode, const memtype_t memtype) {
+	unsigned int transfers = pgm->usb_transfers;
+	int result;
+
+	while ((result = stlink2_write_block(pgm, device, block, addr, prgmode, memtype)) != EOP_OK) {
+		if (result == EOP_WR_PG_DIS && !stlink2_target_reset(pgm, device))
+			return(result);
+		if (!stlink2_write_recover(pgm, device, memtype))
+			return(result);
+		// The failed attempt may have programmed part of the block,
+		// so it is no longer known to be erased.
+		prgmode = 0x01;
+		pgm->block_retries++;
+	}
+
+	pgm->blocks_written++;
+	pgm->block_transfers += pgm->usb_transfers - transfers;
+	return(0);
+}
+
+static int stlink2_swim_write_mem(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype) {
+	unsigned int i = 0;
+	int result;
+
+	if (stlink2_write_setup(pgm, device, memtype, false))
+		return(0);
+
+	if (memtype == OPT) {
+
+		// Only program the bytes that differ, unless forced. Complement pairs
+		// need no special care: if a value changes, so does its complement.
+		unsigned char *current = pgm->force_write ? NULL : malloc(length);
+		unsigned int skipped = 0;
+		bool diff = current && stlink2_swim_read_range(pgm, device, current, start, length) == length;
+
+		for (i = 0; i < length; i++) {
+			if (diff && current[i] == buffer[i]) {
+				skipped++;
+				continue;
+			}
+			while ((result = stlink2_write_opt_byte(pgm, device, buffer[i], start + i)) != EOP_OK) {
+				if (result == EOP_WR_PG_DIS || !stlink2_write_recover(pgm, device, memtype)) {
+					free(current);
+					return(i);
 				}
+				pgm->block_retries++;
 			}
 		}
-	}
+		if (skipped)
+			fprintf(stderr, "%u of %u option bytes unchanged, not programmed\n", skipped, length);
 
-	if (memtype == FLASH || memtype == EEPROM || memtype == OPT) {
-		// Reset DUL and PUL in IAPSR to disable flash and data writes.
-		iapsr = swim_read_byte(pgm, device->regs.FLASH_IAPSR);
-		swim_write_byte(pgm, iapsr & (~0x0a), device->regs.FLASH_IAPSR);
+		free(current);
+		return(length);
 	}
 
-	return(length);
+	return(blockwrite_range(pgm, device, buffer, start, length, memtype, ONLY_WRITE_DIFFS, stlink2_program_block));
+}
+
+int stlink2_swim_write_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype) {
+	unsigned int errors = pgm->swim_errors;
+	int written;
+
+	pgm->swim_errors_mark = errors;
+	if (memtype == RAM)
+		return(stlink2_swim_write_ram(pgm, buffer, start, length));
+
+	written = stlink2_swim_write_mem(pgm, device, buffer, start, length, memtype);
+	if (pgm->swim_errors != errors)
+		fprintf(stderr, "%u SWIM errors during write, %u blocks retried so far\n",
+			pgm->swim_errors - errors, pgm->block_retries);
+	// Option bytes may change the protection right away, and after an error
+	// the target's state is unknown: lock now rather than at the end of the session.
+	if (memtype == OPT || written < (int)length)
+		stlink2_session_lock(pgm);
+	return(written);
 }
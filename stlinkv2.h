@@ -8,5 +8,6 @@ void stlink2_close(programmer_t *pgm);
 void stlink2_srst(programmer_t *pgm);
 int stlink2_swim_read_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length);
 int stlink2_swim_write_range(programmer_t *pgm, const stm8_device_t *device, unsigned char *buffer, unsigned int start, unsigned int length, const memtype_t memtype);
+void stlink2_print_stats(programmer_t *pgm);
 
 #endif
@@ -0,0 +1,132 @@
+/* Effect of payload compression on esp-stlink transfers, for "make bench-esp"
+ *
+ * Writes a flash image through the driver and reads the flash back, once
+ * with version 3 firmware (no compression) and once with version 4, both at
+ * the firmware's default baud rate. The image is an Intel hex, S-record or
+ * binary file given on the command line, or else a made-up one laid out
+ * like a typical application: interrupt vectors, code, constant strings
+ * and zero fill up to the end of flash. The target holds different data
+ * before the write, so every block is programmed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "espstlink.h"
+#include "fake_esp.h"
+#include "ihex.h"
+#include "srec.h"
+#include "utils.h"
+
+#define BENCH_PART    "stm8s105?6"
+#define BENCH_CODE    (10 * 1024) // made-up image: code, then
+#define BENCH_STRINGS (2 * 1024)  // strings, the rest is zero
+
+static const char * const words[] = { "error", "timeout", "sensor", "value", "config", "reset", "ok", "\n" };
+
+static bool is_ext(const char *name, const char *ext) {
+	size_t n = strlen(name), e = strlen(ext);
+
+	return(n > e && !strcmp(name + n - e, ext));
+}
+
+// Returns the length loaded, 0 on error
+static unsigned int load_image(const char *path, unsigned char *buf, const stm8_device_t *d) {
+	unsigned int start = d->flash_start, end = d->flash_start + d->flash_size;
+	FILE *f = fopen(path, "rb");
+	int len;
+
+	if(!f) {
+		perror(path);
+		return(0);
+	}
+	if(is_ext(path, ".ihx") || is_ext(path, ".hex") || is_ext(path, ".i86"))
+		len = ihex_read(f, buf, start, end);
+	else if(is_ext(path, ".s19") || is_ext(path, ".s8") || is_ext(path, ".srec"))
+		len = srec_read(f, buf, start, end);
+	else
+		len = fread(buf, 1, d->flash_size, f);
+	fclose(f);
+	return(len > 0 ? len : 0);
+}
+
+static unsigned int make_image(unsigned char *buf, const stm8_device_t *d) {
+	unsigned int i, seed = 1;
+
+	memset(buf, 0, d->flash_size);
+	for(i = 0; i < 32; i++) { // INT opcode and a handler address each
+		buf[i * 4] = 0x82;
+		buf[i * 4 + 2] = 0x80 + (i ? 1 : 0);
+		buf[i * 4 + 3] = i * 4;
+	}
+	// Code: opcodes from a small set with varying operands
+	for(i = 128; i < 128 + BENCH_CODE; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (i % 3 ? (seed >> 16) & 0xff : 0x90 + ((seed >> 20) & 0x0f));
+	}
+	while(i < 128 + BENCH_CODE + BENCH_STRINGS) {
+		const char *w = words[(seed = seed * 1103515245 + 12345) >> 16 & 7];
+
+		memcpy(buf + i, w, strlen(w) + 1);
+		i += strlen(w) + 1;
+	}
+	return(d->flash_size);
+}
+
+// Times the write and the read back, in us
+static bool run(int version, const unsigned char *image, unsigned int len, const stm8_device_t *d, unsigned long long *write_us, unsigned long long *read_us) {
+	fake_esp_t *f = fake_esp_start(version, ESPSTLINK_DEFAULT_BAUD, false, d);
+	programmer_t *pgm = calloc(1, sizeof(*pgm));
+	unsigned char *buf = malloc(d->flash_size);
+	unsigned long long begin;
+	bool ok;
+
+	fill_pattern(f->target.mem + d->flash_start, d->flash_size, 1); // the previous build
+	pgm->name = "espstlink";
+	pgm->type = ESP_STLink;
+	pgm->open = espstlink_pgm_open;
+	pgm->close = espstlink_pgm_close;
+	pgm->read_range = espstlink_swim_read_range;
+	pgm->write_range = espstlink_swim_write_range;
+	pgm->port = f->path;
+	pgm->swim_error_budget = -1;
+	ok = pgm->open(pgm);
+	if(ok) {
+		begin = time_us();
+		ok = pgm->write_range(pgm, d, (unsigned char *)image, d->flash_start, len, FLASH) == (int)len;
+		*write_us = time_us() - begin;
+		begin = time_us();
+		ok = ok && pgm->read_range(pgm, d, buf, d->flash_start, d->flash_size) == (int)d->flash_size;
+		*read_us = time_us() - begin;
+		ok = ok && !memcmp(buf, image, len);
+		if(ok)
+			printf("version %d: write %u bytes %6llu ms, read %u bytes %6llu ms, %llu payload bytes sent as %llu\n",
+				version, len, *write_us / 1000, d->flash_size, *read_us / 1000,
+				pgm->espstlink->payload_bytes, pgm->espstlink->wire_bytes);
+		pgm->close(pgm);
+	}
+	fake_esp_stop(f);
+	free(pgm);
+	free(buf);
+	return(ok);
+}
+
+int main(int argc, char **argv) {
+	const stm8_device_t *d = fake_target_part(BENCH_PART);
+	unsigned char *image = malloc(d->flash_size);
+	unsigned long long write_us[2], read_us[2];
+	unsigned int len;
+
+	len = (argc > 1 ? load_image(argv[1], image, d) : make_image(image, d));
+	if(!len)
+		return(1);
+	printf("%s on %s at %u baud\n", argc > 1 ? argv[1] : "made-up image", BENCH_PART, ESPSTLINK_DEFAULT_BAUD);
+	if(!run(3, image, len, d, &write_us[0], &read_us[0]) || !run(4, image, len, d, &write_us[1], &read_us[1])) {
+		fprintf(stderr, "benchmark failed\n");
+		return(1);
+	}
+	printf("speedup with compression: write %.2fx, read %.2fx\n",
+		(double)write_us[0] / write_us[1], (double)read_us[0] / read_us[1]);
+	free(image);
+	return(0);
+}
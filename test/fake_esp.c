@@ -0,0 +1,427 @@
+/* Emulated esp-stlink firmware, see fake_esp.h
+ *
+ * Reads, writes and WRITE_BLOCKS go to a fake_target_t, so unlocking, block
+ * programming, IAPSR and the target's fault injection behave as with the
+ * emulated ST-Links. A target access that fails is answered with a SWIM
+ * NACK, a command the firmware version does not have or whose data would
+ * not fit its buffer with FAKE_ESP_INVALID.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "fake_esp.h"
+#include "utils.h"
+
+#define FAKE_ESP_NACK        0xfffc // ESPSTLINK_SWIM_ERROR_NACK
+#define FAKE_ESP_INVALID     0xfffb
+#define FAKE_ESP_ENTRY       1280   // SWIM entry, in firmware cycles
+#define FAKE_ESP_EOP_US      10000  // WRITE_BLOCKS gives up on a block after this
+#define FAKE_ESP_REVERT_US   (ESPSTLINK_BAUD_REVERT_MS * 1000)
+#define FAKE_ESP_TX_CHUNK    64     // bytes the sender hands over at a time
+#define FAKE_ESP_OPT_BAUD    1
+#define FAKE_ESP_OPT_COMPRESSION 2
+
+typedef struct fake_esp_tx_s {
+	struct fake_esp_tx_s *next;
+	unsigned long long due;
+	unsigned int len;
+	unsigned char data[FAKE_ESP_TX_CHUNK];
+} fake_esp_tx_t;
+
+static void sleep_until(unsigned long long t) {
+	unsigned long long now = time_us();
+
+	if(t > now)
+		usleep(t - now);
+}
+
+static unsigned int byte_us(fake_esp_t *f, unsigned int n) {
+	return((unsigned long long)n * 10 * 1000000 / f->baud);
+}
+
+// Takes n bytes from the host at the link's byte time, false once the host is gone
+static bool fw_read(fake_esp_t *f, unsigned char *buf, unsigned int n) {
+	unsigned long long now;
+	unsigned int got = 0;
+	ssize_t r;
+
+	while(got < n) {
+		r = read(f->fd, buf + got, n - got);
+		if(r <= 0)
+			return(false);
+		got += r;
+	}
+	f->rx_bytes += n;
+	// Sleeping too long once must not slow down everything after it
+	now = time_us();
+	if(f->rx_clock + 1000 < now)
+		f->rx_clock = now;
+	f->rx_clock += byte_us(f, n);
+	sleep_until(f->rx_clock);
+	return(true);
+}
+
+static unsigned int fw_waiting(fake_esp_t *f) {
+	int n = 0;
+
+	if(ioctl(f->fd, FIONREAD, &n) != 0)
+		return(0);
+	return(n);
+}
+
+static void *fake_esp_sender(void *arg) {
+	fake_esp_t *f = arg;
+	fake_esp_tx_t *tx;
+	unsigned int i, n;
+
+	for(;;) {
+		pthread_mutex_lock(&f->lock);
+		while(!f->tx_first && !f->stopping)
+			pthread_cond_wait(&f->cond, &f->lock);
+		tx = f->tx_first;
+		if(tx && !(f->tx_first = tx->next))
+			f->tx_last = NULL;
+		pthread_mutex_unlock(&f->lock);
+		if(!tx)
+			return(NULL);
+		sleep_until(tx->due);
+		for(i = 0; i < tx->len; i += n) {
+			n = f->chunky ? 1 + rand() % 7 : tx->len;
+			if(n > tx->len - i)
+				n = tx->len - i;
+			if(write(f->fd, tx->data + i, n) != (ssize_t)n)
+				break;
+		}
+		free(tx);
+	}
+}
+
+// Puts a response on the wire after the ones before it
+static void fw_send(fake_esp_t *f, const unsigned char *buf, unsigned int len) {
+	unsigned long long now = time_us();
+	fake_esp_tx_t *tx;
+	unsigned int i;
+
+	f->tx_bytes += len;
+	for(i = 0; i < len; i += tx->len) {
+		if(!(tx = malloc(sizeof(*tx))))
+			return;
+		tx->next = NULL;
+		tx->len = (len - i > FAKE_ESP_TX_CHUNK ? FAKE_ESP_TX_CHUNK : len - i);
+		memcpy(tx->data, buf + i, tx->len);
+		if(f->wire_end < now)
+			f->wire_end = now;
+		f->wire_end += byte_us(f, tx->len);
+		tx->due = f->wire_end + f->latency_us;
+		pthread_mutex_lock(&f->lock);
+		if(f->tx_last)
+			f->tx_last->next = tx;
+		else
+			f->tx_first = tx;
+		f->tx_last = tx;
+		pthread_cond_signal(&f->cond);
+		pthread_mutex_unlock(&f->lock);
+	}
+}
+
+static void fw_ok(fake_esp_t *f, unsigned char cmd, const unsigned char *data, unsigned int len) {
+	static __thread unsigned char buf[2 + 8 + ESPSTLINK_RLE_BOUND(0xffff)];
+
+	buf[0] = cmd;
+	buf[1] = 0;
+	memcpy(buf + 2, data, len);
+	fw_send(f, buf, 2 + len);
+}
+
+static void fw_error(fake_esp_t *f, unsigned char cmd, unsigned int code) {
+	unsigned char buf[4] = { cmd, 0xff, code >> 8, code & 0xff };
+
+	fw_send(f, buf, sizeof(buf));
+}
+
+// Echo (the command's length and address) and data, encoded if compressing
+static void fw_ok_data(fake_esp_t *f, unsigned char cmd, const unsigned char *echo, unsigned int echo_len, const unsigned char *data, unsigned int len) {
+	static __thread unsigned char buf[8 + ESPSTLINK_RLE_BOUND(0xffff)];
+
+	memcpy(buf, echo, echo_len);
+	if(f->compress) {
+		len = espstlink_rle_encode(data, len, buf + echo_len);
+	} else {
+		memcpy(buf + echo_len, data, len);
+	}
+	fw_ok(f, cmd, buf, echo_len + len);
+}
+
+// A data payload of n bytes, run-length encoded once compression is on
+static bool fw_read_payload(fake_esp_t *f, unsigned char *buf, unsigned int n) {
+	unsigned int out, len;
+	unsigned char token;
+
+	if(!f->compress)
+		return(fw_read(f, buf, n));
+	for(out = 0; out < n; out += len) {
+		if(!fw_read(f, &token, 1))
+			return(false);
+		len = (token & 0x80 ? (token & 0x7f) + ESPSTLINK_RLE_RUN_MIN : token + 1u);
+		if(len > n - out)
+			return(false);
+		if(token & 0x80) {
+			if(!fw_read(f, buf + out, 1))
+				return(false);
+			memset(buf + out, buf[out], len);
+		} else if(!fw_read(f, buf + out, len)) {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+static bool swim_read(fake_esp_t *f, unsigned int addr, unsigned char *buf, unsigned int n) {
+	usleep(FAKE_ESP_SWIM_US + n * FAKE_ESP_BYTE_US);
+	return(fake_target_read(&f->target, addr, buf, n, time_us()));
+}
+
+static bool swim_write(fake_esp_t *f, unsigned int addr, const unsigned char *buf, unsigned int n) {
+	usleep(FAKE_ESP_SWIM_US + n * FAKE_ESP_BYTE_US);
+	return(fake_target_write(&f->target, addr, buf, n, time_us()));
+}
+
+static unsigned int be16(const unsigned char *p) { return((p[0] << 8) | p[1]); }
+static unsigned int be24(const unsigned char *p) { return((p[0] << 16) | (p[1] << 8) | p[2]); }
+
+// SET_OPTION; false once the host is gone
+static bool fw_set_option(fake_esp_t *f, unsigned char cmd, const unsigned char *arg) {
+	unsigned int value = (arg[1] << 24) | (arg[2] << 16) | (arg[3] << 8) | arg[4], old = f->baud;
+	unsigned long long until;
+	unsigned char junk;
+
+	if(arg[0] == FAKE_ESP_OPT_COMPRESSION && f->version >= 4) {
+		f->compress = value != 0;
+		fw_ok(f, cmd, NULL, 0);
+		return(true);
+	}
+	if(arg[0] != FAKE_ESP_OPT_BAUD || f->version < 2 || !value) {
+		fw_error(f, cmd, FAKE_ESP_INVALID);
+		return(true);
+	}
+	// The acknowledgement still goes out at the old rate
+	fw_ok(f, cmd, NULL, 0);
+	sleep_until(f->wire_end);
+	f->baud = value;
+	f->baud_switches++;
+	if(!f->bad_baud)
+		return(true);
+	// Nothing valid arrives at the new rate, so the firmware goes back
+	until = time_us() + FAKE_ESP_REVERT_US;
+	while(time_us() < until) {
+		struct pollfd p = { f->fd, POLLIN, 0 };
+		int r = poll(&p, 1, (until - time_us()) / 1000 + 1);
+
+		if(r > 0 && read(f->fd, &junk, 1) <= 0)
+			return(false);
+	}
+	f->baud = old;
+	return(true);
+}
+
+// WRITE_BLOCKS: mode registers, block and IAPSR polling for each block
+static void fw_write_blocks(fake_esp_t *f, unsigned char cmd, const unsigned char *arg, const unsigned char *data) {
+	unsigned int count = arg[0], size = be16(arg + 1), done;
+	unsigned int cr2 = be24(arg + 4), ncr2 = be24(arg + 7), iapsr = be24(arg + 10), addr = be24(arg + 13);
+	unsigned char mode = arg[3], nmode = ~arg[3], status = 0, result[2];
+	unsigned long long until;
+
+	for(done = 0; done < count; done++) {
+		if(!swim_write(f, cr2, &mode, 1) || (ncr2 && !swim_write(f, ncr2, &nmode, 1)) ||
+		   !swim_write(f, addr + done * size, data + done * size, size)) {
+			fw_error(f, cmd, FAKE_ESP_NACK);
+			return;
+		}
+		until = time_us() + FAKE_ESP_EOP_US;
+		do {
+			if(!swim_read(f, iapsr, &status, 1)) {
+				fw_error(f, cmd, FAKE_ESP_NACK);
+				return;
+			}
+		} while(!(status & 0x05) && time_us() < until);
+		if(!(status & 0x04))
+			break;
+	}
+	result[0] = done;
+	result[1] = status;
+	fw_ok(f, cmd, result, sizeof(result));
+}
+
+// Runs one command, false once the host is gone
+static bool fw_command(fake_esp_t *f, unsigned char cmd) {
+	static __thread unsigned char data[0x10000];
+	unsigned char arg[16], reply[2];
+	unsigned int size, addr, hdr;
+
+	switch(cmd) {
+		case 0xff: // GET_VERSION
+			reply[0] = f->version >> 8;
+			reply[1] = f->version & 0xff;
+			fw_ok(f, cmd, reply, 2);
+			return(true);
+		case 0xfe: // SWIM_ENTRY
+			usleep(1000);
+			reply[0] = FAKE_ESP_ENTRY >> 8;
+			reply[1] = FAKE_ESP_ENTRY & 0xff;
+			fw_ok(f, cmd, reply, 2);
+			return(true);
+		case 0xfd: // HARD_RESET, the reset pin
+			if(!fw_read(f, arg, 1))
+				return(false);
+			if(arg[0] == 1)
+				fake_target_reset(&f->target);
+			fw_ok(f, cmd, NULL, 0);
+			return(true);
+		case 0x00: // SOFT_RESET, SWIM SRST
+			fake_target_reset(&f->target);
+			fw_ok(f, cmd, NULL, 0);
+			return(true);
+		case 0xfc:
+			return(fw_read(f, arg, 5) && fw_set_option(f, cmd, arg));
+		case 0x01: case 0x02: case 0x03: case 0x04:
+			hdr = (cmd >= 0x03 ? 5 : 4);
+			if(!fw_read(f, arg, hdr))
+				return(false);
+			size = (hdr == 5 ? be16(arg) : arg[0]);
+			addr = be24(arg + hdr - 3);
+			// The payload is taken in any case, to stay in step with the host
+			if((cmd == 0x02 || cmd == 0x04) && !fw_read_payload(f, data, size))
+				return(false);
+			if(f->max_waiting < fw_waiting(f))
+				f->max_waiting = fw_waiting(f);
+			if(!f->tcp && fw_waiting(f) > FAKE_ESP_RX_BUF)
+				f->overruns++;
+			if((cmd >= 0x03 && f->version < 3) || size > ESPSTLINK_FRAME_MAX) {
+				fw_error(f, cmd, FAKE_ESP_INVALID);
+			} else if(cmd == 0x01 || cmd == 0x03) {
+				if(swim_read(f, addr, data, size))
+					fw_ok_data(f, cmd, arg, hdr, data, size);
+				else
+					fw_error(f, cmd, FAKE_ESP_NACK);
+			} else {
+				if(swim_write(f, addr, data, size))
+					fw_ok(f, cmd, arg, hdr);
+				else
+					fw_error(f, cmd, FAKE_ESP_NACK);
+			}
+			return(true);
+		case 0x05: // WRITE_BLOCKS
+			if(!fw_read(f, arg, 16))
+				return(false);
+			size = arg[0] * be16(arg + 1);
+			if(size > sizeof(data) || !fw_read_payload(f, data, size))
+				return(false);
+			if(f->version < 3 || size > ESPSTLINK_FRAME_MAX)
+				fw_error(f, cmd, FAKE_ESP_INVALID);
+			else
+				fw_write_blocks(f, cmd, arg, data);
+			return(true);
+		default:
+			fw_error(f, cmd, FAKE_ESP_INVALID);
+			return(true);
+	}
+}
+
+static void *fake_esp_firmware(void *arg) {
+	fake_esp_t *f = arg;
+	unsigned char cmd;
+	int one = 1;
+
+	if(f->tcp) {
+		if((f->fd = accept(f->listen_fd, NULL, NULL)) < 0)
+			return(NULL);
+		setsockopt(f->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	for(;;) {
+		if(f->commands && fw_waiting(f))
+			f->pipelined++;
+		if(!fw_read(f, &cmd, 1) || !fw_command(f, cmd))
+			return(NULL);
+		f->commands++;
+	}
+}
+
+fake_esp_t *fake_esp_start(int version, unsigned int baud, bool tcp, const stm8_device_t *part) {
+	fake_esp_t *f = calloc(1, sizeof(*f));
+	struct sockaddr_in a;
+	socklen_t len = sizeof(a);
+	struct termios t;
+
+	if(!f || !part) {
+		fprintf(stderr, "cannot set up the emulation\n");
+		exit(1);
+	}
+	f->version = version;
+	f->baud = baud;
+	f->latency_us = 1000;
+	f->tcp = tcp;
+	f->fd = f->listen_fd = -1;
+	fake_target_init(&f->target, part);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	if(tcp) {
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if((f->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		   bind(f->listen_fd, (struct sockaddr *)&a, sizeof(a)) || listen(f->listen_fd, 1) ||
+		   getsockname(f->listen_fd, (struct sockaddr *)&a, &len)) {
+			perror("fake esp-stlink socket");
+			exit(1);
+		}
+		snprintf(f->path, sizeof(f->path), "tcp://127.0.0.1:%d", ntohs(a.sin_port));
+	} else {
+		if((f->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(f->fd) || unlockpt(f->fd) ||
+		   tcgetattr(f->fd, &t)) {
+			perror("fake esp-stlink pty");
+			exit(1);
+		}
+		cfmakeraw(&t);
+		tcsetattr(f->fd, TCSANOW, &t);
+		snprintf(f->path, sizeof(f->path), "%s", ptsname(f->fd));
+	}
+	if(pthread_create(&f->firmware, NULL, fake_esp_firmware, f) ||
+	   pthread_create(&f->sender, NULL, fake_esp_sender, f)) {
+		fprintf(stderr, "cannot start the emulation\n");
+		exit(1);
+	}
+	return(f);
+}
+
+void fake_esp_stop(fake_esp_t *f) {
+	fake_esp_tx_t *tx;
+
+	pthread_join(f->firmware, NULL);
+	pthread_mutex_lock(&f->lock);
+	f->stopping = true;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+	pthread_join(f->sender, NULL);
+	while((tx = f->tx_first)) {
+		f->tx_first = tx->next;
+		free(tx);
+	}
+	if(f->fd >= 0)
+		close(f->fd);
+	if(f->listen_fd >= 0)
+		close(f->listen_fd);
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
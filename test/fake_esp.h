@@ -0,0 +1,59 @@
+/* Emulated esp-stlink programmer on a pty or a loopback TCP connection */
+
+#ifndef __FAKE_ESP_H
+#define __FAKE_ESP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "fake_target.h"
+#include "libespstlink.h"
+
+#define FAKE_ESP_RX_BUF     256  // firmware's serial receive buffer
+#define FAKE_ESP_SWIM_US    150  // per SWIM command
+#define FAKE_ESP_BYTE_US    12   // per byte on SWIM
+
+/* One programmer with its target. The firmware runs in a thread of its own
+ * and takes the host's bytes at the UART byte time of baud; its responses go
+ * on the wire one after the other and reach the host latency_us later, like
+ * through a USB serial adapter. A command is taken once the previous one is
+ * done, so pipelined commands wait in the receive buffer meanwhile; more
+ * than FAKE_ESP_RX_BUF bytes waiting there is an overrun on real hardware.
+ * Over TCP baud stands for the link rate and flow control does the rest.
+ * Commands carry up to ESPSTLINK_FRAME_MAX bytes of data, the protocol
+ * versions are those of libespstlink.h.
+ */
+typedef struct fake_esp_s {
+	int version;
+	unsigned int baud;
+	unsigned int latency_us;
+	bool tcp;
+	bool chunky;   // responses reach the host in pieces of a few bytes
+	bool bad_baud; // after a rate switch the host's bytes arrive garbled
+	char path[64]; // port for espstlink_open
+	fake_target_t target;
+
+	// Statistics
+	unsigned int commands, baud_switches;
+	unsigned int pipelined;  // commands that were waiting when the previous one was done
+	unsigned int max_waiting; // bytes in the receive buffer when a command started
+	unsigned int overruns;   // commands started with more than FAKE_ESP_RX_BUF bytes waiting
+	unsigned long long rx_bytes, tx_bytes;
+
+	// Firmware state
+	int fd, listen_fd;
+	bool compress;
+	unsigned long long rx_clock, wire_end;
+	pthread_t firmware, sender;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fake_esp_tx_s *tx_first, *tx_last;
+	bool stopping;
+} fake_esp_t;
+
+/* Starts the firmware of the given protocol version, with part as target.
+ * Exits if the emulation cannot be set up. */
+fake_esp_t *fake_esp_start(int version, unsigned int baud, bool tcp, const stm8_device_t *part);
+/* Call once the host has closed its end */
+void fake_esp_stop(fake_esp_t *f);
+
+#endif
@@ -0,0 +1,413 @@
+/* Emulated ST-Link firmware: the V2/V2-1/V3 command set and the SCSI
+ * wrapped V1 one, driving a fake_target_t.
+ *
+ * WRITEMEM carries its first 8 bytes in the command; the rest is taken from
+ * the same transfer unless split_only is set, in which case any extra bytes
+ * of the command transfer are dropped and the payload is expected in the
+ * following transfers, as with old firmware.
+ * READBUF answers from the read buffer that the last READMEM filled. With
+ * buf_offsets, as set for V2-1 and V3, both take an offset into the read
+ * buffer in bytes 8-9 and READBUF its size in bytes 2-3. A READMEM that
+ * arrives while READBUF data it overlaps is still queued or on the wire
+ * overwrites it, which is counted in hazards.
+ */
+
+#include <string.h>
+#include "fake_usb.h"
+
+#define MODE_MASS 0x01
+#define MODE_SWIM 0x03
+
+#define SWIM_NO_RESPONSE 0x04
+
+#define CBW_SIGNATURE 0x55534243
+#define CSW_SIGNATURE 0x55534253
+
+static unsigned int be16(const unsigned char *p) { return((p[0] << 8) | p[1]); }
+static unsigned int be32(const unsigned char *p) { return((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]); }
+static unsigned int le32(const unsigned char *p) { return((p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]); }
+static unsigned long long max_us(unsigned long long a, unsigned long long b) { return(a > b ? a : b); }
+
+void fake_stlink_init(fake_stlink_t *s, fake_stlink_type_t type, const stm8_device_t *part) {
+	static const unsigned int pids[] = {
+		[FAKE_STLINK_V1] = 0x3744,
+		[FAKE_STLINK_V2] = 0x3748,
+		[FAKE_STLINK_V21] = 0x374b,
+		[FAKE_STLINK_V3] = 0x374f,
+	};
+
+	memset(s, 0, sizeof(*s));
+	s->type = type;
+	s->pid = pids[type];
+	s->mode = MODE_MASS;
+	switch(type) {
+		case FAKE_STLINK_V1:
+			s->version = (1 << 12) | (10 << 6) | 4;
+			s->usb_us = 1000;
+			s->usb_ns = 1000;
+			break;
+		case FAKE_STLINK_V3:
+			s->version = (3 << 12) | (7 << 6) | 1;
+			s->usb_us = 60;
+			s->usb_ns = 50;
+			s->buf_offsets = true;
+			break;
+		default:
+			s->version = (2 << 12) | (29 << 6) | 7;
+			s->usb_us = 250;
+			s->usb_ns = 1000;
+			s->buf_offsets = (type == FAKE_STLINK_V21);
+			break;
+	}
+	fake_target_init(&s->target, part);
+}
+
+void fake_stlink_resync(fake_stlink_t *s) {
+	s->payload = 0;
+	s->cmd_len = 0;
+	s->in_count = 0;
+	s->sending = NULL;
+}
+
+static void respond(fake_stlink_t *s, const unsigned char *data, unsigned int len, unsigned long long ready, bool readbuf) {
+	fake_response_t *r;
+
+	if(s->in_count == FAKE_IN_MAX || len > sizeof(r->data))
+		return;
+	r = &s->in[(s->in_first + s->in_count++) % FAKE_IN_MAX];
+	if(data)
+		memcpy(r->data, data, len);
+	else
+		memset(r->data, 0, len);
+	r->len = len;
+	r->ready = ready;
+	r->readbuf = readbuf;
+	r->offset = 0;
+}
+
+// A SWIM operation on bytes of data, starting at t
+static void swim_run(fake_stlink_t *s, unsigned long long t, unsigned int us, unsigned int bytes, bool ok) {
+	s->swim_from = t + us;
+	s->swim_byte_us = (s->high_speed ? FAKE_SWIM_BYTE_US / 2 : FAKE_SWIM_BYTE_US);
+	s->swim_done = s->swim_from + bytes * s->swim_byte_us;
+	s->swim_status = ok ? 0 : SWIM_NO_RESPONSE;
+	s->swim_cmds++;
+	s->swim_bytes += bytes;
+}
+
+// Busy with the bytes done so far, so a long transfer shows progress
+static void swim_status(fake_stlink_t *s, unsigned long long t, unsigned char *buf) {
+	unsigned long long until = (t < s->swim_done ? t : s->swim_done);
+	unsigned int done = (until > s->swim_from ? (until - s->swim_from) / s->swim_byte_us : 0);
+
+	buf[0] = (t < s->swim_done ? 0x01 : s->swim_status);
+	buf[2] = done & 0xff;
+	buf[3] = done >> 8;
+}
+
+static bool overlap(unsigned int a, unsigned int alen, unsigned int b, unsigned int blen) {
+	return(a < b + blen && b < a + alen);
+}
+
+static void swim_readmem(fake_stlink_t *s, unsigned long long t, unsigned int addr, unsigned int size, unsigned int offset) {
+	unsigned int i;
+	bool ok;
+
+	if(offset > sizeof(s->readbuf))
+		offset = sizeof(s->readbuf);
+	if(size > sizeof(s->readbuf) - offset)
+		size = sizeof(s->readbuf) - offset;
+	// V1 takes a CBW only once the previous CSW has been read, so there its
+	// READBUF data is always out already
+	for(i = 0; i < s->in_count && s->type != FAKE_STLINK_V1; i++) {
+		fake_response_t *r = &s->in[(s->in_first + i) % FAKE_IN_MAX];
+		if(!r->readbuf)
+			continue;
+		s->overlaps++;
+		if(overlap(r->offset, r->len, offset, size)) {
+			s->hazards++;
+			memset(r->data, 0xee, r->len);
+		}
+	}
+	if(s->sending && t < s->sending_until && s->type != FAKE_STLINK_V1) {
+		unsigned int sent = s->sending_len * (t - s->sending_from) / (s->sending_until - s->sending_from);
+		s->overlaps++;
+		if(overlap(s->sending_offset, s->sending_len, offset, size)) {
+			s->hazards++;
+			memset(s->sending + sent, 0xee, s->sending_len - sent);
+		}
+	}
+	ok = fake_target_read(&s->target, addr, s->readbuf + offset, size, t);
+	s->readbuf_len = size;
+	swim_run(s, t, FAKE_SWIM_CMD_US, size, ok);
+}
+
+// READBUF: the last READMEM's data, or the given part with buf_offsets
+static void swim_readbuf(fake_stlink_t *s, const unsigned char *cmd, unsigned int len, unsigned long long t) {
+	unsigned int offset = 0;
+
+	if(s->buf_offsets && be16(cmd + 2)) {
+		len = be16(cmd + 2);
+		offset = be16(cmd + 8);
+		if(offset > sizeof(s->readbuf) || len > sizeof(s->readbuf) - offset)
+			return;
+	}
+	respond(s, s->readbuf + offset, len, max_us(t, s->swim_done), true);
+	if(s->in_count)
+		s->in[(s->in_first + s->in_count - 1) % FAKE_IN_MAX].offset = offset;
+}
+
+// The SWIM subcommands both protocols share. Returns the time the command was taken.
+static unsigned long long swim_command(fake_stlink_t *s, unsigned int sub, unsigned int addr, const unsigned char *data, unsigned int size, unsigned long long t) {
+	switch(sub) {
+		case 0x00: // ENTER
+			s->mode = MODE_SWIM;
+			break;
+		case 0x01: // EXIT
+			s->mode = MODE_MASS;
+			s->high_speed = false;
+			break;
+		case 0x03: // SPEED
+			t = max_us(t, s->swim_done);
+			s->high_speed = size != 0;
+			swim_run(s, t, FAKE_SWIM_CMD_US, 0, true);
+			break;
+		case 0x05: // GEN_RST
+			t = max_us(t, s->swim_done);
+			fake_target_reset(&s->target);
+			swim_run(s, t, FAKE_SWIM_SLOW_US, 0, true);
+			break;
+		case 0x04: // ENTER_SEQ
+		case 0x06: // RESET
+		case 0x07: // ASSERT_RESET
+		case 0x08: // DEASSERT_RESET
+			t = max_us(t, s->swim_done);
+			swim_run(s, t, FAKE_SWIM_SLOW_US, 0, true);
+			break;
+		case 0x0a: // WRITEMEM
+			t = max_us(t, s->swim_done);
+			swim_run(s, t, FAKE_SWIM_CMD_US, size, fake_target_write(&s->target, addr, data, size, t));
+			break;
+		case 0x0b: // READMEM
+			t = max_us(t, s->swim_done);
+			swim_readmem(s, t, addr, size, s->buf_offsets && data ? be16(data) : 0);
+			break;
+	}
+	return(t);
+}
+
+static unsigned long long v2_exec(fake_stlink_t *s, unsigned long long t) {
+	unsigned char *cmd = s->cmd, buf[8] = { 0 };
+	unsigned int sub = cmd[1];
+
+	s->cmd_len = 0;
+	switch(cmd[0]) {
+		case 0xf1: // GET_VERSION
+			buf[0] = s->version >> 8;
+			buf[1] = s->version & 0xff;
+			buf[2] = 0x83;
+			buf[3] = 0x04;
+			buf[4] = s->pid & 0xff;
+			buf[5] = s->pid >> 8;
+			respond(s, buf, 6, t, false);
+			return(t);
+		case 0xf5: // GET_CURRENT_MODE
+			buf[0] = s->mode;
+			respond(s, buf, 2, t, false);
+			return(t);
+		case 0xf2: // DEBUG
+		case 0xf3: // DFU
+			s->mode = MODE_MASS;
+			return(t);
+		case 0xf4:
+			break;
+		default:
+			return(t);
+	}
+
+	switch(sub) {
+		case 0x02: // READ_CAP
+			buf[0] = 0x01;
+			respond(s, buf, 8, t, false);
+			return(t);
+		case 0x09: // READSTATUS
+			swim_status(s, t, buf);
+			respond(s, buf, 4, t, false);
+			return(t);
+		case 0x0c: // READBUF
+			swim_readbuf(s, cmd, s->readbuf_len, t);
+			return(t);
+		case 0x0d: // READBUFSIZE
+			buf[0] = 6144 & 0xff;
+			buf[1] = 6144 >> 8;
+			respond(s, buf, 2, t, false);
+			return(t);
+		case 0x03: // SPEED
+			return(swim_command(s, sub, 0, NULL, cmd[2], t));
+		default:
+			return(swim_command(s, sub, be32(cmd + 4), cmd + 8, be16(cmd + 2), t));
+	}
+}
+
+static unsigned long long v2_out(fake_stlink_t *s, const unsigned char *buf, unsigned int len, unsigned long long t) {
+	unsigned int size, n;
+
+	if(s->payload) {
+		n = len < s->payload ? len : s->payload;
+		memcpy(s->cmd + s->cmd_len, buf, n);
+		s->cmd_len += n;
+		s->payload -= n;
+		return(s->payload ? t : v2_exec(s, t));
+	}
+	if(len < 16)
+		return(t);
+	memcpy(s->cmd, buf, 16);
+	s->cmd_len = 16;
+	if(buf[0] == 0xf4 && buf[1] == 0x0a && (size = be16(buf + 2)) > 8) {
+		if(size + 8 > sizeof(s->cmd))
+			return(t);
+		s->payload = size - 8;
+		if(!s->split_only && len > 16) {
+			n = len - 16 < s->payload ? len - 16 : s->payload;
+			memcpy(s->cmd + 16, buf + 16, n);
+			s->cmd_len += n;
+			s->payload -= n;
+		}
+		if(s->payload)
+			return(t);
+	}
+	return(v2_exec(s, t));
+}
+
+/* V1: a 31 byte CBW, an optional data stage and a 13 byte CSW. The SWIM
+ * command is in the CBW's command block, as in V2 but with 16 bit
+ * addresses at cb[6]. The status word has bit 0 set both while a command is
+ * running and after it failed; only a running one still counts bytes in
+ * bytes 2-3. */
+static unsigned long long v1_exec(fake_stlink_t *s, unsigned long long t) {
+	unsigned char *cbw = s->cmd, *cb = cbw + 15, *data = cbw + 31, csw[13], buf[8] = { 0 };
+	unsigned int length = le32(cbw + 8), size = be16(cb + 2), addr = be16(cb + 6);
+	unsigned char wbuf[FAKE_BUF_SIZE];
+
+	s->cmd_len = 0;
+	switch(cb[0]) {
+		case 0x12: // INQUIRY
+			respond(s, NULL, length, t, false);
+			break;
+		case 0xf1: // GET_VERSION
+			buf[0] = s->version >> 8;
+			buf[1] = s->version & 0xff;
+			respond(s, buf, length < 6 ? length : 6, t, false);
+			break;
+		case 0xf5: // status: ready
+			respond(s, buf, 2, t, false);
+			break;
+		case 0xf4:
+			switch(cb[1]) {
+				case 0x02: // READ_CAP
+					buf[0] = 0x01;
+					respond(s, buf, 8, t, false);
+					break;
+				case 0x0d: // READBUFSIZE
+					buf[0] = 6144 & 0xff;
+					buf[1] = 6144 >> 8;
+					respond(s, buf, 2, t, false);
+					break;
+				case 0x09: // READSTATUS
+					swim_status(s, t, buf);
+					buf[0] = buf[0] ? 0x01 : s->buffer_full ? 0x04 : 0x00;
+					s->buffer_full = false;
+					respond(s, buf, 4, t, false);
+					break;
+				case 0x0c: // READBUF
+					swim_readbuf(s, cb, length, t);
+					break;
+				case 0x0a: // WRITEMEM
+					if(size > sizeof(wbuf) || (size > 8 && length < size - 8))
+						break;
+					if(s->full_count && addr == s->full_addr) {
+						s->full_count--;
+						s->buffer_full = true;
+						break;
+					}
+					memcpy(wbuf, cb + 8, size < 8 ? size : 8);
+					if(size > 8)
+						memcpy(wbuf + 8, data, size - 8);
+					t = swim_command(s, cb[1], addr, wbuf, size, t);
+					break;
+				case 0x03: // SPEED
+					t = swim_command(s, cb[1], 0, NULL, cb[2], t);
+					break;
+				default:
+					t = swim_command(s, cb[1], addr, NULL, size, t);
+					break;
+			}
+			break;
+	}
+	memcpy(csw, "\x55\x53\x42\x53", 4);
+	memcpy(csw + 4, cbw + 4, 4);
+	memset(csw + 8, 0, 5);
+	respond(s, csw, sizeof(csw), t, false);
+	return(t);
+}
+
+static unsigned long long v1_out(fake_stlink_t *s, const unsigned char *buf, unsigned int len, unsigned long long t) {
+	unsigned int n;
+
+	if(s->payload) {
+		n = len < s->payload ? len : s->payload;
+		memcpy(s->cmd + s->cmd_len, buf, n);
+		s->cmd_len += n;
+		s->payload -= n;
+		return(s->payload ? t : v1_exec(s, t));
+	}
+	if(len != 31 || be32(buf) != CBW_SIGNATURE)
+		return(t);
+	memcpy(s->cmd, buf, 31);
+	s->cmd_len = 31;
+	if(!(buf[12] & 0x80) && (s->payload = le32(buf + 8))) {
+		if(s->payload + 31 > sizeof(s->cmd))
+			s->payload = 0;
+		return(t);
+	}
+	return(v1_exec(s, t));
+}
+
+unsigned long long fake_stlink_out(fake_stlink_t *s, const unsigned char *buf, unsigned int len, unsigned long long now) {
+	unsigned long long t = max_us(now, s->out_free) + s->usb_us + (unsigned long long)len * s->usb_ns / 1000;
+
+	s->transfers++;
+	if(s->drop_outs) {
+		s->drop_outs--;
+		return(0);
+	}
+	t = (s->type == FAKE_STLINK_V1 ? v1_out(s, buf, len, t) : v2_out(s, buf, len, t));
+	s->out_free = t;
+	return(t);
+}
+
+int fake_stlink_in(fake_stlink_t *s, unsigned char *buf, unsigned int len, unsigned long long now, unsigned long long *done) {
+	fake_response_t *r;
+	unsigned long long start;
+	unsigned int n;
+
+	if(!s->in_count)
+		return(-1);
+	r = &s->in[s->in_first];
+	s->in_first = (s->in_first + 1) % FAKE_IN_MAX;
+	s->in_count--;
+	s->transfers++;
+
+	n = (len < r->len ? len : r->len);
+	memcpy(buf, r->data, n);
+	start = max_us(max_us(now, r->ready), s->in_free);
+	*done = s->in_free = start + s->usb_us + (unsigned long long)n * s->usb_ns / 1000;
+	if(r->readbuf) {
+		s->sending = buf;
+		s->sending_len = n;
+		s->sending_offset = r->offset;
+		s->sending_from = start;
+		s->sending_until = *done;
+	}
+	return(n);
+}
@@ -0,0 +1,237 @@
+/* Emulated STM8 target for the programmer tests
+ *
+ * Programming starts when a write reaches flash, EEPROM or the option bytes
+ * and ends FAKE_PROG_US or FAKE_PROG_FAST_US later, at which point EOP is
+ * set and the block mode bits in CR2/NCR2 are cleared again. Accesses are
+ * timestamped by the caller, so the target needs no clock of its own.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "fake_target.h"
+
+static bool in_range(unsigned int addr, unsigned int start, unsigned int size) {
+	return(addr >= start && addr - start < size);
+}
+
+static void fake_target_tick(fake_target_t *t, unsigned long long now) {
+	if(t->prog_end && now >= t->prog_end) {
+		t->prog_end = 0;
+		t->eop = true;
+		t->cr2 &= 0x80;
+		t->ncr2 |= 0x7f;
+	}
+}
+
+void fake_target_reset(fake_target_t *t) {
+	t->pul = t->dul = false;
+	t->pukr_state = t->dukr_state = 0;
+	t->cr2 = 0x00;
+	t->ncr2 = 0xff;
+	t->eop = t->wr_pg_dis = false;
+	t->prog_end = 0;
+	t->mem[t->device->regs.FLASH_DM_CSR2] = 0x00;
+	t->resets++;
+}
+
+void fake_target_init(fake_target_t *t, const stm8_device_t *device) {
+	unsigned int i;
+
+	memset(t, 0, sizeof(*t));
+	t->device = device;
+	// Factory option bytes: no read-out protection, complements where STM8S has them
+	if(device->read_out_protection_mode == ROP_STM8S) {
+		for(i = 1; i + 1 < device->option_bytes_size && i + 1 < FAKE_OPT_SIZE; i += 2)
+			t->mem[FAKE_OPT_START + i + 1] = 0xff;
+	}
+	fake_target_reset(t);
+	t->resets = 0;
+}
+
+static bool fake_target_fails(fake_target_t *t, unsigned int addr, unsigned int len) {
+	if(!t->fail_count || !in_range(t->fail_addr, addr, len))
+		return(false);
+	if(t->fail_skip) {
+		t->fail_skip--;
+		return(false);
+	}
+	t->fail_count--;
+	return(true);
+}
+
+bool fake_target_read(fake_target_t *t, unsigned int addr, unsigned char *buf, unsigned int len, unsigned long long now) {
+	const stm8_regs_t *r = &t->device->regs;
+	unsigned int i;
+
+	if(addr + len > FAKE_MEM_SIZE || fake_target_fails(t, addr, len))
+		return(false);
+	fake_target_tick(t, now);
+	for(i = 0; i < len; i++) {
+		unsigned int a = addr + i;
+
+		if(a == r->FLASH_IAPSR) {
+			buf[i] = (t->wr_pg_dis ? 0x01 : 0) | (t->pul ? 0x02 : 0) | (t->eop ? 0x04 : 0) |
+				(t->dul ? 0x08 : 0) | (t->prog_end ? 0 : 0x40);
+			t->eop = t->wr_pg_dis = false;
+		} else if(a == r->FLASH_CR2) {
+			buf[i] = t->cr2;
+		} else if(r->FLASH_NCR2 && a == r->FLASH_NCR2) {
+			buf[i] = t->ncr2;
+		} else if(a == FAKE_SWIM_CSR) {
+			buf[i] = t->mem[a] | 0x02; // HSIT: high speed capable
+		} else {
+			buf[i] = t->mem[a];
+		}
+	}
+	return(true);
+}
+
+static void fake_target_key(int *state, unsigned char value, unsigned char first, unsigned char second, bool *unlocked) {
+	if(*state < 0)
+		return;
+	if(*state == 0 && value == first) {
+		*state = 1;
+	} else if(*state == 1 && value == second) {
+		*state = 0;
+		*unlocked = true;
+	} else {
+		// Locked until the next reset
+		*state = -1;
+	}
+}
+
+static void fake_target_write_reg(fake_target_t *t, unsigned int a, unsigned char value) {
+	const stm8_regs_t *r = &t->device->regs;
+
+	if(a == r->FLASH_PUKR) {
+		fake_target_key(&t->pukr_state, value, 0x56, 0xae, &t->pul);
+	} else if(a == r->FLASH_DUKR) {
+		fake_target_key(&t->dukr_state, value, 0xae, 0x56, &t->dul);
+	} else if(a == r->FLASH_IAPSR) {
+		// Writing 0 to PUL or DUL locks again, writing 1 has no effect
+		if(!(value & 0x02))
+			t->pul = false;
+		if(!(value & 0x08))
+			t->dul = false;
+	} else if(a == r->FLASH_CR2) {
+		t->cr2 = value;
+	} else if(r->FLASH_NCR2 && a == r->FLASH_NCR2) {
+		t->ncr2 = value;
+	} else if(a == FAKE_SWIM_CSR) {
+		t->mem[a] = value & ~0x04;
+	} else {
+		t->mem[a] = value;
+	}
+}
+
+static bool fake_target_block_mode(fake_target_t *t) {
+	if(!(t->cr2 & 0x31))
+		return(false);
+	return(!t->device->regs.FLASH_NCR2 || t->ncr2 == (unsigned char)~t->cr2);
+}
+
+static void fake_target_program(fake_target_t *t, unsigned int addr, const unsigned char *buf, unsigned int len, bool unlocked, bool opt, unsigned long long now) {
+	unsigned int block_size = t->device->flash_block_size, i;
+
+	if(fake_target_block_mode(t)) {
+		bool fast = (t->cr2 & 0x10) != 0;
+
+		if(len != block_size || addr % block_size) {
+			t->bad_writes++;
+			return;
+		}
+		if(t->reset_after && --t->reset_after == 0) {
+			// Watchdog or brown-out: the block hits a locked flash controller
+			fake_target_reset(t);
+			unlocked = false;
+		}
+		if(!unlocked) {
+			t->wr_pg_dis = true;
+			return;
+		}
+		if(!(t->mem[t->device->regs.FLASH_DM_CSR2] & 0x08))
+			t->running_blocks++;
+		for(i = 0; i < len; i++)
+			t->mem[addr + i] = fast ? (t->mem[addr + i] | buf[i]) : buf[i];
+		t->blocks++;
+		t->bytes_programmed += len;
+		t->prog_end = now + (fast ? FAKE_PROG_FAST_US : FAKE_PROG_US);
+		return;
+	}
+
+	if(!unlocked) {
+		t->wr_pg_dis = true;
+		return;
+	}
+	if(opt && !(t->cr2 & 0x80)) {
+		t->bad_writes++;
+		return;
+	}
+	// Byte programming, one programming cycle per byte
+	for(i = 0; i < len; i++)
+		t->mem[addr + i] = buf[i];
+	t->bytes_programmed += len;
+	t->prog_end = now + len * FAKE_PROG_US;
+}
+
+bool fake_target_write(fake_target_t *t, unsigned int addr, const unsigned char *buf, unsigned int len, unsigned long long now) {
+	const stm8_device_t *d = t->device;
+	unsigned int i;
+
+	if(addr + len > FAKE_MEM_SIZE || fake_target_fails(t, addr, len))
+		return(false);
+	fake_target_tick(t, now);
+	if(t->prog_end)
+		t->busy_writes++;
+
+	if(in_range(addr, d->flash_start, d->flash_size)) {
+		bool unlocked = t->pul && !(t->protect_from && addr + len > t->protect_from);
+		fake_target_program(t, addr, buf, len, unlocked, false, now);
+	} else if(in_range(addr, d->eeprom_start, d->eeprom_size)) {
+		fake_target_program(t, addr, buf, len, t->dul, false, now);
+	} else if(in_range(addr, FAKE_OPT_START, FAKE_OPT_SIZE)) {
+		fake_target_program(t, addr, buf, len, t->dul, true, now);
+	} else {
+		for(i = 0; i < len; i++)
+			fake_target_write_reg(t, addr + i, buf[i]);
+	}
+	return(true);
+}
+
+bool fake_target_load(fake_target_t *t, const char *path) {
+	FILE *f = fopen(path, "rb");
+	size_t n;
+
+	if(!f)
+		return(false);
+	n = fread(t->mem, 1, sizeof(t->mem), f);
+	fclose(f);
+	return(n == sizeof(t->mem));
+}
+
+bool fake_target_save(fake_target_t *t, const char *path) {
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if(!f)
+		return(false);
+	ok = fwrite(t->mem, 1, sizeof(t->mem), f) == sizeof(t->mem);
+	return(fclose(f) == 0 && ok);
+}
+
+const stm8_device_t *fake_target_part(const char *name) {
+	const stm8_device_t *d;
+
+	for(d = stm8_devices; d->name; d++) {
+		if(!strcmp(d->name, name))
+			return(d);
+	}
+	return(NULL);
+}
+
+void fill_pattern(unsigned char *buf, unsigned int len, unsigned int seed) {
+	unsigned int i;
+
+	for(i = 0; i < len; i++)
+		buf[i] = (i * 7 + seed + (i >> 8)) & 0xff;
+}
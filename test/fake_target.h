@@ -0,0 +1,61 @@
+/* Emulated STM8 target for the programmer tests */
+
+#ifndef __FAKE_TARGET_H
+#define __FAKE_TARGET_H
+
+#include <stdbool.h>
+#include "stm8.h"
+
+#define FAKE_MEM_SIZE        0x28000
+#define FAKE_SWIM_CSR        0x7f80
+#define FAKE_OPT_START       0x4800
+#define FAKE_OPT_SIZE        0x80
+
+#define FAKE_PROG_US         6000 // standard block (erase and write), byte
+#define FAKE_PROG_FAST_US    3000 // fast block, no erase
+
+/* Memory, SWIM_CSR, the debug module's stall bit and the flash controller:
+ * unlock keys (a wrong key locks until reset), block and byte programming
+ * with their programming times, the IAPSR flags that are cleared on read.
+ * The counters at the end record what a correct programmer never does.
+ */
+typedef struct {
+	const stm8_device_t *device;
+	unsigned char mem[FAKE_MEM_SIZE];
+
+	// Flash controller
+	bool pul, dul;
+	int pukr_state, dukr_state; // 0 idle, 1 first key seen, -1 wrong key until reset
+	unsigned char cr2, ncr2;
+	bool eop, wr_pg_dis;
+	unsigned long long prog_end; // programming in progress until then
+
+	// Fault injection
+	unsigned int protect_from;  // flash from here on is write protected, 0 = none
+	unsigned int reset_after;   // reset by itself before this many more blocks, 0 = never
+	unsigned int fail_addr;     // accesses to this address fail fail_count times,
+	unsigned int fail_count;    // after fail_skip of them went through
+	unsigned int fail_skip;
+
+	// Statistics
+	unsigned int blocks, bytes_programmed, resets;
+
+	// Programmer bugs
+	unsigned int busy_writes;    // writes while programming was in progress
+	unsigned int running_blocks; // blocks programmed without the CPU stalled
+	unsigned int bad_writes;     // partial blocks, option bytes outside OPT mode
+} fake_target_t;
+
+void fake_target_init(fake_target_t *t, const stm8_device_t *device);
+void fake_target_reset(fake_target_t *t);
+/* Accesses at time now (us). Both return false if the SWIM access fails,
+ * which leaves the target unchanged. */
+bool fake_target_read(fake_target_t *t, unsigned int addr, unsigned char *buf, unsigned int len, unsigned long long now);
+bool fake_target_write(fake_target_t *t, unsigned int addr, const unsigned char *buf, unsigned int len, unsigned long long now);
+bool fake_target_load(fake_target_t *t, const char *path);
+bool fake_target_save(fake_target_t *t, const char *path);
+const stm8_device_t *fake_target_part(const char *name);
+/* Test data that differs per seed and between blocks */
+void fill_pattern(unsigned char *buf, unsigned int len, unsigned int seed);
+
+#endif
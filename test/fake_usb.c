@@ -0,0 +1,329 @@
+/* libusb for the tests: devices are emulated ST-Links (fake_stlink.c)
+ *
+ * Transfers are handed to the firmware when they are submitted, which
+ * tells when they complete on the emulated bus; libusb_handle_events_completed
+ * sleeps until the earliest pending transfer is due and completes it. An IN
+ * transfer that finds no response waits for one until its timeout.
+ * Everything lives in the context, so contexts in different threads are
+ * independent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fake_usb.h"
+#include "utils.h"
+
+#define FAKE_DEVS_MAX     8
+#define FAKE_PENDING_MAX  64
+
+struct libusb_device {
+	libusb_context *ctx;
+	fake_stlink_t *fw;
+};
+
+struct libusb_device_handle {
+	libusb_device *dev;
+};
+
+typedef struct {
+	struct libusb_transfer transfer; // must be first
+	unsigned long long due;          // completes then, 0 = no response yet
+	unsigned long long deadline;
+	unsigned int seq;
+	bool cancelled;
+} fake_transfer_t;
+
+struct libusb_context {
+	libusb_device devs[FAKE_DEVS_MAX];
+	unsigned int count;
+	fake_transfer_t *pending[FAKE_PENDING_MAX];
+	unsigned int npending;
+	unsigned int seq;
+	const char *image;
+};
+
+static const char * const fake_strings[] = { NULL, "STMicroelectronics", "STM32 STLink" };
+
+fake_stlink_t *fake_usb_plug(libusb_context *ctx, fake_stlink_type_t type, const stm8_device_t *part) {
+	fake_stlink_t *s;
+
+	if(ctx->count == FAKE_DEVS_MAX || !(s = malloc(sizeof(*s))))
+		return(NULL);
+	fake_stlink_init(s, type, part);
+	snprintf(s->serial, sizeof(s->serial), "FAKE%08u", ctx->count);
+	ctx->devs[ctx->count].ctx = ctx;
+	ctx->devs[ctx->count].fw = s;
+	ctx->count++;
+	return(s);
+}
+
+static void fake_usb_plug_env(libusb_context *ctx) {
+	const char *list = getenv("FAKE_STLINK"), *name = getenv("FAKE_TARGET_PART");
+	const stm8_device_t *part = fake_target_part(name ? name : "stm8s105?6");
+	char buf[64], *tok, *save;
+
+	if(!list || !part || strlen(list) >= sizeof(buf))
+		return;
+	strcpy(buf, list);
+	for(tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		fake_stlink_t *s = NULL;
+
+		if(!strcmp(tok, "v1"))
+			s = fake_usb_plug(ctx, FAKE_STLINK_V1, part);
+		else if(!strcmp(tok, "v2"))
+			s = fake_usb_plug(ctx, FAKE_STLINK_V2, part);
+		else if(!strcmp(tok, "v21"))
+			s = fake_usb_plug(ctx, FAKE_STLINK_V21, part);
+		else if(!strcmp(tok, "v3"))
+			s = fake_usb_plug(ctx, FAKE_STLINK_V3, part);
+		if(s && ctx->image && ctx->count == 1 && fake_target_load(&s->target, ctx->image))
+			fake_target_reset(&s->target);
+	}
+}
+
+int libusb_init(libusb_context **ctx) {
+	if(!(*ctx = calloc(1, sizeof(**ctx))))
+		return(LIBUSB_ERROR_NO_MEM);
+	(*ctx)->image = getenv("FAKE_TARGET_IMAGE");
+	fake_usb_plug_env(*ctx);
+	return(0);
+}
+
+void libusb_exit(libusb_context *ctx) {
+	unsigned int i;
+
+	if(!ctx)
+		return;
+	if(ctx->image && ctx->count && !fake_target_save(&ctx->devs[0].fw->target, ctx->image))
+		perror(ctx->image);
+	for(i = 0; i < ctx->count; i++)
+		free(ctx->devs[i].fw);
+	free(ctx);
+}
+
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...) { return(0); }
+void libusb_set_debug(libusb_context *ctx, int level) { }
+
+const char *libusb_error_name(int errcode) {
+	switch(errcode) {
+		case LIBUSB_SUCCESS: return("LIBUSB_SUCCESS");
+		case LIBUSB_ERROR_IO: return("LIBUSB_ERROR_IO");
+		case LIBUSB_ERROR_TIMEOUT: return("LIBUSB_ERROR_TIMEOUT");
+		case LIBUSB_ERROR_PIPE: return("LIBUSB_ERROR_PIPE");
+		case LIBUSB_ERROR_NO_MEM: return("LIBUSB_ERROR_NO_MEM");
+		case LIBUSB_ERROR_NOT_FOUND: return("LIBUSB_ERROR_NOT_FOUND");
+		default: return("LIBUSB_ERROR_OTHER");
+	}
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+	unsigned int i;
+
+	if(!(*list = calloc(ctx->count + 1, sizeof(**list))))
+		return(LIBUSB_ERROR_NO_MEM);
+	for(i = 0; i < ctx->count; i++)
+		(*list)[i] = &ctx->devs[i];
+	return(ctx->count);
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices) {
+	free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = 18;
+	desc->idVendor = 0x0483;
+	desc->idProduct = dev->fw->pid;
+	desc->iManufacturer = 1;
+	desc->iProduct = 2;
+	desc->iSerialNumber = 3;
+	return(0);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle) {
+	return(dev_handle->dev);
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle) {
+	if(!(*dev_handle = malloc(sizeof(**dev_handle))))
+		return(LIBUSB_ERROR_NO_MEM);
+	(*dev_handle)->dev = dev;
+	return(0);
+}
+
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vendor_id, uint16_t product_id) {
+	libusb_device_handle *h;
+	unsigned int i;
+
+	for(i = 0; i < ctx->count; i++) {
+		if(vendor_id == 0x0483 && product_id == ctx->devs[i].fw->pid)
+			return(libusb_open(&ctx->devs[i], &h) ? NULL : h);
+	}
+	return(NULL);
+}
+
+void libusb_close(libusb_device_handle *dev_handle) {
+	free(dev_handle);
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle, uint8_t desc_index, unsigned char *data, int length) {
+	const char *s = (desc_index == 3 ? dev_handle->dev->fw->serial :
+		desc_index < 3 ? fake_strings[desc_index] : NULL);
+	int n;
+
+	if(!s)
+		return(LIBUSB_ERROR_INVALID_PARAM);
+	n = strlen(s);
+	if(n > length)
+		n = length;
+	memcpy(data, s, n);
+	if(n < length)
+		data[n] = '\0';
+	return(n);
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number) { return(0); }
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number) { return(0); }
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number) { return(0); }
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+	fake_transfer_t *ft = calloc(1, sizeof(*ft));
+	return(ft ? &ft->transfer : NULL);
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+	free(transfer);
+}
+
+// Hands IN transfers that are still waiting to the firmware, oldest first
+static void fake_usb_serve(libusb_context *ctx, fake_stlink_t *fw, unsigned long long now) {
+	unsigned int i;
+
+	for(i = 0; i < ctx->npending; i++) {
+		fake_transfer_t *ft = ctx->pending[i];
+		struct libusb_transfer *t = &ft->transfer;
+		int n;
+
+		if(ft->due || ft->cancelled || !(t->endpoint & LIBUSB_ENDPOINT_IN) || t->dev_handle->dev->fw != fw)
+			continue;
+		if((n = fake_stlink_in(fw, t->buffer, t->length, now, &ft->due)) < 0)
+			return;
+		t->actual_length = n;
+	}
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+	fake_transfer_t *ft = (fake_transfer_t *)transfer;
+	libusb_context *ctx = transfer->dev_handle->dev->ctx;
+	fake_stlink_t *fw = transfer->dev_handle->dev->fw;
+	unsigned long long now = time_us();
+
+	if(ctx->npending == FAKE_PENDING_MAX)
+		return(LIBUSB_ERROR_BUSY);
+	ft->due = 0;
+	ft->cancelled = false;
+	ft->seq = ctx->seq++;
+	ft->deadline = now + (transfer->timeout ? transfer->timeout : 60000) * 1000ULL;
+	transfer->actual_length = 0;
+	ctx->pending[ctx->npending++] = ft;
+
+	if(transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+		fake_usb_serve(ctx, fw, now);
+	} else {
+		ft->due = fake_stlink_out(fw, transfer->buffer, transfer->length, now);
+		if(ft->due)
+			transfer->actual_length = transfer->length;
+		fake_usb_serve(ctx, fw, now);
+	}
+	return(0);
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer) {
+	fake_transfer_t *ft = (fake_transfer_t *)transfer;
+
+	ft->cancelled = true;
+	return(0);
+}
+
+static unsigned long long fake_usb_when(fake_transfer_t *ft) {
+	if(ft->cancelled)
+		return(0);
+	if(ft->due && ft->due <= ft->deadline)
+		return(ft->due);
+	return(ft->deadline);
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+	fake_transfer_t *ft;
+	struct libusb_transfer *t;
+	unsigned long long when, now;
+	unsigned int i, next = 0;
+
+	if(completed && *completed)
+		return(0);
+	if(!ctx->npending)
+		return(LIBUSB_ERROR_NOT_FOUND);
+	for(i = 1; i < ctx->npending; i++) {
+		if(fake_usb_when(ctx->pending[i]) < fake_usb_when(ctx->pending[next]))
+			next = i;
+	}
+	ft = ctx->pending[next];
+	t = &ft->transfer;
+	when = fake_usb_when(ft);
+	while((now = time_us()) < when)
+		usleep(when - now);
+
+	ctx->pending[next] = ctx->pending[--ctx->npending];
+	if(ft->cancelled) {
+		t->status = LIBUSB_TRANSFER_CANCELLED;
+	} else if(ft->due && ft->due <= ft->deadline) {
+		t->status = LIBUSB_TRANSFER_COMPLETED;
+	} else {
+		t->status = LIBUSB_TRANSFER_TIMED_OUT;
+		t->actual_length = 0;
+	}
+	t->callback(t);
+	return(0);
+}
+
+static void LIBUSB_CALL fake_usb_sync_done(struct libusb_transfer *transfer) {
+	*(int *)transfer->user_data = 1;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data, int length, int *actual_length, unsigned int timeout) {
+	struct libusb_transfer *t = libusb_alloc_transfer(0);
+	int done = 0, r;
+
+	if(!t)
+		return(LIBUSB_ERROR_NO_MEM);
+	libusb_fill_bulk_transfer(t, dev_handle, endpoint, data, length, fake_usb_sync_done, &done, timeout);
+	if((r = libusb_submit_transfer(t))) {
+		libusb_free_transfer(t);
+		return(r);
+	}
+	while(!done && libusb_handle_events_completed(dev_handle->dev->ctx, &done) == 0)
+		;
+	*actual_length = t->actual_length;
+	switch(t->status) {
+		case LIBUSB_TRANSFER_COMPLETED: r = 0; break;
+		case LIBUSB_TRANSFER_TIMED_OUT: r = LIBUSB_ERROR_TIMEOUT; break;
+		case LIBUSB_TRANSFER_STALL: r = LIBUSB_ERROR_PIPE; break;
+		default: r = LIBUSB_ERROR_IO; break;
+	}
+	libusb_free_transfer(t);
+	return(r);
+}
+
+// Only the V1 mass storage reset is used
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
+	fake_stlink_resync(dev_handle->dev->fw);
+	return(0);
+}
+
+int libusb_clear_halt(libusb_device_handle *dev_handle, unsigned char endpoint) {
+	fake_stlink_resync(dev_handle->dev->fw);
+	return(0);
+}
@@ -0,0 +1,99 @@
+/* Emulated ST-Link programmers behind the fake libusb */
+
+#ifndef __FAKE_USB_H
+#define __FAKE_USB_H
+
+#include <stdbool.h>
+#include "libusb.h"
+#include "fake_target.h"
+
+typedef enum {
+	FAKE_STLINK_V1,
+	FAKE_STLINK_V2,
+	FAKE_STLINK_V21,
+	FAKE_STLINK_V3,
+} fake_stlink_type_t;
+
+#define FAKE_IN_MAX     16   // responses waiting for an IN transfer
+#define FAKE_BUF_SIZE   8192 // largest transfer and READMEM
+
+typedef struct {
+	unsigned char data[FAKE_BUF_SIZE];
+	unsigned int len;
+	unsigned long long ready; // time the firmware has the response ready
+	bool readbuf;             // sent from the read buffer
+	unsigned int offset;      // at this offset
+} fake_response_t;
+
+/* One programmer with its target. All times are in microseconds on the
+ * time_us() clock. An OUT transfer is taken once the previous one has been,
+ * and a command that starts a SWIM operation not before the running one is
+ * done, so the host is flow controlled like by a NAKing endpoint. Each
+ * transfer costs usb_us plus usb_ns per byte, each SWIM operation
+ * FAKE_SWIM_CMD_US plus a per byte time that depends on the SWIM speed.
+ */
+typedef struct fake_stlink_s {
+	fake_stlink_type_t type;
+	unsigned int pid;
+	char serial[16];
+	unsigned int version;   // GET_VERSION word: stlink << 12 | jtag << 6 | swim
+	bool split_only;        // WRITEMEM payload must come in its own transfer
+	bool buf_offsets;       // READMEM and READBUF take a read buffer offset
+	unsigned int usb_us;
+	unsigned int usb_ns;
+	fake_target_t target;
+
+	// Firmware state
+	unsigned int mode;
+	bool high_speed;
+	unsigned char cmd[FAKE_BUF_SIZE]; // command waiting for its payload
+	unsigned int cmd_len;
+	unsigned int payload;   // payload bytes still expected
+	unsigned char readbuf[FAKE_BUF_SIZE];
+	unsigned int readbuf_len;
+	unsigned long long swim_from, swim_done;
+	unsigned int swim_byte_us;
+	int swim_status;
+	unsigned long long out_free, in_free;
+	fake_response_t in[FAKE_IN_MAX];
+	unsigned int in_first, in_count;
+	unsigned char *sending;  // READBUF data on the wire
+	unsigned int sending_len, sending_offset;
+	unsigned long long sending_from, sending_until;
+
+	// Fault injection
+	unsigned int drop_outs; // OUT transfers from now on that time out unseen
+	unsigned int full_addr, full_count; // V1: WRITEMEMs to full_addr refused with a full buffer
+	bool buffer_full;       // reported by the next V1 status read
+
+	// Statistics
+	unsigned int transfers, swim_cmds;
+	unsigned long long swim_bytes;
+	// READMEMs taken while other read buffer data was still being sent
+	unsigned int overlaps;
+	// Host bugs: a READMEM that overwrote read buffer data still being sent
+	unsigned int hazards;
+} fake_stlink_t;
+
+#define FAKE_SWIM_CMD_US 20
+#define FAKE_SWIM_BYTE_US 30 // low speed; high speed takes half
+#define FAKE_SWIM_SLOW_US 1000 // entry sequence, resets
+
+/* Adds a programmer to ctx. Programmers are also created by libusb_init
+ * from FAKE_STLINK, a comma separated list of v1, v2, v21 and v3, with the
+ * target from FAKE_TARGET_PART (default stm8s105?6) and its memory kept in
+ * the file FAKE_TARGET_IMAGE, if set. */
+fake_stlink_t *fake_usb_plug(libusb_context *ctx, fake_stlink_type_t type, const stm8_device_t *part);
+
+/* Firmware, see fake_stlink.c */
+void fake_stlink_init(fake_stlink_t *s, fake_stlink_type_t type, const stm8_device_t *part);
+/* An OUT transfer submitted at now; returns the time it completes or 0 if
+ * the programmer never takes it. */
+unsigned long long fake_stlink_out(fake_stlink_t *s, const unsigned char *buf, unsigned int len, unsigned long long now);
+/* An IN transfer submitted at now; returns the number of bytes and sets
+ * *done to the time it completes, or returns -1 if nothing is pending. */
+int fake_stlink_in(fake_stlink_t *s, unsigned char *buf, unsigned int len, unsigned long long now, unsigned long long *done);
+/* Clear halt or mass storage reset: forget partial commands and responses */
+void fake_stlink_resync(fake_stlink_t *s);
+
+#endif
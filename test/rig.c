@@ -0,0 +1,50 @@
+/* Test rig: an emulated programmer with its target on a USB context of its own */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rig.h"
+#include "stlink.h"
+#include "stlinkv2.h"
+
+static const programmer_t pgm_types[] = {
+	[FAKE_STLINK_V1] = { "stlink", STLinkV1, 0x0483, 0x3744, stlink_open, stlink_close, stlink_swim_srst,
+		stlink_swim_read_range, stlink_swim_write_range, stlink_print_stats },
+	[FAKE_STLINK_V2] = { "stlinkv2", STLinkV2, 0x0483, 0x3748, stlink2_open, stlink2_close, stlink2_srst,
+		stlink2_swim_read_range, stlink2_swim_write_range, stlink2_print_stats },
+	[FAKE_STLINK_V21] = { "stlinkv21", STLinkV21, 0x0483, 0x374b, stlink2_open, stlink2_close, stlink2_srst,
+		stlink2_swim_read_range, stlink2_swim_write_range, stlink2_print_stats },
+	[FAKE_STLINK_V3] = { "stlinkv3", STLinkV3, 0x0483, 0x374f, stlink2_open, stlink2_close, stlink2_srst,
+		stlink2_swim_read_range, stlink2_swim_write_range, stlink2_print_stats },
+};
+
+const char * const rig_type_names[] = { "V1", "V2", "V2-1", "V3" };
+
+void rig_init(rig_t *r, fake_stlink_type_t type, const char *part) {
+	memset(r, 0, sizeof(*r));
+	r->part = fake_target_part(part);
+	if(libusb_init(&r->ctx) || !(r->fw = fake_usb_plug(r->ctx, type, r->part)) || !(r->pgm = malloc(sizeof(*r->pgm)))) {
+		fprintf(stderr, "cannot set up the emulation\n");
+		exit(1);
+	}
+	r->target = &r->fw->target;
+	*r->pgm = pgm_types[type];
+	r->pgm->ctx = r->ctx;
+	r->pgm->swim_error_budget = -1;
+}
+
+bool rig_open(rig_t *r) {
+	r->pgm->dev_handle = libusb_open_device_with_vid_pid(r->ctx, r->pgm->usb_vid, r->pgm->usb_pid);
+	return(r->pgm->dev_handle && r->pgm->open(r->pgm));
+}
+
+void rig_close(rig_t *r) {
+	r->pgm->close(r->pgm);
+	libusb_close(r->pgm->dev_handle);
+	r->pgm->dev_handle = NULL;
+}
+
+void rig_free(rig_t *r) {
+	libusb_exit(r->ctx);
+	free(r->pgm);
+}
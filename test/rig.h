@@ -0,0 +1,25 @@
+/* Test rig: an emulated programmer with its target on a USB context of its own */
+
+#ifndef __RIG_H
+#define __RIG_H
+
+#include "fake_usb.h"
+#include "pgm.h"
+
+typedef struct {
+	libusb_context *ctx;
+	fake_stlink_t *fw;
+	fake_target_t *target;
+	const stm8_device_t *part;
+	programmer_t *pgm;
+} rig_t;
+
+extern const char * const rig_type_names[];
+
+/* Exits if the emulation cannot be set up */
+void rig_init(rig_t *r, fake_stlink_type_t type, const char *part);
+bool rig_open(rig_t *r);
+void rig_close(rig_t *r);
+void rig_free(rig_t *r);
+
+#endif
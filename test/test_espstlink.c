@@ -0,0 +1,426 @@
+/* esp-stlink backend and libespstlink tests against the emulated firmware */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "espstlink.h"
+#include "fake_esp.h"
+#include "libespstlink.h"
+#include "utils.h"
+
+#define FAST_BAUD 921600 // firmware rate, keeps the tests short
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+		failures++; \
+	} \
+} while(0)
+
+// The esp-stlink programmer as main.c sets it up, on the emulation's port
+static programmer_t *esp_pgm(fake_esp_t *f, unsigned int baud) {
+	programmer_t *pgm = calloc(1, sizeof(*pgm));
+
+	if(!pgm) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	pgm->name = "espstlink";
+	pgm->type = ESP_STLink;
+	pgm->open = espstlink_pgm_open;
+	pgm->close = espstlink_pgm_close;
+	pgm->reset = espstlink_srst;
+	pgm->read_range = espstlink_swim_read_range;
+	pgm->write_range = espstlink_swim_write_range;
+	pgm->print_stats = espstlink_print_stats;
+	pgm->port = f->path;
+	pgm->baud = baud;
+	pgm->swim_error_budget = -1;
+	return(pgm);
+}
+
+// Responses arriving in pieces are put together again
+static void test_read(int version, bool chunky) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(version, FAST_BAUD, false, d);
+	programmer_t *pgm = esp_pgm(f, 0);
+	unsigned int len = 8192;
+	unsigned char *buf = malloc(len);
+
+	f->chunky = chunky;
+	fill_pattern(f->target.mem + d->flash_start, len, version);
+	CHECK(pgm->open(pgm));
+	CHECK(pgm->read_range(pgm, d, buf, d->flash_start, len) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	pgm->close(pgm);
+	fake_esp_stop(f);
+	free(pgm);
+	free(buf);
+}
+
+// Block writes end up in flash without touching the target while it programs
+static void test_write(int version) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(version, FAST_BAUD, false, d);
+	programmer_t *pgm = esp_pgm(f, 0);
+	unsigned int len = 16 * d->flash_block_size + 5;
+	unsigned char *buf = malloc(len);
+
+	fill_pattern(buf, len, 3);
+	fill_pattern(f->target.mem + d->flash_start, len, 4); // not erased: standard blocks
+	CHECK(pgm->open(pgm));
+	CHECK(pgm->write_range(pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	CHECK(f->target.busy_writes == 0);
+	CHECK(f->target.bad_writes == 0);
+	pgm->close(pgm);
+	CHECK(!f->target.pul && !f->target.dul);
+	fake_esp_stop(f);
+	free(pgm);
+	free(buf);
+}
+
+// A silent device fails the command after the response timeout, not before
+static void test_timeout(void) {
+	fake_esp_t *f = fake_esp_start(1, FAST_BAUD, false, fake_target_part("stm8s105?6"));
+	espstlink_t *e = espstlink_open(f->path, NULL);
+	unsigned long long begin, us;
+
+	f->latency_us = 1500000;
+	CHECK(e != NULL);
+	begin = time_us();
+	CHECK(e && !espstlink_fetch_version(e));
+	us = time_us() - begin;
+	CHECK(e && espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_READ);
+	CHECK(us >= 400000 && us < 1000000);
+	if(e)
+		espstlink_close(e);
+	fake_esp_stop(f);
+}
+
+// Reads of 255 bytes each, one round trip at a time or queued
+static unsigned long long read_chunks(espstlink_t *e, unsigned char *buf, unsigned int addr, unsigned int len, bool queued) {
+	unsigned long long begin = time_us();
+	unsigned int i;
+
+	for(i = 0; i < len; i += 0xff) {
+		if(queued)
+			CHECK(espstlink_queue_read(e, buf + i, addr + i, 0xff));
+		else
+			CHECK(espstlink_swim_read(e, buf + i, addr + i, 0xff));
+	}
+	if(queued)
+		CHECK(espstlink_flush(e, NULL));
+	return(time_us() - begin);
+}
+
+// Queued commands go out back to back without overrunning the firmware
+static void test_pipelined(void) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(1, FAST_BAUD, false, d);
+	espstlink_t *e = espstlink_open(f->path, NULL);
+	unsigned int len = 16 * 0xff;
+	unsigned char *buf = malloc(len);
+	unsigned long long one_by_one, queued;
+
+	f->latency_us = 5000;
+	fill_pattern(f->target.mem + d->flash_start, len, 5);
+	CHECK(e && espstlink_fetch_version(e));
+	if(e) {
+		one_by_one = read_chunks(e, buf, d->flash_start, len, false);
+		CHECK(f->pipelined == 0);
+		memset(buf, 0, len);
+		queued = read_chunks(e, buf, d->flash_start, len, true);
+		CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+		CHECK(f->pipelined > 0);
+		CHECK(queued < one_by_one);
+		printf("16 reads of 255 bytes: %llu us one by one, %llu us queued\n", one_by_one, queued);
+		espstlink_close(e);
+	}
+	CHECK(f->overruns == 0);
+	CHECK(f->max_waiting <= FAKE_ESP_RX_BUF);
+	fake_esp_stop(f);
+	free(buf);
+}
+
+// A failed command in the middle of the queue: the ones before it are done
+// and the link is usable again afterwards
+static void test_queue_failure(void) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(1, FAST_BAUD, false, d);
+	espstlink_t *e = espstlink_open(f->path, NULL);
+	unsigned char data[8][16], check[16];
+	size_t done = 99;
+	unsigned int i;
+
+	f->target.fail_addr = d->ram_start + 3 * 16;
+	f->target.fail_count = 1;
+	CHECK(e && espstlink_fetch_version(e));
+	if(e) {
+		for(i = 0; i < 8; i++) {
+			fill_pattern(data[i], 16, i);
+			CHECK(espstlink_queue_write(e, data[i], d->ram_start + i * 16, 16));
+		}
+		CHECK(!espstlink_flush(e, &done));
+		CHECK(done == 3);
+		CHECK(espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_COMM);
+		CHECK(!memcmp(f->target.mem + d->ram_start, data, 3 * 16));
+		CHECK(espstlink_swim_read(e, check, d->ram_start + 16, 16));
+		CHECK(!memcmp(check, data[1], 16));
+		espstlink_close(e);
+	}
+	fake_esp_stop(f);
+}
+
+// The rate is switched where the firmware can, and kept where it can't
+static void test_baud(int version, bool bad_baud) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(version, ESPSTLINK_DEFAULT_BAUD, false, d);
+	espstlink_t *e = espstlink_open(f->path, NULL);
+	bool switched = version >= 2 && !bad_baud;
+	unsigned char buf[64];
+
+	f->bad_baud = bad_baud;
+	fill_pattern(f->target.mem + d->ram_start, sizeof(buf), 6);
+	CHECK(e && espstlink_fetch_version(e));
+	if(e) {
+		CHECK(espstlink_set_baud(e, 921600) == switched);
+		if(!switched)
+			CHECK(espstlink_get_last_error(e)->code == (version < 2 ? ESPSTLINK_ERROR_VERSION : ESPSTLINK_ERROR_BAUD));
+		CHECK(e->baud == (switched ? 921600 : ESPSTLINK_DEFAULT_BAUD));
+		CHECK(espstlink_swim_read(e, buf, d->ram_start, sizeof(buf)));
+		CHECK(!memcmp(buf, f->target.mem + d->ram_start, sizeof(buf)));
+		CHECK(!espstlink_set_baud(e, 12345));
+		CHECK(espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_BAUD);
+		espstlink_close(e);
+	}
+	CHECK(f->baud == (switched ? 921600 : ESPSTLINK_DEFAULT_BAUD));
+	CHECK(f->baud_switches == (version >= 2 ? 1 : 0));
+	fake_esp_stop(f);
+}
+
+// The driver negotiates the rate asked for and carries on without it
+static void test_baud_open(bool bad_baud) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(2, ESPSTLINK_DEFAULT_BAUD, false, d);
+	programmer_t *pgm = esp_pgm(f, 921600);
+	unsigned char buf[300];
+
+	f->bad_baud = bad_baud;
+	fill_pattern(f->target.mem + d->flash_start, sizeof(buf), 7);
+	CHECK(pgm->open(pgm));
+	CHECK(pgm->espstlink->baud == (bad_baud ? ESPSTLINK_DEFAULT_BAUD : 921600));
+	CHECK(pgm->read_range(pgm, d, buf, d->flash_start, sizeof(buf)) == (int)sizeof(buf));
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, sizeof(buf)));
+	pgm->close(pgm);
+	fake_esp_stop(f);
+	free(pgm);
+}
+
+// Commands per KB read and written through the driver, fewer with large frames
+static void test_frames(int version, double *read_cmds, double *write_cmds) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(version, FAST_BAUD, false, d);
+	programmer_t *pgm = esp_pgm(f, 0);
+	unsigned int len = 8192, commands;
+	unsigned char *buf = malloc(len);
+
+	fill_pattern(f->target.mem + d->flash_start, len, 8);
+	CHECK(pgm->open(pgm));
+	commands = f->commands;
+	CHECK(pgm->read_range(pgm, d, buf, d->flash_start, len) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	*read_cmds = (f->commands - commands) * 1024.0 / len;
+
+	fill_pattern(buf, len, 9);
+	commands = f->commands;
+	CHECK(pgm->write_range(pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	*write_cmds = (f->commands - commands) * 1024.0 / len;
+	CHECK(f->target.busy_writes == 0);
+	CHECK(f->target.bad_writes == 0);
+	pgm->close(pgm);
+	CHECK(f->overruns == 0);
+	fake_esp_stop(f);
+	free(pgm);
+	free(buf);
+}
+
+static void test_large_frames(void) {
+	double read_v1, write_v1, read_v3, write_v3;
+
+	test_frames(1, &read_v1, &write_v1);
+	test_frames(3, &read_v3, &write_v3);
+	printf("commands per KB: read %.2f, write %.2f with version 1; read %.2f, write %.2f with version 3\n",
+		read_v1, write_v1, read_v3, write_v3);
+	CHECK(read_v3 < read_v1);
+	CHECK(write_v3 < write_v1);
+}
+
+// Commands carry no more than the firmware can buffer
+static void test_frame_max(void) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(3, FAST_BAUD, false, d);
+	espstlink_t *e = espstlink_open(f->path, NULL);
+	unsigned char *buf = malloc(ESPSTLINK_FRAME_MAX + 1);
+
+	fill_pattern(f->target.mem + d->flash_start, ESPSTLINK_FRAME_MAX, 10);
+	CHECK(e && espstlink_fetch_version(e));
+	if(e) {
+		CHECK(espstlink_max_size(e) == ESPSTLINK_FRAME_MAX);
+		CHECK(espstlink_swim_read(e, buf, d->flash_start, espstlink_max_size(e)));
+		CHECK(!memcmp(buf, f->target.mem + d->flash_start, ESPSTLINK_FRAME_MAX));
+		CHECK(!espstlink_queue_read(e, buf, d->flash_start, ESPSTLINK_FRAME_MAX + 1));
+		CHECK(espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_QUEUE);
+		espstlink_close(e);
+	}
+	fake_esp_stop(f);
+	free(buf);
+}
+
+// Errors from the system come with their description
+static void test_open_error(void) {
+	espstlink_error_t error;
+
+	CHECK(espstlink_open("/nonexistent/ttyUSB0", &error) == NULL);
+	CHECK(error.code == ESPSTLINK_ERROR_OPEN);
+	CHECK(!strcmp(error.message, "Couldn't open /nonexistent/ttyUSB0: No such file or directory"));
+}
+
+// The same commands over a network link, with its larger window
+static void test_tcp(int version) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(version, FAST_BAUD, true, d);
+	programmer_t *pgm = esp_pgm(f, 0);
+	unsigned int len = 16 * d->flash_block_size;
+	unsigned char *buf = malloc(len);
+
+	fill_pattern(f->target.mem + d->flash_start, len, 11);
+	CHECK(pgm->open(pgm));
+	CHECK(pgm->espstlink->tcp && pgm->espstlink->baud == 0);
+	CHECK(!espstlink_set_baud(pgm->espstlink, 921600));
+	CHECK(espstlink_get_last_error(pgm->espstlink)->code == ESPSTLINK_ERROR_BAUD);
+	CHECK(pgm->read_range(pgm, d, buf, d->flash_start, len) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	CHECK(version >= 3 || f->pipelined > 0);
+	fill_pattern(buf, len, 12);
+	CHECK(pgm->write_range(pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	CHECK(f->target.busy_writes == 0);
+	pgm->close(pgm);
+	fake_esp_stop(f);
+	free(pgm);
+	free(buf);
+}
+
+// Addresses that cannot work fail in espstlink_open
+static void test_tcp_open_errors(void) {
+	static const char * const bad[] = { "tcp://x", "tcp://:5", "tcp://[::1]", "tcp://[]:4", "tcp://[::1]x:4", "tcp://127.0.0.1:" };
+	espstlink_error_t error;
+	unsigned int i;
+
+	for(i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		CHECK(espstlink_open(bad[i], &error) == NULL);
+		CHECK(error.code == ESPSTLINK_ERROR_OPEN);
+		CHECK(!strncmp(error.message, "Invalid address", 15));
+	}
+	// Port 1 on the loopback has no listener
+	CHECK(espstlink_open("tcp://127.0.0.1:1", &error) == NULL);
+	CHECK(error.code == ESPSTLINK_ERROR_OPEN);
+	CHECK(strstr(error.message, "refused") != NULL);
+}
+
+// A peer that went away fails the commands instead of killing the process
+static void test_tcp_closed(void) {
+	struct sockaddr_in a;
+	socklen_t len = sizeof(a);
+	char path[64];
+	unsigned char buf[16] = { 0 };
+	espstlink_t *e;
+	int l, i;
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	CHECK(l >= 0 && !bind(l, (struct sockaddr *)&a, sizeof(a)) && !listen(l, 1) &&
+		!getsockname(l, (struct sockaddr *)&a, &len));
+	snprintf(path, sizeof(path), "tcp://127.0.0.1:%d", ntohs(a.sin_port));
+	e = espstlink_open(path, NULL);
+	CHECK(e != NULL);
+	close(accept(l, NULL, NULL));
+	close(l);
+	usleep(10000);
+	for(i = 0; e && i < 3; i++) {
+		CHECK(!espstlink_swim_write(e, buf, 0, sizeof(buf)));
+		CHECK(espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_WRITE ||
+			espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_READ);
+	}
+	if(e)
+		espstlink_close(e);
+}
+
+// Payloads go over the link run-length encoded where the firmware can
+static void test_compression(int version) {
+	const stm8_device_t *d = fake_target_part("stm8s105?6");
+	fake_esp_t *f = fake_esp_start(version, FAST_BAUD, false, d);
+	programmer_t *pgm = esp_pgm(f, 0);
+	unsigned int len = 16 * d->flash_block_size;
+	unsigned char *buf = calloc(1, len);
+
+	f->chunky = true;
+	fill_pattern(buf, d->flash_block_size + 7, 13); // the rest stays zero
+	fill_pattern(f->target.mem + d->flash_start, len, 14);
+	CHECK(pgm->open(pgm));
+	CHECK(pgm->espstlink->compress == (version >= 4));
+	CHECK(f->compress == (version >= 4));
+	CHECK(pgm->write_range(pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	memset(buf, 0xff, len);
+	CHECK(pgm->read_range(pgm, d, buf, d->flash_start, len) == (int)len);
+	CHECK(!memcmp(buf, f->target.mem + d->flash_start, len));
+	if(version >= 4)
+		CHECK(pgm->espstlink->wire_bytes * 2 < pgm->espstlink->payload_bytes);
+	else
+		CHECK(pgm->espstlink->payload_bytes == 0);
+	pgm->close(pgm);
+	fake_esp_stop(f);
+	free(pgm);
+	free(buf);
+}
+
+int main(void) {
+	int v;
+
+	for(v = 1; v <= 4; v++) {
+		test_read(v, false);
+		test_read(v, true);
+		test_write(v);
+	}
+	test_timeout();
+	test_open_error();
+	test_pipelined();
+	test_queue_failure();
+	for(v = 1; v <= 2; v++)
+		test_baud(v, false);
+	test_baud(2, true);
+	test_baud_open(false);
+	test_baud_open(true);
+	test_large_frames();
+	test_frame_max();
+	for(v = 1; v <= 4; v++)
+		test_tcp(v);
+	test_tcp_open_errors();
+	test_tcp_closed();
+	for(v = 3; v <= 4; v++)
+		test_compression(v);
+	if(failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return(failures ? 1 : 0);
+}
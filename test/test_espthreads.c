@@ -0,0 +1,105 @@
+/* Several esp-stlink programmers driven through libespstlink, one thread each
+ *
+ * Every thread has its own emulated firmware and target, and writes and reads
+ * back the target's RAM a few times with queued commands. One of them fails
+ * a command on purpose; its error must stay with its own handle.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fake_esp.h"
+#include "libespstlink.h"
+
+#define THREADS 4
+#define ROUNDS  3
+#define FAILING 1 // thread whose target fails a read
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: %s: thread %u: check failed: %s\n", __FILE__, __LINE__, __func__, w->id, #cond); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while(0)
+
+typedef struct {
+	unsigned int id;
+	fake_esp_t *f;
+	pthread_t thread;
+} worker_t;
+
+// Queues the whole range in chunks of the largest size the firmware takes
+static bool transfer(espstlink_t *e, unsigned char *buf, unsigned int addr, unsigned int len, bool write) {
+	unsigned int i, n;
+
+	for(i = 0; i < len; i += n) {
+		n = (len - i < espstlink_max_size(e) ? len - i : espstlink_max_size(e));
+		if(write ? !espstlink_queue_write(e, buf + i, addr + i, n) : !espstlink_queue_read(e, buf + i, addr + i, n))
+			return(false);
+	}
+	return(espstlink_flush(e, NULL));
+}
+
+static void *worker(void *arg) {
+	worker_t *w = arg;
+	const stm8_device_t *d = w->f->target.device;
+	espstlink_error_t error;
+	espstlink_t *e = espstlink_open(w->f->path, &error);
+	unsigned int len = d->ram_size, round;
+	unsigned char *buf = malloc(len), *check = malloc(len);
+
+	CHECK(e != NULL);
+	if(!e)
+		return(NULL);
+	CHECK(espstlink_fetch_version(e));
+	CHECK(espstlink_swim_entry(e));
+	if(e->version >= 4)
+		CHECK(espstlink_set_compression(e, true));
+	for(round = 0; round < ROUNDS; round++) {
+		// A seed per thread and round, so a write to the wrong target shows
+		fill_pattern(buf, len, w->id * ROUNDS + round);
+		CHECK(transfer(e, buf, d->ram_start, len, true));
+		CHECK(transfer(e, check, d->ram_start, len, false));
+		CHECK(!memcmp(buf, check, len));
+		CHECK(!memcmp(buf, w->f->target.mem + d->ram_start, len));
+	}
+	if(w->id == FAILING) {
+		w->f->target.fail_addr = d->ram_start;
+		w->f->target.fail_count = 1;
+		CHECK(!espstlink_swim_read(e, check, d->ram_start, 8));
+		CHECK(espstlink_get_last_error(e)->code == ESPSTLINK_ERROR_COMM);
+		CHECK(espstlink_get_last_error(e)->device_code == 0xfffc);
+	} else {
+		CHECK(espstlink_get_last_error(e)->code == 0);
+	}
+	espstlink_close(e);
+	free(buf);
+	free(check);
+	return(NULL);
+}
+
+int main(int argc, char **argv) {
+	const stm8_device_t *part = fake_target_part("stm8s105?6");
+	worker_t workers[THREADS];
+	unsigned int i;
+
+	for(i = 0; i < THREADS; i++) {
+		workers[i].id = i;
+		workers[i].f = fake_esp_start(1 + i % 4, 921600, false, part);
+		if(pthread_create(&workers[i].thread, NULL, worker, &workers[i])) {
+			fprintf(stderr, "cannot start thread %u\n", i);
+			return(1);
+		}
+	}
+	for(i = 0; i < THREADS; i++) {
+		pthread_join(workers[i].thread, NULL);
+		fake_esp_stop(workers[i].f);
+	}
+	printf("%u programmers, %u rounds each\n", THREADS, ROUNDS);
+	if(failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return(failures ? 1 : 0);
+}
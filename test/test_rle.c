@@ -0,0 +1,89 @@
+/* Run-length encoding of espstlink payloads, see libespstlink.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libespstlink.h"
+
+#define ROUNDS       20000
+#define LARGE_ROUNDS 200     // payloads of up to LEN_LARGE bytes,
+#define LEN_LARGE    0x10000
+#define LEN_SMALL    600     // then short ones
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+		failures++; \
+	} \
+} while(0)
+
+static uint8_t src[LEN_LARGE], enc[ESPSTLINK_RLE_BOUND(LEN_LARGE)], dec[LEN_LARGE];
+
+// Runs of random length and value mixed with noise, like flash images
+static void fill_runs(uint8_t *buf, size_t len) {
+	size_t i = 0, j, run;
+	uint8_t value;
+
+	while(i < len) {
+		run = 1 + rand() % (rand() % 4 ? 4 : 300);
+		value = (rand() % 3 ? rand() : 0);
+		for(j = 0; j < run && i < len; j++, i++)
+			buf[i] = (rand() % 2 ? value : rand());
+	}
+}
+
+// Encoded data decodes to the original, within the bound, and truncated
+// data is refused
+static void test_roundtrip(void) {
+	unsigned int round;
+	size_t len, encoded;
+
+	srand(1);
+	for(round = 0; round < ROUNDS && !failures; round++) {
+		len = rand() % (round < LARGE_ROUNDS ? LEN_LARGE : LEN_SMALL);
+		fill_runs(src, len);
+		encoded = espstlink_rle_encode(src, len, enc);
+		CHECK(encoded <= ESPSTLINK_RLE_BOUND(len));
+		if(!len)
+			continue;
+		memset(dec, 0x55, len);
+		CHECK(espstlink_rle_decode(enc, encoded, dec, len) == encoded);
+		CHECK(!memcmp(src, dec, len));
+		CHECK(espstlink_rle_decode(enc, encoded - 1, dec, len) == 0);
+	}
+}
+
+// The extremes: nothing to compress, and nothing but one value
+static void test_limits(void) {
+	size_t i, len = 0xffff;
+
+	for(i = 0; i < len; i++)
+		src[i] = (i % 2 ? i : ~i);
+	CHECK(espstlink_rle_encode(src, len, enc) <= ESPSTLINK_RLE_BOUND(len));
+	memset(src, 0, len);
+	CHECK(espstlink_rle_encode(src, len, enc) == 2 * ((len + ESPSTLINK_RLE_RUN_MAX - 1) / ESPSTLINK_RLE_RUN_MAX));
+	CHECK(espstlink_rle_decode(enc, espstlink_rle_encode(src, len, enc), dec, len) > 0);
+	CHECK(!memcmp(src, dec, len));
+}
+
+// Tokens that would decode past the expected length are refused
+static void test_malformed(void) {
+	static const uint8_t literals[] = { 0x03, 1, 2, 3, 4 }; // 4 bytes
+	static const uint8_t run[] = { 0x82, 0xaa };           // 5 bytes
+
+	CHECK(espstlink_rle_decode(literals, sizeof(literals), dec, 4) == sizeof(literals));
+	CHECK(espstlink_rle_decode(literals, sizeof(literals), dec, 3) == 0);
+	CHECK(espstlink_rle_decode(run, sizeof(run), dec, 5) == sizeof(run));
+	CHECK(espstlink_rle_decode(run, sizeof(run), dec, 4) == 0);
+}
+
+int main(void) {
+	test_roundtrip();
+	test_limits();
+	test_malformed();
+	if(failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return(failures ? 1 : 0);
+}
@@ -0,0 +1,434 @@
+/* ST-Link backend tests against emulated programmers and targets */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rig.h"
+#include "utils.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+		failures++; \
+	} \
+} while(0)
+
+// Reads the whole flash and checks it against the target, returns the time taken
+static unsigned long long read_flash(rig_t *r, unsigned char *buf) {
+	const stm8_device_t *d = r->part;
+	unsigned long long begin = time_us(), us;
+
+	CHECK(r->pgm->read_range(r->pgm, d, buf, d->flash_start, d->flash_size) == (int)d->flash_size);
+	us = time_us() - begin;
+	CHECK(!memcmp(buf, r->target->mem + d->flash_start, d->flash_size));
+	CHECK(r->fw->hazards == 0);
+	return(us);
+}
+
+// Double buffering firmware takes the next READMEM while data is still sent, and is faster for it
+static void test_read_range(fake_stlink_type_t type) {
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char *buf;
+	unsigned long long us, seq, t;
+	int i;
+
+	rig_init(&r, type, "stm8s105?6");
+	d = r.part;
+	buf = malloc(d->flash_size);
+	fill_pattern(r.target->mem + d->flash_start, d->flash_size, type);
+	CHECK(rig_open(&r));
+	CHECK(r.pgm->double_buffer == r.fw->buf_offsets);
+
+	us = read_flash(&r, buf);
+	printf("%s: read %u bytes in %llu us, %.0f bytes/s\n", rig_type_names[type], d->flash_size, us, d->flash_size * 1e6 / us);
+	CHECK((r.fw->overlaps > 0) == r.pgm->double_buffer);
+
+	// The data of each chunk is sent while the next one is read. Best of
+	// three each, as the emulation runs on the wall clock.
+	if(r.pgm->double_buffer) {
+		seq = ~0ULL;
+		for(i = 0; i < 3; i++) {
+			r.pgm->double_buffer = false;
+			r.fw->overlaps = 0;
+			t = read_flash(&r, buf);
+			seq = (t < seq ? t : seq);
+			CHECK(r.fw->overlaps == 0);
+			r.pgm->double_buffer = true;
+			t = read_flash(&r, buf);
+			us = (t < us ? t : us);
+		}
+		printf("%s: double buffered %llu us, sequential %llu us\n", rig_type_names[type], us, seq);
+		if(r.fw->usb_ns >= 1000)
+			CHECK(us < seq);
+	}
+
+	rig_close(&r);
+	rig_free(&r);
+	free(buf);
+}
+
+// Block writes end up in flash without touching the target while it programs
+static void test_write_range(fake_stlink_type_t type) {
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char *buf;
+	unsigned int len;
+
+	rig_init(&r, type, "stm8s105?6");
+	d = r.part;
+	len = 16 * d->flash_block_size + 5;
+	buf = malloc(17 * d->flash_block_size); // padded to whole blocks like main.c does
+	fill_pattern(buf, len, 3);
+	fill_pattern(r.target->mem + d->flash_start, len, 4); // not erased: standard blocks
+	CHECK(rig_open(&r));
+	r.target->eop = true; // left over from the application's own programming
+
+	CHECK(r.pgm->write_range(r.pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+	CHECK(!memcmp(buf, r.target->mem + d->flash_start, len));
+	CHECK(r.target->busy_writes == 0);
+	CHECK(r.target->running_blocks == 0);
+	CHECK(r.target->bad_writes == 0);
+
+	rig_close(&r);
+	CHECK(!r.target->pul && !r.target->dul);
+	rig_free(&r);
+	free(buf);
+}
+
+// Unlocking an STM8L writes the ROP byte twice, the second time unchanged
+static void test_force_write(fake_stlink_type_t type) {
+	rig_t r;
+	unsigned char c = 0xaa;
+
+	rig_init(&r, type, "stm8l151?6");
+	CHECK(rig_open(&r));
+	r.pgm->force_write = true;
+
+	CHECK(r.pgm->write_range(r.pgm, r.part, &c, FAKE_OPT_START, 1, OPT) == 1);
+	CHECK(r.pgm->write_range(r.pgm, r.part, &c, FAKE_OPT_START, 1, OPT) == 1);
+	CHECK(r.target->bytes_programmed == 2);
+	CHECK(r.target->mem[FAKE_OPT_START] == 0xaa);
+
+	rig_close(&r);
+	rig_free(&r);
+}
+
+// RAM writes are retried chunk by chunk and report what reached the target
+static void test_write_ram(fake_stlink_type_t type) {
+	rig_t r;
+	unsigned char buf[1024];
+
+	rig_init(&r, type, "stm8s105?6");
+	fill_pattern(buf, sizeof(buf), 6);
+	r.target->fail_addr = 0x200;
+	r.target->fail_count = 1;
+	CHECK(rig_open(&r));
+	r.pgm->read_buf_size = 256;
+
+	CHECK(r.pgm->write_range(r.pgm, r.part, buf, 0x100, sizeof(buf), RAM) == sizeof(buf));
+	CHECK(r.target->fail_count == 0);
+	CHECK(!memcmp(buf, r.target->mem + 0x100, sizeof(buf)));
+
+	// Without retries the write stops at the failed chunk
+	r.pgm->swim_error_budget = 0;
+	r.target->fail_count = 1;
+	CHECK(r.pgm->write_range(r.pgm, r.part, buf, 0x100, sizeof(buf), RAM) == 0x100);
+
+	// Errors of earlier calls do not count against the budget
+	r.pgm->swim_error_budget = 1;
+	r.target->fail_count = 1;
+	CHECK(r.pgm->write_range(r.pgm, r.part, buf, 0x100, sizeof(buf), RAM) == sizeof(buf));
+
+	rig_close(&r);
+	rig_free(&r);
+}
+
+/* STLINK-V3 takes a RAM chunk of the whole read buffer in one frame, the
+ * full speed programmers need the header and the payload sent apart. How
+ * often the status is read depends on timing, so those transfers (command
+ * and response) are not counted. */
+static unsigned int ram_write_transfers(fake_stlink_type_t type) {
+	rig_t r;
+	unsigned char buf[2048];
+	unsigned int transfers, polls;
+
+	rig_init(&r, type, "stm8s105?6");
+	fill_pattern(buf, sizeof(buf), 7);
+	CHECK(rig_open(&r));
+	CHECK(r.pgm->single_frame);
+	transfers = r.pgm->usb_transfers;
+	polls = r.pgm->status_polls;
+	CHECK(r.pgm->write_range(r.pgm, r.part, buf, 0, sizeof(buf), RAM) == sizeof(buf));
+	CHECK(!memcmp(buf, r.target->mem, sizeof(buf)));
+	transfers = r.pgm->usb_transfers - transfers - 2 * (r.pgm->status_polls - polls);
+	rig_close(&r);
+	rig_free(&r);
+	return(transfers);
+}
+
+static void test_ram_frames(void) {
+	CHECK(ram_write_transfers(FAKE_STLINK_V3) < ram_write_transfers(FAKE_STLINK_V2));
+}
+
+/* A target that resets itself halfway through a write comes back running
+ * and locked: the stall bit must be set and the flash unlocked again. */
+static void test_target_reset(fake_stlink_type_t type) {
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char *buf;
+	unsigned int len;
+
+	rig_init(&r, type, "stm8s105?6");
+	d = r.part;
+	len = 6 * d->flash_block_size;
+	buf = malloc(len);
+	fill_pattern(buf, len, 5);
+	r.target->reset_after = 3;
+	CHECK(rig_open(&r));
+
+	CHECK(r.pgm->write_range(r.pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+	CHECK(r.target->resets == 1);
+	CHECK(r.target->running_blocks == 0);
+	CHECK(!memcmp(buf, r.target->mem + d->flash_start, len));
+
+	rig_close(&r);
+	rig_free(&r);
+	free(buf);
+}
+
+/* Firmware that wants the WRITEMEM payload in a transfer of its own is
+ * either not probed (old SWIM version) or detected by the probe, which must
+ * neither fail the connection nor leave the RAM it used changed. */
+static void test_split_framing(fake_stlink_type_t type) {
+	static const unsigned int swim_versions[] = { 6, 7 };
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char ram[16], buf[256];
+	unsigned int i;
+
+	for(i = 0; i < sizeof(swim_versions) / sizeof(swim_versions[0]); i++) {
+		rig_init(&r, type, "stm8s105?6");
+		d = r.part;
+		r.fw->split_only = true;
+		r.fw->version = (r.fw->version & ~0x3f) | swim_versions[i];
+		fill_pattern(ram, sizeof(ram), 11);
+		memcpy(r.target->mem, ram, sizeof(ram));
+		fill_pattern(buf, sizeof(buf), 12);
+		CHECK(rig_open(&r));
+		CHECK(!r.pgm->single_frame);
+		CHECK(!memcmp(r.target->mem, ram, sizeof(ram)));
+
+		CHECK(r.pgm->write_range(r.pgm, d, buf, d->flash_start, sizeof(buf), FLASH) == sizeof(buf));
+		CHECK(!memcmp(buf, r.target->mem + d->flash_start, sizeof(buf)));
+		CHECK(r.pgm->write_range(r.pgm, d, buf, 0x100, sizeof(buf), RAM) == sizeof(buf));
+		CHECK(!memcmp(buf, r.target->mem + 0x100, sizeof(buf)));
+
+		rig_close(&r);
+		rig_free(&r);
+	}
+}
+
+/* A SWIM error on one queued command is noticed although later commands
+ * succeed, and only the failed command is sent again: replaying the first
+ * unlock key would lock the flash until reset. */
+static void test_write_errors(fake_stlink_type_t type) {
+	static const struct {
+		const char *what;
+		int reg;              // fail at FLASH_PUKR if set, else in the second block
+		unsigned int skip;
+	} cases[] = {
+		{ "first key", 1, 0 },
+		{ "second key", 1, 1 },
+		{ "block data", 0, 1 },   // after the read for the diff
+	};
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char *buf;
+	unsigned int len, i;
+	int before;
+
+	for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		before = failures;
+		rig_init(&r, type, "stm8s105?6");
+		d = r.part;
+		len = 4 * d->flash_block_size;
+		buf = malloc(len);
+		fill_pattern(buf, len, i);
+		r.target->fail_addr = cases[i].reg ? d->regs.FLASH_PUKR : d->flash_start + d->flash_block_size;
+		r.target->fail_skip = cases[i].skip;
+		r.target->fail_count = 1;
+		CHECK(rig_open(&r));
+
+		CHECK(r.pgm->write_range(r.pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+		CHECK(r.target->fail_count == 0);
+		CHECK(r.target->pukr_state == 0);
+		CHECK(!memcmp(buf, r.target->mem + d->flash_start, len));
+		if(failures != before)
+			fprintf(stderr, "%s: SWIM error on %s\n", rig_type_names[type], cases[i].what);
+
+		rig_close(&r);
+		rig_free(&r);
+		free(buf);
+	}
+}
+
+// A full capability cache drops its oldest entries to take a new one
+static void test_cache_full(void) {
+	char path[] = "/tmp/stm8flash-cache-XXXXXX", line[256], first[256], last[256];
+	unsigned int i, lines = 0;
+	rig_t r;
+	FILE *f;
+	int fd;
+
+	CHECK((fd = mkstemp(path)) >= 0 && (f = fdopen(fd, "w")));
+	for(i = 0; i < 70; i++)
+		fprintf(f, "OTHER%03u 2747 6144 0100000000000000 1\n", i);
+	fclose(f);
+
+	rig_init(&r, FAKE_STLINK_V2, "stm8s105?6");
+	r.pgm->cache_file = path;
+	CHECK(rig_open(&r));
+	rig_close(&r);
+	rig_free(&r);
+
+	CHECK((f = fopen(path, "r")));
+	while(fgets(line, sizeof(line), f))
+		strcpy(lines++ ? last : first, line);
+	fclose(f);
+	unlink(path);
+	CHECK(lines == 64);
+	CHECK(!strncmp(first, "OTHER007 ", 9));
+	CHECK(!strncmp(last, "46414B45", 8)); // "FAKE", as the hex serial number
+}
+
+/* V1 unlocks with the keys alone and locks by clearing PUL and DUL, so
+ * unlocking the flash keeps the EEPROM unlocked and closing locks both. */
+static void test_v1_unlock(void) {
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char flash[256], eeprom[128];
+
+	rig_init(&r, FAKE_STLINK_V1, "stm8s105?6");
+	d = r.part;
+	CHECK(rig_open(&r));
+
+	fill_pattern(eeprom, sizeof(eeprom), 7);
+	CHECK(r.pgm->write_range(r.pgm, d, eeprom, d->eeprom_start, sizeof(eeprom), EEPROM) == sizeof(eeprom));
+	fill_pattern(flash, sizeof(flash), 8);
+	CHECK(r.pgm->write_range(r.pgm, d, flash, d->flash_start, sizeof(flash), FLASH) == sizeof(flash));
+	fill_pattern(eeprom, sizeof(eeprom), 9);
+	CHECK(r.pgm->write_range(r.pgm, d, eeprom, d->eeprom_start, sizeof(eeprom), EEPROM) == sizeof(eeprom));
+	CHECK(!memcmp(flash, r.target->mem + d->flash_start, sizeof(flash)));
+	CHECK(!memcmp(eeprom, r.target->mem + d->eeprom_start, sizeof(eeprom)));
+	CHECK(r.target->busy_writes == 0);
+	CHECK(r.target->bad_writes == 0);
+	CHECK(r.target->running_blocks == 0);
+
+	// A write protected page stops the write at its block
+	r.target->protect_from = d->flash_start + d->flash_block_size;
+	fill_pattern(flash, sizeof(flash), 10);
+	CHECK(r.pgm->write_range(r.pgm, d, flash, d->flash_start, sizeof(flash), FLASH) == d->flash_block_size);
+
+	rig_close(&r);
+	CHECK(!r.target->pul && !r.target->dul);
+	rig_free(&r);
+}
+
+/* ST-Link V1 reports a failed command with the busy bit, which must not be
+ * taken for success, nor waited on until the poll times out: its status no
+ * longer changes. Reads resume and blocks are written again after a few
+ * errors; a persistent one fails the write. */
+static void test_v1_swim_error(void) {
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char flash[128], *buf;
+	unsigned long long begin;
+
+	rig_init(&r, FAKE_STLINK_V1, "stm8s105?6");
+	d = r.part;
+	buf = malloc(d->flash_size);
+	fill_pattern(r.target->mem + d->flash_start, d->flash_size, 14);
+	fill_pattern(flash, sizeof(flash), 11);
+	CHECK(rig_open(&r));
+
+	r.target->fail_addr = d->flash_start + 3 * 6144 + 5;
+	r.target->fail_count = 2;
+	begin = time_us();
+	CHECK(r.pgm->read_range(r.pgm, d, buf, d->flash_start, d->flash_size) == (int)d->flash_size);
+	CHECK(time_us() - begin < 1000000);
+	CHECK(!memcmp(buf, r.target->mem + d->flash_start, d->flash_size));
+	CHECK(r.pgm->read_retries == 2);
+
+	r.target->fail_addr = d->regs.FLASH_CR2;
+	r.target->fail_count = 2;
+	CHECK(r.pgm->write_range(r.pgm, d, flash, d->flash_start, sizeof(flash), FLASH) == sizeof(flash));
+	CHECK(!memcmp(flash, r.target->mem + d->flash_start, sizeof(flash)));
+	CHECK(r.pgm->block_retries == 2);
+
+	// Without block mode the block would be byte programmed
+	fill_pattern(flash, sizeof(flash), 15);
+	r.target->bytes_programmed = 0;
+	r.target->fail_count = 100;
+	CHECK(r.pgm->write_range(r.pgm, d, flash, d->flash_start, sizeof(flash), FLASH) == 0);
+	CHECK(r.target->bytes_programmed == 0);
+
+	rig_close(&r);
+	rig_free(&r);
+	free(buf);
+}
+
+/* ST-Link V1 refuses a byte write with a full buffer status, without the
+ * error bit. The write is repeated a few times, and then fails. */
+static void test_v1_buffer_full(void) {
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char flash[128];
+
+	rig_init(&r, FAKE_STLINK_V1, "stm8s105?6");
+	d = r.part;
+	fill_pattern(flash, sizeof(flash), 12);
+	CHECK(rig_open(&r));
+
+	r.fw->full_addr = d->regs.FLASH_CR2;
+	r.fw->full_count = 2;
+	CHECK(r.pgm->write_range(r.pgm, d, flash, d->flash_start, sizeof(flash), FLASH) == sizeof(flash));
+	CHECK(!memcmp(flash, r.target->mem + d->flash_start, sizeof(flash)));
+
+	fill_pattern(flash, sizeof(flash), 13);
+	r.target->bytes_programmed = 0;
+	r.fw->full_count = 100;
+	CHECK(r.pgm->write_range(r.pgm, d, flash, d->flash_start, sizeof(flash), FLASH) == 0);
+	CHECK(r.target->bytes_programmed == 0);
+
+	rig_close(&r);
+	rig_free(&r);
+}
+
+int main(int argc, char **argv) {
+	fake_stlink_type_t type;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	for(type = FAKE_STLINK_V2; type <= FAKE_STLINK_V3; type++) {
+		test_read_range(type);
+		test_write_range(type);
+		test_write_errors(type);
+		test_target_reset(type);
+		test_write_ram(type);
+		test_force_write(type);
+	}
+	test_split_framing(FAKE_STLINK_V2);
+	test_read_range(FAKE_STLINK_V1);
+	test_v1_unlock();
+	test_force_write(FAKE_STLINK_V1);
+	test_v1_swim_error();
+	test_v1_buffer_full();
+	test_cache_full();
+	test_ram_frames();
+	if(failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return(failures ? 1 : 0);
+}
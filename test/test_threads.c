@@ -0,0 +1,84 @@
+/* Several programmers driven from one process, one thread each
+ *
+ * Every thread has its own USB context, programmer and target and writes,
+ * reads back and rewrites the flash a few times. Any state shared between
+ * programmer_t instances shows up as data going to the wrong target or as
+ * corrupted transfers.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rig.h"
+
+#define THREADS 8
+#define ROUNDS  3
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: %s: thread %u: check failed: %s\n", __FILE__, __LINE__, __func__, w->id, #cond); \
+		__sync_fetch_and_add(&failures, 1); \
+	} \
+} while(0)
+
+typedef struct {
+	unsigned int id;
+	fake_stlink_type_t type;
+	pthread_t thread;
+} worker_t;
+
+static void *worker(void *arg) {
+	worker_t *w = arg;
+	rig_t r;
+	const stm8_device_t *d;
+	unsigned char *buf, *check;
+	unsigned int len, round;
+
+	rig_init(&r, w->type, "stm8s105?6");
+	d = r.part;
+	len = 8 * d->flash_block_size + w->id;
+	buf = malloc(9 * d->flash_block_size); // padded to whole blocks like main.c does
+	check = malloc(len);
+	CHECK(rig_open(&r));
+
+	for(round = 0; round < ROUNDS; round++) {
+		// A seed per thread and round, so a write to the wrong target shows
+		fill_pattern(buf, len, w->id * ROUNDS + round);
+		CHECK(r.pgm->write_range(r.pgm, d, buf, d->flash_start, len, FLASH) == (int)len);
+		CHECK(r.pgm->read_range(r.pgm, d, check, d->flash_start, len) == (int)len);
+		CHECK(!memcmp(buf, check, len));
+		CHECK(!memcmp(buf, r.target->mem + d->flash_start, len));
+	}
+	CHECK(r.fw->hazards == 0);
+	CHECK(r.target->busy_writes == 0);
+
+	rig_close(&r);
+	rig_free(&r);
+	free(buf);
+	free(check);
+	return(NULL);
+}
+
+int main(int argc, char **argv) {
+	static const fake_stlink_type_t types[] = { FAKE_STLINK_V2, FAKE_STLINK_V21, FAKE_STLINK_V3, FAKE_STLINK_V1 };
+	worker_t workers[THREADS];
+	unsigned int i;
+
+	for(i = 0; i < THREADS; i++) {
+		workers[i].id = i;
+		workers[i].type = types[i % (sizeof(types) / sizeof(types[0]))];
+		if(pthread_create(&workers[i].thread, NULL, worker, &workers[i])) {
+			fprintf(stderr, "cannot start thread %u\n", i);
+			return(1);
+		}
+	}
+	for(i = 0; i < THREADS; i++)
+		pthread_join(workers[i].thread, NULL);
+	printf("%u programmers, %u rounds each\n", THREADS, ROUNDS);
+	if(failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return(failures ? 1 : 0);
+}
@@ -1,10 +1,19 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <time.h>
+
 #if DEBUG
 #define DEBUG_PRINT(...) do{ fprintf( stderr, __VA_ARGS__ ); fflush(stderr); } while( false )
 #else
 #define DEBUG_PRINT(...) do{ } while ( false )
 #endif
 
+// Monotonic time in microseconds, for timeouts and statistics
+static inline unsigned long long time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #endif